@@ -0,0 +1,449 @@
+/**
+ * Microbenchmarks for the routing core of the vnic module, built in userspace against
+ * vnic_core.c. Measures lookups in the IP table at a range of sizes and load factors,
+ * the probe lengths the hash gives, how tombstones build up under churn, lookups in the
+ * forwarding table, and parsing of the addresses given on the command line.
+ *
+ * Usage: core_bench [-j] [-s seed]
+ *     -j    print the results as JSON, for comparing runs
+ *     -s    seed for the random addresses, so that runs can be repeated
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vnic_core.h"
+
+#define LOOKUP_ROUNDS 2000000
+#define PARSE_ROUNDS 2000000
+// Each entry is removed and a new one added this many times over in the churn test
+#define CHURN_FACTOR 4
+
+static int json;
+static int first_result = 1;
+// Stops the compiler from optimising the measured work away
+static volatile uintptr_t sink;
+
+/**
+ * Fast xorshift generator, so that generating addresses does not dominate the timings
+ */
+static uint64_t rng_state = 88172645463325252ULL;
+
+static u32 rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (u32)(rng_state >> 32);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_ints(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * Fills addrs with count distinct random addresses. Address 0 is never used, so that it
+ * can stand in for a miss
+ */
+static void random_addrs(u32 *addrs, int count) {
+    struct vnic_ip_table *seen = vnic_ip_table_alloc(count);
+    int i = 0;
+
+    while (i < count) {
+        u32 addr = rng_next();
+
+        if (addr && !vnic_ip_table_lookup(seen, addr, NULL)) {
+            vnic_ip_table_insert(seen, addr, (void *)(uintptr_t)(i + 2));
+            addrs[i++] = addr;
+        }
+    }
+    vnic_ip_table_free(seen);
+}
+
+static void shuffle(u32 *addrs, int count) {
+    int i, j;
+    u32 tmp;
+
+    for (i = count - 1; i > 0; i--) {
+        j = rng_next() % (i + 1);
+        tmp = addrs[i];
+        addrs[i] = addrs[j];
+        addrs[j] = tmp;
+    }
+}
+
+/**
+ * Adds an entry the way the module does, growing the table first if the resize policy
+ * asks for it. Returns the table, which may have been replaced
+ */
+static struct vnic_ip_table *table_add(struct vnic_ip_table *table, u32 addr, void *value) {
+    int entries = vnic_ip_table_resize_hint(table, true);
+
+    if (entries) {
+        struct vnic_ip_table *new_table = vnic_ip_table_alloc(entries);
+
+        vnic_ip_table_copy(new_table, table);
+        vnic_ip_table_free(table);
+        table = new_table;
+    }
+    vnic_ip_table_insert(table, addr, value);
+    return table;
+}
+
+static struct vnic_ip_table *table_remove(struct vnic_ip_table *table, u32 addr) {
+    int entries;
+
+    if (vnic_ip_table_remove(table, addr) && (entries = vnic_ip_table_resize_hint(table, false))) {
+        struct vnic_ip_table *new_table = vnic_ip_table_alloc(entries);
+
+        vnic_ip_table_copy(new_table, table);
+        vnic_ip_table_free(table);
+        table = new_table;
+    }
+    return table;
+}
+
+/**
+ * ===============================================================
+ *                           Reporting
+ * ===============================================================
+ */
+
+struct probe_stats {
+    double mean;
+    int p50, p90, p99, max;
+};
+
+/**
+ * Looks up each of addrs once, recording the number of slots probed for each
+ */
+static struct probe_stats measure_probes(struct vnic_ip_table *table, u32 *addrs, int count) {
+    struct probe_stats stats;
+    int *probes = malloc(sizeof(int) * count);
+    long total = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        vnic_ip_table_lookup(table, addrs[i], &probes[i]);
+        total += probes[i];
+    }
+    qsort(probes, count, sizeof(int), compare_ints);
+    stats.mean = (double)total / count;
+    stats.p50 = probes[count / 2];
+    stats.p90 = probes[(int)(count * 0.9)];
+    stats.p99 = probes[(int)(count * 0.99)];
+    stats.max = probes[count - 1];
+    free(probes);
+    return stats;
+}
+
+/**
+ * Returns lookups per second over rounds lookups of addrs, cycling through them
+ */
+static double measure_lookups(struct vnic_ip_table *table, u32 *addrs, int count, int rounds) {
+    uintptr_t found = 0;
+    double start;
+    int i, j = 0;
+
+    start = now_ns();
+    for (i = 0; i < rounds; i++) {
+        found += (uintptr_t)vnic_ip_table_lookup(table, addrs[j], NULL);
+        if (++j == count) {
+            j = 0;
+        }
+    }
+    sink = found;
+    return rounds / ((now_ns() - start) / 1e9);
+}
+
+static void begin_result(const char *name) {
+    if (json) {
+        printf("%s\n    {\"test\": \"%s\"", first_result ? "" : ",", name);
+        first_result = 0;
+    } else {
+        printf("%-8s", name);
+    }
+}
+
+static void report_int(const char *key, long value) {
+    if (json) {
+        printf(", \"%s\": %ld", key, value);
+    } else {
+        printf("  %s=%ld", key, value);
+    }
+}
+
+static void report_double(const char *key, double value) {
+    if (json) {
+        printf(", \"%s\": %.3f", key, value);
+    } else {
+        printf("  %s=%.3g", key, value);
+    }
+}
+
+static void report_probes(const char *prefix, struct probe_stats *stats) {
+    char key[32];
+
+    snprintf(key, sizeof(key), "%s_probes_mean", prefix);
+    report_double(key, stats->mean);
+    snprintf(key, sizeof(key), "%s_probes_p50", prefix);
+    report_int(key, stats->p50);
+    snprintf(key, sizeof(key), "%s_probes_p90", prefix);
+    report_int(key, stats->p90);
+    snprintf(key, sizeof(key), "%s_probes_p99", prefix);
+    report_int(key, stats->p99);
+    snprintf(key, sizeof(key), "%s_probes_max", prefix);
+    report_int(key, stats->max);
+}
+
+static void end_result(void) {
+    if (json) {
+        printf("}");
+    } else {
+        printf("\n");
+    }
+}
+
+/**
+ * ===============================================================
+ *                           Benchmarks
+ * ===============================================================
+ */
+
+/**
+ * Builds a table of count entries as the module does when vnics are added one at a time,
+ * then measures lookups that hit and lookups that miss. The table is then churned by
+ * removing entries and adding new ones, leaving tombstones behind, and measured again.
+ */
+static void bench_size(int count) {
+    struct vnic_ip_table *table = vnic_ip_table_alloc(0);
+    u32 *addrs = malloc(sizeof(u32) * count * (CHURN_FACTOR + 3));
+    u32 *live = addrs;
+    u32 *misses = addrs + count;
+    u32 *replacements = addrs + count * 2;
+    u32 *churn_misses = addrs + count * (CHURN_FACTOR + 2);
+    struct probe_stats hit_stats, miss_stats;
+    int i;
+
+    random_addrs(addrs, count * (CHURN_FACTOR + 3));
+    for (i = 0; i < count; i++) {
+        table = table_add(table, addrs[i], (void *)(uintptr_t)(i + 2));
+    }
+
+    begin_result("size");
+    report_int("entries", count);
+    report_int("slots", table->len);
+    report_double("load", (double)table->count / table->len);
+    report_double("used", (double)table->used / table->len);
+    shuffle(live, count);
+    hit_stats = measure_probes(table, live, count);
+    miss_stats = measure_probes(table, misses, count);
+    report_double("hit_lookups_per_sec", measure_lookups(table, live, count, LOOKUP_ROUNDS));
+    report_double("miss_lookups_per_sec", measure_lookups(table, misses, count, LOOKUP_ROUNDS));
+    report_probes("hit", &hit_stats);
+    report_probes("miss", &miss_stats);
+    end_result();
+
+    // Replace a random live entry with a fresh address, CHURN_FACTOR times per entry
+    for (i = 0; i < count * CHURN_FACTOR; i++) {
+        int victim = rng_next() % count;
+
+        table = table_remove(table, live[victim]);
+        live[victim] = replacements[i];
+        table = table_add(table, live[victim], (void *)(uintptr_t)(victim + 2));
+    }
+
+    begin_result("churn");
+    report_int("entries", table->count);
+    report_int("slots", table->len);
+    report_double("load", (double)table->count / table->len);
+    report_double("used", (double)table->used / table->len);
+    shuffle(live, count);
+    hit_stats = measure_probes(table, live, count);
+    miss_stats = measure_probes(table, churn_misses, count);
+    report_double("hit_lookups_per_sec", measure_lookups(table, live, count, LOOKUP_ROUNDS));
+    report_double("miss_lookups_per_sec", measure_lookups(table, churn_misses, count, LOOKUP_ROUNDS));
+    report_probes("hit", &hit_stats);
+    report_probes("miss", &miss_stats);
+    end_result();
+
+    vnic_ip_table_free(table);
+    free(addrs);
+}
+
+/**
+ * Fills a table of a fixed size to each load factor in turn, without resizing, to show
+ * how probe lengths grow as the table fills beyond what the resize policy allows
+ */
+static void bench_load_factor(void) {
+    const int slots = 1 << 16;
+    u32 *addrs = malloc(sizeof(u32) * slots * 2);
+    struct probe_stats hit_stats, miss_stats;
+    int tenths, count;
+
+    random_addrs(addrs, slots * 2);
+    for (tenths = 1; tenths <= 9; tenths++) {
+        struct vnic_ip_table *table = vnic_ip_table_alloc((slots - 1) * 2 / 3);
+        int i;
+
+        count = slots * tenths / 10;
+        for (i = 0; i < count; i++) {
+            vnic_ip_table_insert(table, addrs[i], (void *)(uintptr_t)(i + 2));
+        }
+
+        begin_result("load");
+        report_int("entries", count);
+        report_int("slots", table->len);
+        report_double("load", (double)table->count / table->len);
+        hit_stats = measure_probes(table, addrs, count);
+        miss_stats = measure_probes(table, addrs + slots, count);
+        report_double("hit_lookups_per_sec", measure_lookups(table, addrs, count, LOOKUP_ROUNDS));
+        report_double("miss_lookups_per_sec",
+                      measure_lookups(table, addrs + slots, count, LOOKUP_ROUNDS));
+        report_probes("hit", &hit_stats);
+        report_probes("miss", &miss_stats);
+        end_result();
+        vnic_ip_table_free(table);
+    }
+    free(addrs);
+}
+
+/**
+ * Builds forwarding tables of random routes, mostly /16 to /24 as in real tables, and
+ * measures longest prefix matches of random addresses against them
+ */
+static void bench_routes(void) {
+    static const int counts[] = {10, 1000, 100000};
+    static const int lengths[] = {8, 12, 16, 16, 20, 22, 24, 24, 24, 24, 28, 32};
+    const int lookups = 1 << 16;
+    struct vnic_route *routes;
+    struct vnic_lpm *lpm;
+    u32 *addrs = malloc(sizeof(u32) * lookups);
+    uintptr_t found, matched;
+    double start, build_ns;
+    int c, i, j;
+
+    for (c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++) {
+        routes = malloc(sizeof(struct vnic_route) * counts[c]);
+        for (i = 0; i < counts[c]; i++) {
+            // Keep the routes within 10.0.0.0/8, so that most lookups walk several levels
+            routes[i].prefix = 0x0a000000 | (rng_next() & 0x00ffffff);
+            routes[i].prefix_len = lengths[rng_next() % (sizeof(lengths) / sizeof(lengths[0]))];
+            routes[i].value = (void *)(uintptr_t)(i + 1);
+        }
+        routes[0].prefix_len = 8;
+
+        start = now_ns();
+        lpm = vnic_lpm_build(routes, counts[c]);
+        build_ns = now_ns() - start;
+        for (i = 0; i < lookups; i++) {
+            addrs[i] = 0x0a000000 | (rng_next() & 0x00ffffff);
+        }
+
+        matched = 0;
+        for (i = 0; i < lookups; i++) {
+            matched += vnic_lpm_lookup(lpm, addrs[i]) != NULL;
+        }
+        found = 0;
+        start = now_ns();
+        for (i = 0, j = 0; i < LOOKUP_ROUNDS; i++) {
+            found += (uintptr_t)vnic_lpm_lookup(lpm, addrs[j]);
+            j = (j + 1) & (lookups - 1);
+        }
+        sink = found;
+
+        begin_result("routes");
+        report_int("routes", counts[c]);
+        report_int("nodes", lpm->node_count);
+        report_int("bytes", (long)(sizeof(struct vnic_route) * counts[c] +
+                                   sizeof(u32[VNIC_LPM_FANOUT]) * lpm->node_count));
+        report_double("build_ms", build_ns / 1e6);
+        report_double("lookups_per_sec", LOOKUP_ROUNDS / ((now_ns() - start) / 1e9));
+        report_double("matched", (double)matched / lookups);
+        end_result();
+        vnic_lpm_free(lpm);
+        free(routes);
+    }
+    free(addrs);
+}
+
+/**
+ * Measures parsing of addresses in the form they are given to the module parameters
+ */
+static void bench_parse(void) {
+    static const char *ips[] = {"10.0.0.1", "192.168.100.200", "172.16.5.34", "1.2.3.4"};
+    static const char *macs[] = {"00:00:00:00:00:01", "de:ad:be:ef:00:42",
+                                 "02-1A-2B-3C-4D-5E", "ff:ff:ff:ff:ff:fe"};
+    size_t ip_lens[4], mac_lens[4];
+    uintptr_t total = 0;
+    double start;
+    u32 ip_addr;
+    u8 mac[6];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        ip_lens[i] = strlen(ips[i]);
+        mac_lens[i] = strlen(macs[i]);
+    }
+
+    start = now_ns();
+    for (i = 0; i < PARSE_ROUNDS; i++) {
+        total += vnic_parse_ip(ips[i & 3], ip_lens[i & 3], &ip_addr);
+        total += ip_addr;
+    }
+    begin_result("parse");
+    report_double("ips_per_sec", PARSE_ROUNDS / ((now_ns() - start) / 1e9));
+
+    start = now_ns();
+    for (i = 0; i < PARSE_ROUNDS; i++) {
+        total += vnic_parse_mac(macs[i & 3], mac_lens[i & 3], mac);
+        total += mac[5];
+    }
+    report_double("macs_per_sec", PARSE_ROUNDS / ((now_ns() - start) / 1e9));
+    end_result();
+    sink = total;
+}
+
+int main(int argc, char **argv) {
+    static const int sizes[] = {10, 100, 1000, 10000, 100000};
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "js:")) != -1) {
+        switch (opt) {
+        case 'j':
+            json = 1;
+            break;
+        case 's':
+            rng_state = strtoull(optarg, NULL, 0) | 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-j] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (json) {
+        printf("{\"results\": [");
+    }
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        bench_size(sizes[i]);
+    }
+    bench_load_factor();
+    bench_routes();
+    bench_parse();
+    if (json) {
+        printf("\n]}\n");
+    }
+    return 0;
+}
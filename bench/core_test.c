@@ -0,0 +1,202 @@
+/**
+ * Tests for the routing core of the vnic module, built in userspace against vnic_core.c.
+ * Checks that the timing wheel returns every entry in the tick it is due, however the
+ * due tick and the clock fall across the turns of its levels, including the turn of the
+ * top level, which the clock comes round to about every 73 minutes.
+ *
+ * Usage: core_test [-s seed]
+ *     -s    seed for the random due ticks, so that runs can be repeated
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vnic_core.h"
+
+#define WHEEL_ENTRIES 4096
+// Ticks of one turn of the top level of the wheel
+#define WHEEL_TURN (1ULL << (VNIC_WHEEL_LEVELS * VNIC_WHEEL_BITS))
+
+static int failures;
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static u64 rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void fail(const char *test, const char *fmt, unsigned long long a, unsigned long long b) {
+    printf("FAIL %s: ", test);
+    printf(fmt, a, b);
+    printf("\n");
+    failures++;
+}
+
+/**
+ * Runs the wheel as the timer of a link does, from one tick which needs handling to the
+ * next, until it is empty. Checks that each entry comes out in exactly the tick it is due,
+ * or in the first one if it was due before the clock started.
+ * Returns the number of entries which came out
+ */
+static int drain(const char *test, struct vnic_wheel *wheel, u64 start) {
+    struct vnic_wheel_entry *entry;
+    u64 prev = start, now;
+    int returned = 0;
+
+    while ((now = vnic_wheel_next(wheel)) != U64_MAX) {
+        if (now < prev) {
+            fail(test, "next tick %llx is before the last one, %llx", now, prev);
+            return returned;
+        }
+        for (entry = vnic_wheel_run(wheel, now); entry; entry = entry->next) {
+            if ((entry->due < start ? start : entry->due) != now) {
+                fail(test, "entry due in %llx came out in %llx", entry->due, now);
+            }
+            returned++;
+        }
+        prev = now + 1;
+    }
+    return returned;
+}
+
+/**
+ * Fills a wheel whose clock starts at start with entries due from min_ahead to max_ahead
+ * ticks later, and drains it
+ */
+static void test_range(const char *test, u64 start, u64 min_ahead, u64 max_ahead) {
+    struct vnic_wheel *wheel = calloc(1, sizeof(struct vnic_wheel));
+    struct vnic_wheel_entry *entries = calloc(WHEEL_ENTRIES, sizeof(struct vnic_wheel_entry));
+    int returned;
+    int i;
+
+    wheel->clock = start;
+    for (i = 0; i < WHEEL_ENTRIES; i++) {
+        entries[i].due = start + min_ahead + rng_next() % (max_ahead - min_ahead + 1);
+        vnic_wheel_insert(wheel, &entries[i]);
+    }
+    returned = drain(test, wheel, start);
+    if (returned != WHEEL_ENTRIES) {
+        fail(test, "%llu of %llu entries came out", returned, WHEEL_ENTRIES);
+    }
+    free(entries);
+    free(wheel);
+}
+
+/**
+ * An entry due just after the turn of the top level, with the clock in the last slot of
+ * the turn, must not be left in the slot the clock is already in
+ */
+static void test_top_level_wrap(void) {
+    struct vnic_wheel wheel;
+    struct vnic_wheel_entry entries[3];
+    u64 start = 5 * WHEEL_TURN + WHEEL_TURN - 256;
+    int i;
+
+    memset(&wheel, 0, sizeof(wheel));
+    wheel.clock = start;
+    entries[0].due = start + 256;
+    entries[1].due = start + 257 + 0x12345;
+    entries[2].due = start + WHEEL_TURN + 1000;
+    for (i = 0; i < 3; i++) {
+        vnic_wheel_insert(&wheel, &entries[i]);
+    }
+    if (vnic_wheel_next(&wheel) > entries[0].due) {
+        fail("top_level_wrap", "next tick is %llx, after %llx", vnic_wheel_next(&wheel),
+             entries[0].due);
+    }
+    if (drain("top_level_wrap", &wheel, start) != 3) {
+        fail("top_level_wrap", "%llu of %llu entries came out", 0, 3);
+    }
+}
+
+/**
+ * Entries due before the clock come out the next time the wheel is run
+ */
+static void test_late(void) {
+    struct vnic_wheel wheel;
+    struct vnic_wheel_entry entry;
+
+    memset(&wheel, 0, sizeof(wheel));
+    wheel.clock = WHEEL_TURN + 0x10000;
+    entry.due = 0x10;
+    vnic_wheel_insert(&wheel, &entry);
+    if (vnic_wheel_run(&wheel, wheel.clock) != &entry) {
+        fail("late", "entry due in %llx did not come out in %llx", entry.due, wheel.clock);
+    }
+}
+
+/**
+ * Taking entries out leaves the others to come out when they are due
+ */
+static bool is_odd(struct vnic_wheel_entry *entry, void *arg) {
+    (void)arg;
+    return entry->due & 1;
+}
+
+static void test_remove(void) {
+    struct vnic_wheel *wheel = calloc(1, sizeof(struct vnic_wheel));
+    struct vnic_wheel_entry *entries = calloc(WHEEL_ENTRIES, sizeof(struct vnic_wheel_entry));
+    struct vnic_wheel_entry *entry;
+    int removed = 0, odd = 0;
+    int i;
+
+    for (i = 0; i < WHEEL_ENTRIES; i++) {
+        entries[i].due = rng_next() % (1ULL << 26);
+        odd += entries[i].due & 1;
+        vnic_wheel_insert(wheel, &entries[i]);
+    }
+    for (entry = vnic_wheel_remove(wheel, is_odd, NULL); entry; entry = entry->next) {
+        removed++;
+    }
+    if (removed != odd) {
+        fail("remove", "%llu entries were taken out, not %llu", removed, odd);
+    }
+    if (drain("remove", wheel, 0) != WHEEL_ENTRIES - odd) {
+        fail("remove", "%llu entries were left, not %llu", WHEEL_ENTRIES - odd, 0);
+    }
+    free(entries);
+    free(wheel);
+}
+
+int main(int argc, char **argv) {
+    // Clocks which start just before the end of a turn of each level
+    static const u64 starts[] = {
+        0, 250, 0xfff0, 0xffff00, 0xfffffff0, 0x5ffffff00, 0x5ff000000, 0x7fffffffffff00,
+    };
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+        case 's':
+            rng_state = strtoull(optarg, NULL, 0) | 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    test_top_level_wrap();
+    test_late();
+    test_remove();
+    for (i = 0; i < (int)(sizeof(starts) / sizeof(starts[0])); i++) {
+        test_range("near", starts[i], 0, 1024);
+        test_range("level_2", starts[i], 0, 1 << 20);
+        test_range("top_level", starts[i], 1 << 20, WHEEL_TURN);
+        test_range("beyond_top_level", starts[i], WHEEL_TURN - 1024, 4 * WHEEL_TURN);
+    }
+
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
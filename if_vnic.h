@@ -0,0 +1,35 @@
+/**
+ * Netlink attributes of the "vnic" link type, for creating vnics with
+ *     ip link add vnicN type vnic ip <ip_addr> mac <mac_addr>
+ * This header is included by both the kernel module and the iproute2 plugin.
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#ifndef IF_VNIC_H
+#define IF_VNIC_H
+
+/**
+ * Attributes nested in IFLA_INFO_DATA
+ */
+enum {
+    IFLA_VNIC_UNSPEC,
+    IFLA_VNIC_IP,     /* __be32, the IPv4 address packets are delivered to the vnic for */
+    IFLA_VNIC_MAC,    /* ETH_ALEN bytes, the MAC address. IFLA_ADDRESS may be used instead */
+    IFLA_VNIC_NETSIM, /* __u8, enum vnic_netsim_role */
+    IFLA_VNIC_NETSIM_SHARD, /* __u8, the network simulator shard of a vnic with a role */
+    __IFLA_VNIC_MAX,
+};
+
+#define IFLA_VNIC_MAX (__IFLA_VNIC_MAX - 1)
+
+/**
+ * Part a vnic plays for the network simulator. Only one vnic of each shard can have
+ * each role
+ */
+enum vnic_netsim_role {
+    VNIC_NETSIM_NONE, /* An ordinary vnic */
+    VNIC_NETSIM_RX,   /* Receives the packets sent by ordinary vnics in flows of its shard */
+    VNIC_NETSIM_TX,   /* Sends packets on to their destinations */
+};
+
+#endif
@@ -0,0 +1,114 @@
+/**
+ * iproute2 plugin for the "vnic" link type, so that vnics can be created with
+ *     ip link add vnicN type vnic ip <ip_addr> mac <mac_addr> [netsim { rx | tx } [shard N]]
+ * ip loads it from /usr/lib/ip/link_vnic.so the first time it meets the type.
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+
+#include "utils.h"
+#include "ip_common.h"
+#include "../if_vnic.h"
+
+static void print_explain(FILE *f) {
+    fprintf(f,
+            "Usage: ... vnic [ ip ADDR ] [ mac LLADDR ] [ netsim { rx | tx } ] [ shard SHARD ]\n"
+            "\n"
+            "Where: ADDR   := IPv4 address packets are delivered to the vnic for\n"
+            "       LLADDR := MAC address of the vnic, random if left out\n"
+            "       SHARD  := network simulator shard the role is for, 0 if left out\n"
+            "       netsim gives the vnic a role for the network simulator\n");
+}
+
+static void explain(void) {
+    print_explain(stderr);
+}
+
+static int vnic_parse_opt(struct link_util *lu, int argc, char **argv, struct nlmsghdr *n) {
+    while (argc > 0) {
+        if (matches(*argv, "ip") == 0) {
+            inet_prefix addr;
+
+            NEXT_ARG();
+            if (get_addr(&addr, *argv, AF_INET)) {
+                invarg("invalid IPv4 address", *argv);
+            }
+            addattr32(n, 1024, IFLA_VNIC_IP, addr.data[0]);
+        } else if (matches(*argv, "mac") == 0) {
+            char mac[ETH_ALEN];
+
+            NEXT_ARG();
+            if (ll_addr_a2n(mac, sizeof(mac), *argv) != ETH_ALEN) {
+                invarg("invalid MAC address", *argv);
+            }
+            addattr_l(n, 1024, IFLA_VNIC_MAC, mac, ETH_ALEN);
+        } else if (matches(*argv, "netsim") == 0) {
+            NEXT_ARG();
+            if (strcmp(*argv, "rx") == 0) {
+                addattr8(n, 1024, IFLA_VNIC_NETSIM, VNIC_NETSIM_RX);
+            } else if (strcmp(*argv, "tx") == 0) {
+                addattr8(n, 1024, IFLA_VNIC_NETSIM, VNIC_NETSIM_TX);
+            } else if (strcmp(*argv, "none") == 0) {
+                addattr8(n, 1024, IFLA_VNIC_NETSIM, VNIC_NETSIM_NONE);
+            } else {
+                invarg("netsim must be rx, tx or none", *argv);
+            }
+        } else if (matches(*argv, "shard") == 0) {
+            __u8 shard;
+
+            NEXT_ARG();
+            if (get_u8(&shard, *argv, 0)) {
+                invarg("invalid shard", *argv);
+            }
+            addattr8(n, 1024, IFLA_VNIC_NETSIM_SHARD, shard);
+        } else if (matches(*argv, "help") == 0) {
+            explain();
+            return -1;
+        } else {
+            fprintf(stderr, "vnic: unknown option \"%s\"?\n", *argv);
+            explain();
+            return -1;
+        }
+        argc--, argv++;
+    }
+    return 0;
+}
+
+static void vnic_print_opt(struct link_util *lu, FILE *f, struct rtattr *tb[]) {
+    static const char *roles[] = { "none", "rx", "tx" };
+
+    if (!tb) {
+        return;
+    }
+    if (tb[IFLA_VNIC_IP]) {
+        print_string(PRINT_ANY, "ip", "ip %s ",
+                     format_host_rta(AF_INET, tb[IFLA_VNIC_IP]));
+    }
+    if (tb[IFLA_VNIC_NETSIM]) {
+        __u8 role = rta_getattr_u8(tb[IFLA_VNIC_NETSIM]);
+
+        if (role < ARRAY_SIZE(roles) && role != VNIC_NETSIM_NONE) {
+            print_string(PRINT_ANY, "netsim", "netsim %s ", roles[role]);
+            if (tb[IFLA_VNIC_NETSIM_SHARD]) {
+                print_uint(PRINT_ANY, "shard", "shard %u ",
+                           rta_getattr_u8(tb[IFLA_VNIC_NETSIM_SHARD]));
+            }
+        }
+    }
+}
+
+static void vnic_print_help(struct link_util *lu, int argc, char **argv, FILE *f) {
+    print_explain(f);
+}
+
+struct link_util vnic_link_util = {
+    .id = "vnic",
+    .maxattr = IFLA_VNIC_MAX,
+    .parse_opt = vnic_parse_opt,
+    .print_opt = vnic_print_opt,
+    .print_help = vnic_print_help,
+};
@@ -7,12 +7,13 @@
 #define VNIC_H
 
 #include <linux/netdevice.h>
+#include <linux/jump_label.h>
+#include <linux/bpf.h>
 
 #define VNIC_TIMEOUT 5
-// TODO: remove hard coded definition of HASH_BITS
-#define MY_HASH_BITS 5
-#define MAX_VNICS (1 << MY_HASH_BITS)
-
+// Offloads advertised by every vnic. Checksums and segmentation are passed through
+#define VNIC_FEATURES (NETIF_F_SG | NETIF_F_FRAGLIST | NETIF_F_HW_CSUM | NETIF_F_RXCSUM | \
+                       NETIF_F_HIGHDMA | NETIF_F_GSO_SOFTWARE | NETIF_F_GSO_ENCAP_ALL)
 #define DEBUG_ON
 #ifdef DEBUG_ON
     // Log message to kernal logs if DEBUG_ON is defined
@@ -22,25 +23,236 @@
     #define LOG(message)
 #endif
 
-struct vnic_packet {
-    struct vnic_packet *next;
-    struct net_device *dev;
-    int datalen;
-    u8 data[ETH_DATA_LEN];
+/**
+ * Reasons for a packet to be dropped by a vnic
+ */
+enum vnic_drop_reason {
+    VNIC_DROP_NO_DEST,    /* No device is registered for the destination address */
+    VNIC_DROP_DEST_DOWN,  /* The destination device is not running */
+    VNIC_DROP_TOO_SHORT,  /* Too short to contain ethernet and ip headers */
+    VNIC_DROP_RX_FULL,    /* The receive queue of the destination device is full */
+    VNIC_DROP_NO_MEM,     /* Memory ran out, e.g. while segmenting a packet */
+    VNIC_DROP_LINK_LOSS,  /* Lost on an emulated link */
+    VNIC_DROP_LINK_LIMIT, /* Would have waited too long behind the rate limit of a link */
+    VNIC_DROP_XDP,        /* Dropped by an XDP program, or could not be given to or sent by one */
+    VNIC_DROP_MAX,
+};
+
+/**
+ * Other per-CPU event counters of a vnic
+ */
+enum vnic_counter {
+    VNIC_NETSIM_FORWARDED, /* Packets sent to, or from, the network simulator */
+    VNIC_XDP_TX,           /* Packets sent back out by an XDP program with XDP_TX */
+    VNIC_XDP_REDIRECT,     /* Packets redirected by an XDP program */
+    VNIC_ROUTED,           /* Packets forwarded to the next hop of a route */
+    VNIC_TX_STOPPED,       /* Times a transmit queue was stopped because its destination was full */
+    VNIC_FLOW_BYPASSED,    /* Packets delivered straight to their destination by a flow */
+    VNIC_FANOUT_CLONED,    /* Extra copies of broadcast and multicast packets, made by cloning */
+    VNIC_COUNTER_MAX,
+};
+
+/**
+ * Stages of the path of a packet through the module, which latency is measured for
+ */
+enum vnic_latency_stage {
+    VNIC_LATENCY_DIRECT,      /* From one vnic to another, over an emulated link or a route */
+    VNIC_LATENCY_TO_NETSIM,   /* From a vnic to the network simulator */
+    VNIC_LATENCY_IN_NETSIM,   /* Inside the network simulator */
+    VNIC_LATENCY_FROM_NETSIM, /* From the network simulator to a vnic */
+    VNIC_LATENCY_STAGE_MAX,
+};
+
+/**
+ * A vnic which latency is measured for, kept by value since it may be destroyed while
+ * its packets are still on their way
+ */
+struct vnic_latency_dev {
+    u32 net;     /* Inode number of its network namespace */
+    int ifindex; /* In its network namespace */
+};
+
+/**
+ * State kept in skb->cb from when a vnic sends a packet until it is delivered.
+ * Other users of skb->cb inside the module keep theirs after it
+ */
+struct vnic_skb_cb {
+    u64 stamp;                   /* ktime_get_ns() when the packet was sent */
+    u32 epoch;                   /* Latency measurement the stamp belongs to, 0 for none */
+    u8 stage;                    /* enum vnic_latency_stage */
+    struct vnic_latency_dev src; /* The vnic which sent the packet */
+};
+
+#define VNIC_SKB_CB(skb) ((struct vnic_skb_cb *)(skb)->cb)
+
+/**
+ * The transmit queues stopped until a ring has room, kept with the ring so that a
+ * receiver making room only looks at its own waiters
+ */
+struct vnic_ring_waiters {
+    spinlock_t lock;
+    struct list_head list; /* Of struct vnic_tx_waiter, in vnic_main.c */
 };
 
+static inline void vnic_ring_waiters_init(struct vnic_ring_waiters *ring_waiters) {
+    spin_lock_init(&ring_waiters->lock);
+    INIT_LIST_HEAD(&ring_waiters->list);
+}
+
+// Most shards the network simulator can be split into, each with its own pair of vnics
+#define VNIC_NETSIM_MAX_SHARDS 64
+
+/**
+ * Devices for the network simulator, one of each per shard, defined in vnic_main.c
+ * NULL while there is no such device. Read with READ_ONCE under RCU
+ */
+extern struct net_device *netsim_rxdevs[VNIC_NETSIM_MAX_SHARDS];
+extern struct net_device *netsim_txdevs[VNIC_NETSIM_MAX_SHARDS];
+
 void print_netdev_name(struct net_device *dev);
+void vnic_print_skb(struct net_device *dev, struct sk_buff *skb);
+u8 vnic_netsim_role(const struct net_device *dev);
+int vnic_netsim_shard(const struct net_device *dev);
+int vnic_netsim_shard_count(void);
+u32 vnic_ip_addr(const struct net_device *dev);
+bool vnic_is_vnic(const struct net_device *dev);
+struct net_device *vnic_next(struct net_device *dev);
 void vnic_init(struct net_device *dev);
+void vnic_drop(struct net_device *dev, struct sk_buff *skb, enum vnic_drop_reason reason);
+void vnic_count_drops(struct net_device *dev, enum vnic_drop_reason reason, unsigned int count);
+void vnic_count(struct net_device *dev, enum vnic_counter counter);
+void vnic_get_stats64(struct net_device *dev, struct rtnl_link_stats64 *stats);
 int vnic_header(struct sk_buff *skb, struct net_device *dev,
 			   unsigned short type, const void *daddr,
 			   const void *saddr, unsigned int len);
-void vnic_setup_packet_pool(struct net_device *dev);
+int vnic_header_cache(const struct neighbour *neigh, struct hh_cache *hh, __be16 type);
+void vnic_header_cache_update(struct hh_cache *hh, const struct net_device *dev,
+                              const unsigned char *haddr);
 int vnic_dev_init(struct net_device *dev);
+void vnic_dev_uninit(struct net_device *dev);
 int vnic_open(struct net_device *dev);
 int vnic_release(struct net_device *dev);
+u16 vnic_select_queue(struct net_device *dev, struct sk_buff *skb,
+                      struct net_device *sb_dev);
 netdev_tx_t vnic_xmit(struct sk_buff *skb, struct net_device *dev);
-void vnic_rx(struct net_device *dev, struct sk_buff *skb);
+netdev_tx_t vnic_inject_xmit(struct net_device *dev, struct sk_buff *skb, bool more);
+int vnic_rx(struct net_device *dev, struct sk_buff *skb);
+int __vnic_rx(struct net_device *dev, struct sk_buff *skb, struct netdev_queue *txq);
+void vnic_batch_flush(void);
+void vnic_tx_wake(struct vnic_ring_waiters *ring_waiters);
+int vnic_poll(struct napi_struct *napi, int budget);
+int vnic_bpf(struct net_device *dev, struct netdev_bpf *bpf);
+int vnic_xdp_xmit(struct net_device *dev, int n, struct xdp_frame **frames, u32 flags);
+struct net_device *get_dev_for_ip(u32 ip_addr, bool *routed);
+int vnic_route_add(u32 prefix, int prefix_len, struct net_device *dev);
+int vnic_route_del(u32 prefix, int prefix_len, struct net_device *dev);
 int debug_init(struct net_device *dev);
+struct net_device *find_vnic_by_name(const char *name);
+void vnic_debugfs_init(void);
+void vnic_debugfs_cleanup(void);
+
+// vnic_netsim.c
+int vnic_netsim_rx(struct net_device *dev, struct sk_buff *skb);
+int vnic_netsim_rx_busy(struct net_device *dev, unsigned int len,
+                        struct vnic_ring_waiters **ring_waiters);
+void vnic_netsim_tx_resume(struct net_device *dev);
+int vnic_netsim_init(void);
+void vnic_netsim_cleanup(void);
+
+// vnic_pool.c
+// Room before the packet data for headers to be pushed, and for XDP programs, so that
+// packets built from the cache can be given to them without being copied
+#define VNIC_POOL_HEADROOM (max(XDP_PACKET_HEADROOM, NET_SKB_PAD) + NET_IP_ALIGN)
+// The longest packet vnic_alloc_skb can fit in a page alongside the headroom and skb_shared_info
+#define VNIC_POOL_MAX_LEN (PAGE_SIZE - VNIC_POOL_HEADROOM - \
+                           SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+int vnic_pool_init(void);
+void vnic_pool_cleanup(void);
+struct sk_buff *vnic_alloc_skb(struct net_device *dev, unsigned int len);
+void vnic_pool_debugfs_init(struct dentry *root);
+
+// vnic_link.c
+struct vnic_link;
+DECLARE_STATIC_KEY_FALSE(vnic_link_key);
+struct vnic_link *vnic_link_find(struct net_device *src, struct net_device *dst);
+int vnic_link_xmit(struct vnic_link *link, struct net_device *dst, struct sk_buff *skb);
+void vnic_link_remove_dev(struct net_device *dev);
+void vnic_link_purge_dev(struct net_device *dev);
+int vnic_link_init(void);
+void vnic_link_cleanup(void);
+void vnic_link_debugfs_init(struct dentry *root);
+
+// vnic_capture.c
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_MAX_SNAPLEN 65535
+
+/**
+ * Header at the start of a pcap stream, in the byte order of the host which wrote it
+ */
+struct vnic_pcap_file_header {
+    u32 magic;
+    u16 version_major;
+    u16 version_minor;
+    s32 thiszone;
+    u32 sigfigs;
+    u32 snaplen;
+    u32 linktype;
+};
+
+/**
+ * Header before each packet in a pcap stream. ts_nsec holds microseconds if the
+ * stream starts with PCAP_MAGIC_USEC
+ */
+struct vnic_pcap_record_header {
+    u32 ts_sec;
+    u32 ts_nsec;
+    u32 incl_len;
+    u32 orig_len;
+};
+
+DECLARE_STATIC_KEY_FALSE(vnic_capture_key);
+void vnic_capture_skb(struct sk_buff *skb);
+void vnic_capture_debugfs_init(struct dentry *root);
+
+// vnic_latency.c
+DECLARE_STATIC_KEY_FALSE(vnic_latency_key);
+void vnic_latency_stamp(struct sk_buff *skb, struct net_device *src, struct net_device *dst);
+void vnic_latency_deliver(struct sk_buff *skb, struct net_device *dst);
+void vnic_latency_add(const struct net_device *src, const struct net_device *dst,
+                      enum vnic_latency_stage stage, u64 stamp);
+void vnic_latency_debugfs_init(struct dentry *root);
+void vnic_latency_cleanup(void);
+
+// vnic_flow.c
+struct iphdr;
+struct vnic_netsim_flow;
+DECLARE_STATIC_KEY_FALSE(vnic_flow_key);
+struct net_device *vnic_flow_lookup(struct sk_buff *skb, struct iphdr *iph);
+int vnic_flow_ioctl(unsigned int cmd, const struct vnic_netsim_flow *nf, int shard);
+void vnic_flow_clear(void);
+void vnic_flow_clear_shard(int shard);
+void vnic_flow_remove_dev(struct net_device *dev);
+void vnic_flow_debugfs_init(struct dentry *root);
+void vnic_flow_cleanup(void);
+
+// vnic_pktgen.c
+void vnic_pktgen_remove_dev(struct net_device *dev);
+void vnic_pktgen_debugfs_init(struct dentry *root);
+void vnic_pktgen_cleanup(void);
+
+// vnic_fanout.c
+struct vnic_fanout_set;
+DECLARE_STATIC_KEY_FALSE(vnic_fanout_key);
+const struct vnic_fanout_set *vnic_fanout_lookup(const struct iphdr *iph);
+int vnic_fanout_xmit(const struct vnic_fanout_set *set, struct net_device *dev,
+                     struct sk_buff *skb, struct netdev_queue *txq);
+void vnic_fanout_set_rx_mode(struct net_device *dev);
+void vnic_fanout_remove_dev(struct net_device *dev);
+void vnic_fanout_debugfs_init(struct dentry *root);
+int vnic_fanout_init(void);
+void vnic_fanout_cleanup(void);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,349 @@
+/**
+ * Packet capture, read from /sys/kernel/debug/vnic/capture as a pcap stream
+ *
+ * Capturing runs while the file is open, and costs nothing otherwise: the check in
+ * vnic_xmit is a static key which is only patched in on open. Every packet sent by any
+ * vnic is seen once, as it is transmitted. One in capture_sample of them is copied, up to
+ * capture_snaplen bytes, into a ring belonging to the CPU sending it. Each ring has a
+ * single producer, its own CPU with bottom halves disabled, and a single consumer, the
+ * reader, so neither side takes a lock. A packet which finds its ring full is counted and
+ * dropped from the capture rather than waiting, so the cost on the data path is bounded
+ * by one copy of capture_snaplen bytes. The reader merges the rings in timestamp order.
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/sched/signal.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/jump_label.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+
+#include "vnic.h"
+
+/**
+ * Command line arguments for loading the module. Each is read when the capture file is
+ * opened, and can be changed through /sys/module/vnic/parameters between captures
+ * capture_snaplen : int, the most bytes of each packet which are captured.
+ * capture_sample : int, capture one in this many packets sent by each CPU.
+ * capture_slots : int, the number of packets each CPU can hold for the reader. Rounded
+ *                 up to a power of 2.
+ */
+static int capture_snaplen = 128;
+static int capture_sample = 1;
+static int capture_slots = 1024;
+module_param(capture_snaplen, int, 0644);
+module_param(capture_sample, int, 0644);
+module_param(capture_slots, int, 0644);
+
+// How long a blocking read sleeps between looking for packets, so senders never wake it
+#define CAPTURE_POLL_INTERVAL (HZ / 100)
+
+/**
+ * A captured packet, in one slot of a ring
+ */
+struct vnic_capture_record {
+    u64 tstamp; /* Real time in ns */
+    u32 caplen;
+    u32 len;
+    u8 data[];
+};
+
+/**
+ * Ring of captured packets of one CPU. producer is only written by the CPU, and
+ * consumer only by the reader, so they are kept on separate cache lines.
+ */
+struct vnic_capture_ring {
+    u32 producer;
+    u32 skip;     /* Packets to let past before the next is captured */
+    u64 captured;
+    u64 dropped;  /* Packets sampled while the ring was full */
+    u8 *data;
+    u32 consumer ____cacheline_aligned_in_smp;
+};
+
+struct vnic_capture {
+    u32 slots;
+    u32 slot_size;
+    u32 snaplen;
+    u32 sample;
+    struct vnic_capture_ring __percpu *rings;
+
+    // Reader state. The pending buffer holds the part of the stream, the file header or
+    // one packet, which has not been read yet
+    struct mutex read_mutex;
+    u8 *pending;
+    size_t pending_len;
+    size_t pending_off;
+};
+
+/**
+ * Patched in while the capture file is open, so that vnic_xmit only captures then
+ */
+DEFINE_STATIC_KEY_FALSE(vnic_capture_key);
+
+static struct vnic_capture __rcu *vnic_capture_active;
+static atomic_t vnic_capture_open_count = ATOMIC_INIT(0);
+
+static inline struct vnic_capture_record *vnic_capture_slot(struct vnic_capture *capture,
+                                                            struct vnic_capture_ring *ring,
+                                                            u32 index) {
+    return (struct vnic_capture_record *)(ring->data +
+                                          (size_t)(index & (capture->slots - 1)) * capture->slot_size);
+}
+
+/**
+ * Captures a packet being sent, if it is sampled and its ring has room.
+ * Must be called with bottom halves disabled, as is the case in vnic_xmit.
+ */
+void vnic_capture_skb(struct sk_buff *skb) {
+    struct vnic_capture *capture = rcu_dereference_bh(vnic_capture_active);
+    struct vnic_capture_ring *ring;
+    struct vnic_capture_record *record;
+
+    if (!capture) {
+        return;
+    }
+    ring = this_cpu_ptr(capture->rings);
+    if (--ring->skip) {
+        return;
+    }
+    ring->skip = capture->sample;
+
+    if (ring->producer - smp_load_acquire(&ring->consumer) >= capture->slots) {
+        ring->dropped++;
+        return;
+    }
+
+    record = vnic_capture_slot(capture, ring, ring->producer);
+    record->tstamp = ktime_get_real_ns();
+    record->len = skb->len;
+    record->caplen = min(skb->len, capture->snaplen);
+    if (skb_copy_bits(skb, 0, record->data, record->caplen)) {
+        record->caplen = 0;
+    }
+    ring->captured++;
+    // Pairs with the acquire in vnic_capture_next. The reader sees the whole record
+    smp_store_release(&ring->producer, ring->producer + 1);
+}
+
+/**
+ * Takes the oldest packet at the head of any ring and formats it into the pending buffer.
+ * Returns false if every ring is empty
+ */
+static bool vnic_capture_next(struct vnic_capture *capture) {
+    struct vnic_capture_ring *oldest = NULL;
+    struct vnic_capture_record *record, *oldest_record = NULL;
+    struct vnic_pcap_record_header *header;
+    u32 nsec;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct vnic_capture_ring *ring = per_cpu_ptr(capture->rings, cpu);
+
+        if (smp_load_acquire(&ring->producer) == ring->consumer) {
+            continue;
+        }
+        record = vnic_capture_slot(capture, ring, ring->consumer);
+        if (!oldest || record->tstamp < oldest_record->tstamp) {
+            oldest = ring;
+            oldest_record = record;
+        }
+    }
+    if (!oldest) {
+        return false;
+    }
+
+    header = (struct vnic_pcap_record_header *)capture->pending;
+    header->ts_sec = div_u64_rem(oldest_record->tstamp, NSEC_PER_SEC, &nsec);
+    header->ts_nsec = nsec;
+    header->incl_len = oldest_record->caplen;
+    header->orig_len = oldest_record->len;
+    memcpy(capture->pending + sizeof(*header), oldest_record->data, oldest_record->caplen);
+    capture->pending_len = sizeof(*header) + oldest_record->caplen;
+    capture->pending_off = 0;
+
+    // The slot can be reused once it has been copied out
+    smp_store_release(&oldest->consumer, oldest->consumer + 1);
+    return true;
+}
+
+/**
+ * Reads the pcap stream. Blocks until at least one packet has been captured, unless the
+ * file was opened with O_NONBLOCK
+ */
+static ssize_t vnic_capture_read(struct file *file, char __user *buf, size_t count,
+                                 loff_t *ppos) {
+    struct vnic_capture *capture = file->private_data;
+    size_t copied = 0;
+    ssize_t result;
+
+    if (mutex_lock_interruptible(&capture->read_mutex)) {
+        return -ERESTARTSYS;
+    }
+    while (copied < count) {
+        size_t len;
+
+        if (capture->pending_off == capture->pending_len && !vnic_capture_next(capture)) {
+            if (copied) {
+                break;
+            }
+            if (file->f_flags & O_NONBLOCK) {
+                result = -EAGAIN;
+                goto out;
+            }
+            schedule_timeout_interruptible(CAPTURE_POLL_INTERVAL);
+            if (signal_pending(current)) {
+                result = -ERESTARTSYS;
+                goto out;
+            }
+            continue;
+        }
+
+        len = min(count - copied, capture->pending_len - capture->pending_off);
+        if (copy_to_user(buf + copied, capture->pending + capture->pending_off, len)) {
+            result = copied ? copied : -EFAULT;
+            goto out;
+        }
+        capture->pending_off += len;
+        copied += len;
+    }
+    *ppos += copied;
+    result = copied;
+out:
+    mutex_unlock(&capture->read_mutex);
+    return result;
+}
+
+static void vnic_capture_free(struct vnic_capture *capture) {
+    int cpu;
+
+    if (capture->rings) {
+        for_each_possible_cpu(cpu) {
+            kvfree(per_cpu_ptr(capture->rings, cpu)->data);
+        }
+        free_percpu(capture->rings);
+    }
+    kfree(capture->pending);
+    kfree(capture);
+}
+
+static struct vnic_capture *vnic_capture_alloc(void) {
+    struct vnic_capture *capture = kzalloc(sizeof(struct vnic_capture), GFP_KERNEL);
+    struct vnic_pcap_file_header *header;
+    int cpu;
+
+    if (!capture) {
+        return NULL;
+    }
+
+    capture->slots = roundup_pow_of_two(max(capture_slots, 1));
+    capture->snaplen = clamp(capture_snaplen, ETH_HLEN, PCAP_MAX_SNAPLEN);
+    capture->sample = max(capture_sample, 1);
+    capture->slot_size = ALIGN(sizeof(struct vnic_capture_record) + capture->snaplen, 8);
+    mutex_init(&capture->read_mutex);
+
+    capture->pending = kmalloc(max(sizeof(struct vnic_pcap_file_header),
+                                   sizeof(struct vnic_pcap_record_header) + capture->snaplen),
+                               GFP_KERNEL);
+    capture->rings = alloc_percpu(struct vnic_capture_ring);
+    if (!capture->pending || !capture->rings) {
+        vnic_capture_free(capture);
+        return NULL;
+    }
+
+    for_each_possible_cpu(cpu) {
+        struct vnic_capture_ring *ring = per_cpu_ptr(capture->rings, cpu);
+
+        ring->skip = 1;
+        ring->data = kvmalloc_node((size_t)capture->slots * capture->slot_size, GFP_KERNEL,
+                                   cpu_to_node(cpu));
+        if (!ring->data) {
+            vnic_capture_free(capture);
+            return NULL;
+        }
+    }
+
+    // The stream starts with the file header
+    header = (struct vnic_pcap_file_header *)capture->pending;
+    header->magic = PCAP_MAGIC_NSEC;
+    header->version_major = 2;
+    header->version_minor = 4;
+    header->thiszone = 0;
+    header->sigfigs = 0;
+    header->snaplen = capture->snaplen;
+    header->linktype = PCAP_LINKTYPE_ETHERNET;
+    capture->pending_len = sizeof(*header);
+    capture->pending_off = 0;
+    return capture;
+}
+
+/**
+ * Only one reader can capture at a time. Packets are captured from the moment it opens
+ * the file
+ */
+static int vnic_capture_open(struct inode *inode, struct file *file) {
+    struct vnic_capture *capture;
+
+    if (atomic_cmpxchg(&vnic_capture_open_count, 0, 1)) {
+        return -EBUSY;
+    }
+
+    capture = vnic_capture_alloc();
+    if (!capture) {
+        atomic_set(&vnic_capture_open_count, 0);
+        return -ENOMEM;
+    }
+    file->private_data = capture;
+
+    rcu_assign_pointer(vnic_capture_active, capture);
+    static_branch_enable(&vnic_capture_key);
+    printk("vnic: capturing 1 in %u packets, %u bytes of each\n", capture->sample,
+           capture->snaplen);
+    return nonseekable_open(inode, file);
+}
+
+/**
+ * Stops capturing, then frees the rings once no CPU can still be copying into them
+ */
+static int vnic_capture_release(struct inode *inode, struct file *file) {
+    struct vnic_capture *capture = file->private_data;
+    u64 captured = 0, dropped = 0;
+    int cpu;
+
+    static_branch_disable(&vnic_capture_key);
+    RCU_INIT_POINTER(vnic_capture_active, NULL);
+    synchronize_net();
+
+    for_each_possible_cpu(cpu) {
+        captured += per_cpu_ptr(capture->rings, cpu)->captured;
+        dropped += per_cpu_ptr(capture->rings, cpu)->dropped;
+    }
+    printk("vnic: capture stopped, %llu packets captured, %llu dropped because the reader fell behind\n",
+           captured, dropped);
+
+    vnic_capture_free(capture);
+    atomic_set(&vnic_capture_open_count, 0);
+    return 0;
+}
+
+static const struct file_operations vnic_capture_fops = {
+    .owner = THIS_MODULE,
+    .open = vnic_capture_open,
+    .read = vnic_capture_read,
+    .release = vnic_capture_release,
+    .llseek = no_llseek,
+};
+
+void vnic_capture_debugfs_init(struct dentry *root) {
+    debugfs_create_file("capture", 0400, root, NULL, &vnic_capture_fops);
+}
@@ -0,0 +1,650 @@
+/**
+ * Routing core of the vnic module, shared by the kernel module and userspace builds.
+ * See vnic_core.h
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/bitops.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/overflow.h>
+#include <linux/if_ether.h>
+#include <asm/barrier.h>
+#else
+#include <stdlib.h>
+#include <errno.h>
+#endif
+
+#include "vnic_core.h"
+
+#ifdef __KERNEL__
+#define vnic_core_zalloc(size) kvzalloc(size, GFP_KERNEL)
+#define vnic_core_free(ptr) kvfree(ptr)
+// Slots are read under RCU while the writer changes them. The value is loaded with
+// acquire, not just a dependency, as the ip_addr of the slot is read after it without
+// going through the pointer, and must be the one published with the value
+#define vnic_core_load(p) smp_load_acquire(&(p))
+#define vnic_core_publish(p, v) rcu_assign_pointer(p, v)
+#define vnic_core_set(p, v) RCU_INIT_POINTER(p, v)
+#else
+#define vnic_core_zalloc(size) calloc(1, size)
+#define vnic_core_free(ptr) free(ptr)
+#define vnic_core_load(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define vnic_core_publish(p, v) __atomic_store_n(&(p), v, __ATOMIC_RELEASE)
+#define vnic_core_set(p, v) __atomic_store_n(&(p), v, __ATOMIC_RELAXED)
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), v, __ATOMIC_RELAXED)
+#define ETH_ALEN 6
+
+static inline int fls(unsigned int x) {
+    return x ? 32 - __builtin_clz(x) : 0;
+}
+
+static inline int fls64(u64 x) {
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline unsigned long __ffs64(u64 x) {
+    return __builtin_ctzll(x);
+}
+#endif
+
+// Multiplicative hash, as hash_32 in the kernel
+#define VNIC_GOLDEN_RATIO_32 0x61C88647
+
+static inline u32 vnic_core_hash(u32 val, int bits) {
+    return (val * VNIC_GOLDEN_RATIO_32) >> (32 - bits);
+}
+
+/**
+ * ===============================================================
+ *                         IP lookup table
+ * ===============================================================
+ */
+
+/**
+ * Allocates an empty table large enough to hold entries values
+ * The length of the table is the first power of 2 after entries * 1.5
+ * Returns NULL if memory runs out
+ */
+struct vnic_ip_table *vnic_ip_table_alloc(int entries) {
+    struct vnic_ip_table *table;
+    int bits = fls((entries * 3) / 2);
+
+    if (bits < 2) {
+        bits = 2;
+    }
+    table = vnic_core_zalloc(sizeof(struct vnic_ip_table) +
+                             sizeof(struct vnic_ip_slot) * ((size_t)1 << bits));
+    if (!table) {
+        return NULL;
+    }
+    table->hash_bits = bits;
+    table->len = 1 << bits;
+    return table;
+}
+
+void vnic_ip_table_free(struct vnic_ip_table *table) {
+    vnic_core_free(table);
+}
+
+/**
+ * Stores value against ip_addr in table, replacing the value already stored for ip_addr if
+ * there is one.
+ * New entries only go in empty slots. A tombstone is not reused in place, as a reader may
+ * have loaded the value of the removed entry and be about to read the address of the slot,
+ * and would match it against the new address. Tombstones count towards the resize hint,
+ * so they are cleared by rebuilding the table before they fill it.
+ * Returns 1 for success, 0 if the table is full
+ */
+int vnic_ip_table_insert(struct vnic_ip_table *table, u32 ip_addr, void *value) {
+    u32 index = vnic_core_hash(ip_addr, table->hash_bits);
+    struct vnic_ip_slot *slot;
+    void *entry;
+    int attempts = 0;
+
+    while ((entry = vnic_core_load(table->slots[index].value)) && attempts++ < table->len) {
+        if (entry != VNIC_TOMBSTONE && table->slots[index].ip_addr == ip_addr) {
+            // Remap an existing entry. Readers see either the old or the new value
+            vnic_core_publish(table->slots[index].value, value);
+            return 1;
+        }
+        index = (index + 1) & (table->len - 1);
+    }
+    if (entry) {
+        return 0;
+    }
+
+    // The address must be visible before the value, since readers check the value first.
+    // It never changes again, until the table is rebuilt
+    slot = &table->slots[index];
+    WRITE_ONCE(slot->ip_addr, ip_addr);
+    vnic_core_publish(slot->value, value);
+    table->used++;
+    table->count++;
+    return 1;
+}
+
+/**
+ * Removes the value stored for ip_addr, leaving a tombstone in its slot
+ * Returns 1 if an entry was removed, 0 if there was no entry for ip_addr
+ */
+int vnic_ip_table_remove(struct vnic_ip_table *table, u32 ip_addr) {
+    u32 index = vnic_core_hash(ip_addr, table->hash_bits);
+    void *entry;
+    int attempts = 0;
+
+    while ((entry = vnic_core_load(table->slots[index].value)) && attempts++ < table->len) {
+        if (entry != VNIC_TOMBSTONE && table->slots[index].ip_addr == ip_addr) {
+            vnic_core_set(table->slots[index].value, VNIC_TOMBSTONE);
+            table->count--;
+            return 1;
+        }
+        index = (index + 1) & (table->len - 1);
+    }
+    return 0;
+}
+
+/**
+ * Removes every entry for value, such as when a device is destroyed
+ * Returns the number of entries removed
+ */
+int vnic_ip_table_remove_value(struct vnic_ip_table *table, void *value) {
+    int removed = 0;
+    int i;
+
+    for (i = 0; i < table->len; i++) {
+        if (vnic_core_load(table->slots[i].value) == value) {
+            vnic_core_set(table->slots[i].value, VNIC_TOMBSTONE);
+            table->count--;
+            removed++;
+        }
+    }
+    return removed;
+}
+
+/**
+ * Finds the value stored for ip_addr. Safe to call alongside changes to the table.
+ * If probes is not NULL, the number of slots looked at is stored in it.
+ * Returns NULL if there is no entry for ip_addr
+ */
+void *vnic_ip_table_lookup(struct vnic_ip_table *table, u32 ip_addr, int *probes) {
+    u32 index = vnic_core_hash(ip_addr, table->hash_bits);
+    void *entry;
+    int attempts = 0;
+
+    while ((entry = vnic_core_load(table->slots[index].value)) && attempts++ < table->len) {
+        if (entry != VNIC_TOMBSTONE && READ_ONCE(table->slots[index].ip_addr) == ip_addr) {
+            if (probes) {
+                *probes = attempts;
+            }
+            return entry;
+        }
+        index = (index + 1) & (table->len - 1);
+    }
+    if (probes) {
+        *probes = attempts;
+    }
+    return NULL;
+}
+
+/**
+ * Returns the value in slot index of the table, storing its address in ip_addr, or NULL
+ * if the slot holds no entry. For listing every entry
+ */
+void *vnic_ip_table_entry(struct vnic_ip_table *table, int index, u32 *ip_addr) {
+    void *value = vnic_core_load(table->slots[index].value);
+
+    if (!value || value == VNIC_TOMBSTONE) {
+        return NULL;
+    }
+    *ip_addr = READ_ONCE(table->slots[index].ip_addr);
+    return value;
+}
+
+/**
+ * Inserts every entry of src into dst, which must be large enough to hold them.
+ * Tombstones are left behind
+ */
+void vnic_ip_table_copy(struct vnic_ip_table *dst, struct vnic_ip_table *src) {
+    void *value;
+    u32 ip_addr;
+    int i;
+
+    for (i = 0; i < src->len; i++) {
+        if ((value = vnic_ip_table_entry(src, i, &ip_addr))) {
+            vnic_ip_table_insert(dst, ip_addr, value);
+        }
+    }
+}
+
+/**
+ * The resizing policy of the table. Before an entry is added the table is grown if more
+ * than 3/4 of it would be used, counting tombstones. After entries are removed it is
+ * shrunk when less than 1/8 of it holds entries.
+ * Returns the number of entries to build a new table for, or 0 if the table is fine as it is
+ */
+int vnic_ip_table_resize_hint(struct vnic_ip_table *table, bool adding) {
+    if (adding && (table->used + 1) * 4 > table->len * 3) {
+        return (table->count + 1) * 2;
+    }
+    if (!adding && table->count * 8 < table->len && table->len > 4) {
+        return table->count ? table->count * 2 : 1;
+    }
+    return 0;
+}
+
+/**
+ * ===============================================================
+ *                        Forwarding table
+ * ===============================================================
+ */
+
+/**
+ * Sets entry, and every entry beneath it, to value
+ */
+static void vnic_lpm_fill(struct vnic_lpm *lpm, u32 *entry, u32 value) {
+    int i;
+
+    if (!(*entry & VNIC_LPM_CHILD)) {
+        *entry = value;
+        return;
+    }
+    for (i = 0; i < VNIC_LPM_FANOUT; i++) {
+        vnic_lpm_fill(lpm, &lpm->nodes[*entry & ~VNIC_LPM_CHILD][i], value);
+    }
+}
+
+/**
+ * Adds route index to the trie. Routes must be added shortest first, so that a route
+ * overwrites every shorter route it overlaps
+ */
+static void vnic_lpm_add(struct vnic_lpm *lpm, int index) {
+    struct vnic_route *route = &lpm->routes[index];
+    int len = route->prefix_len;
+    int shift = 32 - VNIC_LPM_STRIDE;
+    u32 node = 0;
+    u32 *entry;
+    u32 first;
+    int i;
+
+    // Walk down to the level the route ends in, adding nodes where there are none
+    while (len > VNIC_LPM_STRIDE) {
+        entry = &lpm->nodes[node][(route->prefix >> shift) & (VNIC_LPM_FANOUT - 1)];
+        if (!(*entry & VNIC_LPM_CHILD)) {
+            // The new node inherits the shorter route which covered its entry
+            for (i = 0; i < VNIC_LPM_FANOUT; i++) {
+                lpm->nodes[lpm->node_count][i] = *entry;
+            }
+            *entry = VNIC_LPM_CHILD | lpm->node_count++;
+        }
+        node = *entry & ~VNIC_LPM_CHILD;
+        shift -= VNIC_LPM_STRIDE;
+        len -= VNIC_LPM_STRIDE;
+    }
+
+    first = (route->prefix >> shift) & (VNIC_LPM_FANOUT - 1);
+    for (i = 0; i < 1 << (VNIC_LPM_STRIDE - len); i++) {
+        vnic_lpm_fill(lpm, &lpm->nodes[node][first + i], index + 1);
+    }
+}
+
+/**
+ * Builds a forwarding table from count routes. The host bits of each prefix are ignored.
+ * If two routes are for the same prefix, the later one is used.
+ * Returns NULL if memory runs out
+ */
+struct vnic_lpm *vnic_lpm_build(const struct vnic_route *routes, int count) {
+    struct vnic_lpm *lpm;
+    size_t max_nodes = 1;
+    int len, i;
+
+    // Each route adds at most one node for each level above the one it ends in
+    for (i = 0; i < count; i++) {
+        if (routes[i].prefix_len > VNIC_LPM_STRIDE) {
+            max_nodes += (routes[i].prefix_len - 1) / VNIC_LPM_STRIDE;
+        }
+    }
+    lpm = vnic_core_zalloc(sizeof(struct vnic_lpm) + sizeof(struct vnic_route) * count +
+                           sizeof(u32[VNIC_LPM_FANOUT]) * max_nodes);
+    if (!lpm) {
+        return NULL;
+    }
+    lpm->nodes = (void *)&lpm->routes[count];
+    lpm->node_count = 1;
+
+    for (len = 0; len <= 32; len++) {
+        for (i = 0; i < count; i++) {
+            if (routes[i].prefix_len != len) {
+                continue;
+            }
+            lpm->routes[lpm->route_count] = routes[i];
+            lpm->routes[lpm->route_count].prefix &= vnic_prefix_mask(len);
+            vnic_lpm_add(lpm, lpm->route_count++);
+        }
+    }
+    return lpm;
+}
+
+void vnic_lpm_free(struct vnic_lpm *lpm) {
+    vnic_core_free(lpm);
+}
+
+/**
+ * Finds the value of the longest route to ip_addr.
+ * Returns NULL if no route covers ip_addr
+ */
+void *vnic_lpm_lookup(struct vnic_lpm *lpm, u32 ip_addr) {
+    int shift = 32 - VNIC_LPM_STRIDE;
+    u32 entry = lpm->nodes[0][ip_addr >> shift];
+
+    while (entry & VNIC_LPM_CHILD) {
+        shift -= VNIC_LPM_STRIDE;
+        entry = lpm->nodes[entry & ~VNIC_LPM_CHILD][(ip_addr >> shift) & (VNIC_LPM_FANOUT - 1)];
+    }
+    return entry ? lpm->routes[entry - 1].value : NULL;
+}
+
+/**
+ * ===============================================================
+ *                          Timing wheel
+ * ===============================================================
+ */
+
+// The ticks of one turn of the top level, less one
+#define VNIC_WHEEL_TURN_MASK ((1ULL << (VNIC_WHEEL_LEVELS * VNIC_WHEEL_BITS)) - 1)
+
+/**
+ * Adds entry to the wheel. An entry which is already due goes in the current level 0 slot,
+ * to be returned by the next vnic_wheel_run
+ */
+void vnic_wheel_insert(struct vnic_wheel *wheel, struct vnic_wheel_entry *entry) {
+    // There is no slot to cascade from after the current turn of the top level, so later
+    // entries are placed by its last tick, and placed again once it comes round
+    u64 last = wheel->clock | VNIC_WHEEL_TURN_MASK;
+    u64 tick = entry->due < wheel->clock ? wheel->clock : entry->due;
+    struct vnic_wheel_slot *slot;
+    int level = 0;
+    int index;
+
+    if (tick > last) {
+        tick = last;
+    }
+    if (tick ^ wheel->clock) {
+        level = (fls64(tick ^ wheel->clock) - 1) / VNIC_WHEEL_BITS;
+    }
+
+    index = (tick >> (level * VNIC_WHEEL_BITS)) & VNIC_WHEEL_MASK;
+    slot = &wheel->slots[level][index];
+    entry->next = NULL;
+    if (slot->head) {
+        slot->tail->next = entry;
+    } else {
+        slot->head = entry;
+        wheel->occupied[level][index / 64] |= 1ULL << (index % 64);
+    }
+    slot->tail = entry;
+}
+
+/**
+ * Empties a slot, returning its entries as a list
+ */
+static struct vnic_wheel_entry *vnic_wheel_take(struct vnic_wheel *wheel, int level, int index) {
+    struct vnic_wheel_entry *list = wheel->slots[level][index].head;
+
+    wheel->slots[level][index].head = NULL;
+    wheel->slots[level][index].tail = NULL;
+    wheel->occupied[level][index / 64] &= ~(1ULL << (index % 64));
+    return list;
+}
+
+/**
+ * Returns the first slot of level from start on which holds entries, or VNIC_WHEEL_SIZE
+ * if there is none
+ */
+static unsigned int vnic_wheel_find(struct vnic_wheel *wheel, int level, unsigned int start) {
+    unsigned int word = start / 64;
+    u64 bits;
+
+    if (start >= VNIC_WHEEL_SIZE) {
+        return VNIC_WHEEL_SIZE;
+    }
+    bits = wheel->occupied[level][word] & (~0ULL << (start % 64));
+    while (!bits) {
+        if (++word == VNIC_WHEEL_SIZE / 64) {
+            return VNIC_WHEEL_SIZE;
+        }
+        bits = wheel->occupied[level][word];
+    }
+    return word * 64 + __ffs64(bits);
+}
+
+/**
+ * Moves the clock forward to tick, cascading the slots which start at tick into the
+ * levels below. No slots may be skipped over which hold entries
+ */
+static void vnic_wheel_set_clock(struct vnic_wheel *wheel, u64 tick) {
+    struct vnic_wheel_entry *list, *next;
+    int level;
+
+    wheel->clock = tick;
+    for (level = 1; level < VNIC_WHEEL_LEVELS; level++) {
+        if (tick & ((1ULL << (level * VNIC_WHEEL_BITS)) - 1)) {
+            break;
+        }
+        list = vnic_wheel_take(wheel, level, (tick >> (level * VNIC_WHEEL_BITS)) & VNIC_WHEEL_MASK);
+        for (; list; list = next) {
+            next = list->next;
+            vnic_wheel_insert(wheel, list);
+        }
+    }
+}
+
+/**
+ * Finds the next tick which needs handling, either to return a level 0 slot or to
+ * cascade a higher one. Lower levels always come first, as higher levels only hold
+ * entries from later turns of the levels below them.
+ * Returns U64_MAX if the wheel is empty
+ */
+u64 vnic_wheel_next(struct vnic_wheel *wheel) {
+    int level;
+
+    for (level = 0; level < VNIC_WHEEL_LEVELS; level++) {
+        int shift = level * VNIC_WHEEL_BITS;
+        // Level 0 can hold entries due now, higher levels only from their next slot on
+        unsigned int start = ((wheel->clock >> shift) & VNIC_WHEEL_MASK) + (level ? 1 : 0);
+        unsigned int index = vnic_wheel_find(wheel, level, start);
+
+        if (index < VNIC_WHEEL_SIZE) {
+            u64 turn = (wheel->clock >> (shift + VNIC_WHEEL_BITS)) << (shift + VNIC_WHEEL_BITS);
+            return turn + ((u64)index << shift);
+        }
+    }
+    return U64_MAX;
+}
+
+/**
+ * Handles every tick up to and including now.
+ * Returns the entries which are due, as a list
+ */
+struct vnic_wheel_entry *vnic_wheel_run(struct vnic_wheel *wheel, u64 now) {
+    struct vnic_wheel_entry *due = NULL, **tail = &due;
+    struct vnic_wheel_entry *list, *entry;
+    u64 next;
+
+    while ((next = vnic_wheel_next(wheel)) <= now) {
+        if (next > wheel->clock) {
+            vnic_wheel_set_clock(wheel, next);
+            continue;
+        }
+        list = vnic_wheel_take(wheel, 0, wheel->clock & VNIC_WHEEL_MASK);
+        vnic_wheel_set_clock(wheel, wheel->clock + 1);
+        while ((entry = list) != NULL) {
+            list = entry->next;
+            if (entry->due < wheel->clock) {
+                *tail = entry;
+                tail = &entry->next;
+            } else {
+                // Held at the end of a turn of the top level, and due in a later one
+                vnic_wheel_insert(wheel, entry);
+            }
+        }
+    }
+    *tail = NULL;
+    if (next == U64_MAX && wheel->clock <= now) {
+        // Nothing is waiting, so the clock can jump straight to now
+        wheel->clock = now + 1;
+    }
+    return due;
+}
+
+/**
+ * Takes the entries which match out of the wheel, or every entry if match is NULL.
+ * Returns the entries taken, as a list
+ */
+struct vnic_wheel_entry *vnic_wheel_remove(struct vnic_wheel *wheel,
+                                           bool (*match)(struct vnic_wheel_entry *entry, void *arg),
+                                           void *arg) {
+    struct vnic_wheel_entry *removed = NULL;
+    struct vnic_wheel_entry *entry, **pos;
+    struct vnic_wheel_slot *slot;
+    unsigned int index;
+    int level;
+
+    for (level = 0; level < VNIC_WHEEL_LEVELS; level++) {
+        for (index = vnic_wheel_find(wheel, level, 0); index < VNIC_WHEEL_SIZE;
+             index = vnic_wheel_find(wheel, level, index + 1)) {
+            slot = &wheel->slots[level][index];
+            slot->tail = NULL;
+            for (pos = &slot->head; (entry = *pos) != NULL;) {
+                if (!match || match(entry, arg)) {
+                    *pos = entry->next;
+                    entry->next = removed;
+                    removed = entry;
+                } else {
+                    slot->tail = entry;
+                    pos = &entry->next;
+                }
+            }
+            if (!slot->head) {
+                wheel->occupied[level][index / 64] &= ~(1ULL << (index % 64));
+            }
+        }
+    }
+    return removed;
+}
+
+/**
+ * ===============================================================
+ *                            Parsing
+ * ===============================================================
+ */
+
+static int vnic_hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/**
+ * Parses the first len characters of str as a dotted decimal IPv4 address, storing it in
+ * ip_addr in host byte order. Needs no terminator, so addresses can be parsed in place
+ * from a list.
+ * Returns 0 on success, -EINVAL if str is not exactly an address
+ */
+int vnic_parse_ip(const char *str, size_t len, u32 *ip_addr) {
+    u32 result = 0;
+    u32 octet = 0;
+    int digits = 0;
+    int dots = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (str[i] >= '0' && str[i] <= '9') {
+            octet = octet * 10 + (str[i] - '0');
+            if (++digits > 3 || octet > 255) {
+                return -EINVAL;
+            }
+        } else if (str[i] == '.' && digits && dots < 3) {
+            result = (result << 8) | octet;
+            octet = 0;
+            digits = 0;
+            dots++;
+        } else {
+            return -EINVAL;
+        }
+    }
+    if (!digits || dots != 3) {
+        return -EINVAL;
+    }
+    *ip_addr = (result << 8) | octet;
+    return 0;
+}
+
+/**
+ * Parses the first len characters of str as a prefix in the form a.b.c.d/len, storing
+ * the address in host byte order. An address with no length is taken as a /32
+ * Returns 0 on success, -EINVAL if str is not exactly a prefix
+ */
+int vnic_parse_prefix(const char *str, size_t len, u32 *prefix, int *prefix_len) {
+    size_t slash;
+    int bits = 0;
+    size_t i;
+
+    for (slash = 0; slash < len && str[slash] != '/'; slash++) {
+    }
+    if (slash == len) {
+        *prefix_len = 32;
+        return vnic_parse_ip(str, len, prefix);
+    }
+    if (slash + 1 == len || len - slash > 3) {
+        return -EINVAL;
+    }
+    for (i = slash + 1; i < len; i++) {
+        if (str[i] < '0' || str[i] > '9') {
+            return -EINVAL;
+        }
+        bits = bits * 10 + (str[i] - '0');
+    }
+    if (bits > 32 || vnic_parse_ip(str, slash, prefix)) {
+        return -EINVAL;
+    }
+    *prefix_len = bits;
+    return 0;
+}
+
+/**
+ * Parses the first len characters of str as a MAC address of six pairs of hex digits,
+ * separated by ':' or '-', storing it in mac.
+ * Returns 0 on success, -EINVAL if str is not exactly an address
+ */
+int vnic_parse_mac(const char *str, size_t len, u8 *mac) {
+    int high, low;
+    int i;
+
+    if (len != 3 * ETH_ALEN - 1) {
+        return -EINVAL;
+    }
+    for (i = 0; i < ETH_ALEN; i++) {
+        high = vnic_hex_digit(str[i * 3]);
+        low = vnic_hex_digit(str[i * 3 + 1]);
+        if (high < 0 || low < 0) {
+            return -EINVAL;
+        }
+        if (i < ETH_ALEN - 1 && str[i * 3 + 2] != ':' && str[i * 3 + 2] != '-') {
+            return -EINVAL;
+        }
+        mac[i] = (high << 4) | low;
+    }
+    return 0;
+}
@@ -0,0 +1,162 @@
+/**
+ * Routing core of the vnic module: the table of IP addresses to devices, the forwarding
+ * table of routes to prefixes, parsing of the addresses given on the command line, and
+ * the timing wheel which holds the packets of emulated links. The core builds both in the kernel, as part of
+ * vnic.ko, and as a plain userspace library, so that it can be measured and tuned by
+ * bench/core_bench.c, and tested by bench/core_test.c, without loading the module. It
+ * depends on nothing else in the module.
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#ifndef VNIC_CORE_H
+#define VNIC_CORE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/rcupdate.h>
+#else
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+#define __rcu
+#define U64_MAX UINT64_MAX
+#endif
+
+/**
+ * Value of a slot whose entry has been removed. Tombstones keep the probe sequence of
+ * other entries intact, and are cleared when the table is rebuilt.
+ */
+#define VNIC_TOMBSTONE ((void *)1)
+
+/**
+ * An entry in the lookup table. value is NULL if the slot has never been used
+ */
+struct vnic_ip_slot {
+    u32 ip_addr;
+    void __rcu *value;
+};
+
+/**
+ * Open-addressed table of IP addresses to values, probed linearly.
+ * In the kernel the values are net_devices. Lookups are lock-free and may run alongside
+ * a single writer, which is left to the caller to serialise. The table is never resized
+ * in place: a resized copy is built with vnic_ip_table_copy and published instead.
+ */
+struct vnic_ip_table {
+#ifdef __KERNEL__
+    struct rcu_head rcu; /* For freeing the table once readers have finished with it */
+#endif
+    int hash_bits;
+    int len;
+    int count; /* Number of live entries */
+    int used;  /* Number of slots that are not empty, including tombstones */
+    struct vnic_ip_slot slots[];
+};
+
+struct vnic_ip_table *vnic_ip_table_alloc(int entries);
+void vnic_ip_table_free(struct vnic_ip_table *table);
+int vnic_ip_table_insert(struct vnic_ip_table *table, u32 ip_addr, void *value);
+int vnic_ip_table_remove(struct vnic_ip_table *table, u32 ip_addr);
+int vnic_ip_table_remove_value(struct vnic_ip_table *table, void *value);
+void *vnic_ip_table_lookup(struct vnic_ip_table *table, u32 ip_addr, int *probes);
+void *vnic_ip_table_entry(struct vnic_ip_table *table, int index, u32 *ip_addr);
+void vnic_ip_table_copy(struct vnic_ip_table *dst, struct vnic_ip_table *src);
+int vnic_ip_table_resize_hint(struct vnic_ip_table *table, bool adding);
+
+/**
+ * A route of every address in prefix/prefix_len to value
+ */
+struct vnic_route {
+    u32 prefix;
+    int prefix_len;
+    void *value;
+};
+
+// Bits of the address used at each level of the forwarding table
+#define VNIC_LPM_STRIDE 8
+#define VNIC_LPM_FANOUT (1 << VNIC_LPM_STRIDE)
+// Set in an entry of a node which points to the node for the next level
+#define VNIC_LPM_CHILD 0x80000000u
+
+/**
+ * Forwarding table, a multibit trie with a stride of 8 bits, so that a longest prefix
+ * match takes at most four reads of one cache line each.
+ * Routes are expanded to cover every entry of the level they end in, and pushed down
+ * into the nodes of longer routes beneath them, so a lookup stops at the first entry
+ * with no child and needs no backtracking. An entry is 0 if no route covers it, the
+ * index of a route plus 1, or VNIC_LPM_CHILD with the index of a node.
+ * The table is never changed once built: it is rebuilt from its routes and published
+ * in place of the old one, so lookups need no locking.
+ */
+struct vnic_lpm {
+#ifdef __KERNEL__
+    struct rcu_head rcu; /* For freeing the table once readers have finished with it */
+#endif
+    int route_count;
+    int node_count;
+    u32 (*nodes)[VNIC_LPM_FANOUT];
+    struct vnic_route routes[];
+};
+
+/**
+ * Returns the netmask of a prefix length, in host byte order
+ */
+static inline u32 vnic_prefix_mask(int prefix_len) {
+    return prefix_len ? ~0u << (32 - prefix_len) : 0;
+}
+
+struct vnic_lpm *vnic_lpm_build(const struct vnic_route *routes, int count);
+void vnic_lpm_free(struct vnic_lpm *lpm);
+void *vnic_lpm_lookup(struct vnic_lpm *lpm, u32 ip_addr);
+
+// 4 levels of 256 slots cover 2^32 ticks of a timing wheel
+#define VNIC_WHEEL_BITS 8
+#define VNIC_WHEEL_SIZE (1 << VNIC_WHEEL_BITS)
+#define VNIC_WHEEL_MASK (VNIC_WHEEL_SIZE - 1)
+#define VNIC_WHEEL_LEVELS 4
+
+/**
+ * An entry in a timing wheel, embedded in what is being timed
+ */
+struct vnic_wheel_entry {
+    struct vnic_wheel_entry *next;
+    u64 due; /* In ticks */
+};
+
+struct vnic_wheel_slot {
+    struct vnic_wheel_entry *head;
+    struct vnic_wheel_entry *tail;
+};
+
+/**
+ * Hierarchical timing wheel, so that adding and expiring an entry costs O(1) however many
+ * are waiting. An entry goes in the lowest level whose slots are long enough to cover the
+ * time until it is due. When the wheel comes round to a slot above level 0 its entries are
+ * cascaded into lower levels, and entries in a level 0 slot are due.
+ * Entries in level l agree with clock in every bit above the slots of level l, so the
+ * slots of a level only ever hold entries from the current turn of the level above.
+ * Entries due after the current turn of the top level are held in the last slot which
+ * comes round before it ends, and placed again from there. The wheel does no locking.
+ */
+struct vnic_wheel {
+    u64 clock; /* Every tick before this has been handled */
+    u64 occupied[VNIC_WHEEL_LEVELS][VNIC_WHEEL_SIZE / 64];
+    struct vnic_wheel_slot slots[VNIC_WHEEL_LEVELS][VNIC_WHEEL_SIZE];
+};
+
+void vnic_wheel_insert(struct vnic_wheel *wheel, struct vnic_wheel_entry *entry);
+u64 vnic_wheel_next(struct vnic_wheel *wheel);
+struct vnic_wheel_entry *vnic_wheel_run(struct vnic_wheel *wheel, u64 now);
+struct vnic_wheel_entry *vnic_wheel_remove(struct vnic_wheel *wheel,
+                                           bool (*match)(struct vnic_wheel_entry *entry, void *arg),
+                                           void *arg);
+
+int vnic_parse_ip(const char *str, size_t len, u32 *ip_addr);
+int vnic_parse_prefix(const char *str, size_t len, u32 *prefix, int *prefix_len);
+int vnic_parse_mac(const char *str, size_t len, u8 *mac);
+
+#endif
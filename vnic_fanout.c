@@ -0,0 +1,545 @@
+/**
+ * Broadcast and multicast fan-out
+ *
+ * Unicast packets are delivered to the one vnic with their destination address. Packets
+ * to a multicast group, to the limited broadcast address, or to the broadcast address of
+ * a subnet are instead delivered to every vnic listening for them, once they have left
+ * the network simulator. Each vnic gets a clone of the packet which shares its data, so a
+ * packet sent to hundreds of vnics is never copied. The clones join the batch of the
+ * sending CPU like any other packet, and are delivered to each receive queue in one go.
+ *
+ * Group membership is learned the way a NIC learns it: the stack in each namespace adds
+ * the multicast MAC of every group a socket joins to the device, and the device follows
+ * its list through ndo_set_rx_mode. A vnic in allmulti or promiscuous mode receives
+ * every group. Subnets are learned from the IPv4 addresses of the vnics, and a vnic
+ * receives the broadcasts of every subnet it has an address in. Vnics with a role for
+ * the network simulator receive neither.
+ *
+ * The table is rebuilt as a whole, under RTNL, whenever membership or addresses change,
+ * and replaced under RCU, so the data path looks packets up without a lock. A vnic being
+ * destroyed is instead cleared from the sets of the current table in place, so that
+ * destroying every vnic does not rebuild the table once for each of them.
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/in.h>
+#include <linux/inetdevice.h>
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/jump_label.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/rtnetlink.h>
+#include <net/ip.h>
+
+#include "vnic.h"
+#include "if_vnic.h"
+
+#define FANOUT_HASH_BITS 8
+
+// Keys of broadcast sets have this bit set above the broadcast address. Keys of multicast
+// sets are the multicast MAC, which takes up the 48 bits below it
+#define FANOUT_KEY_BROADCAST BIT_ULL(48)
+
+struct vnic_fanout_member {
+    struct net_device *dev; /* NULL once the vnic has been destroyed */
+    __be32 addr; /* First IPv4 address of the vnic, 0 if it has none */
+};
+
+/**
+ * The vnics a broadcast or multicast packet is delivered to
+ */
+struct vnic_fanout_set {
+    struct hlist_node node;
+    struct hlist_node subnet_node; /* In subnets of the table, for broadcast sets */
+    u64 key;
+    __be32 prefix; /* Subnet of a broadcast set */
+    __be32 mask;
+    unsigned int count;
+    unsigned int size; /* Members there is room for */
+    struct vnic_fanout_member *members;
+};
+
+struct vnic_fanout_table {
+    DECLARE_HASHTABLE(sets, FANOUT_HASH_BITS);
+    struct hlist_head subnets;
+    struct vnic_fanout_set allmulti; /* Vnics which receive every multicast group */
+    struct rcu_head rcu;
+};
+
+/**
+ * The current table, or NULL while no vnic listens for broadcasts or multicasts.
+ * Replaced under RTNL
+ */
+static struct vnic_fanout_table __rcu *vnic_fanout_table;
+
+/**
+ * Enabled while there is a table, so that vnic_xmit only looks for sets when there are some
+ */
+DEFINE_STATIC_KEY_FALSE(vnic_fanout_key);
+
+static void vnic_fanout_work_fn(struct work_struct *work);
+static DECLARE_WORK(vnic_fanout_work, vnic_fanout_work_fn);
+static bool vnic_fanout_notifier_registered;
+
+/**
+ * ===============================================================
+ *                             Data path
+ * ===============================================================
+ */
+
+static struct vnic_fanout_set *vnic_fanout_find(struct vnic_fanout_table *table, u64 key) {
+    struct vnic_fanout_set *set;
+
+    hash_for_each_possible(table->sets, set, node, key) {
+        if (set->key == key) {
+            return set;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Finds the vnics a packet from the network simulator is delivered to: the members of its
+ * multicast group, the vnics in the subnet of its source for the limited broadcast
+ * address, or the vnics in the subnet its destination is the broadcast address of.
+ * Must be called under rcu_read_lock_bh(), which the set is valid until the end of.
+ * Returns NULL if no vnic listens for the destination
+ */
+const struct vnic_fanout_set *vnic_fanout_lookup(const struct iphdr *iph) {
+    struct vnic_fanout_table *table = rcu_dereference_bh(vnic_fanout_table);
+    struct vnic_fanout_set *set;
+    u8 mac[ETH_ALEN];
+
+    if (!table) {
+        return NULL;
+    }
+
+    if (ipv4_is_multicast(iph->daddr)) {
+        ip_eth_mc_map(iph->daddr, (char *)mac);
+        set = vnic_fanout_find(table, ether_addr_to_u64(mac));
+        return set ? set : (table->allmulti.count ? &table->allmulti : NULL);
+    }
+    if (ipv4_is_lbcast(iph->daddr)) {
+        hlist_for_each_entry(set, &table->subnets, subnet_node) {
+            if ((iph->saddr & set->mask) == set->prefix) {
+                return set;
+            }
+        }
+        return NULL;
+    }
+    return vnic_fanout_find(table, FANOUT_KEY_BROADCAST | ntohl(iph->daddr));
+}
+
+/**
+ * Delivers skb, sent from dev, to every vnic of set but the one it came from. Every vnic
+ * but the last gets a clone sharing the data of skb, and the last gets skb itself,
+ * counted by Byte Queue Limits against txq. Receivers which are full drop their copy,
+ * rather than stopping the sender for every other receiver.
+ * Must be called with bottom halves disabled, as is the case in vnic_xmit.
+ * Returns the number of vnics the packet was delivered to
+ */
+int vnic_fanout_xmit(const struct vnic_fanout_set *set, struct net_device *dev,
+                     struct sk_buff *skb, struct netdev_queue *txq) {
+    __be32 saddr = ip_hdr(skb)->saddr;
+    struct net_device *prev = NULL;
+    struct sk_buff *clone;
+    int delivered = 0;
+    unsigned int i;
+
+    for (i = 0; i < set->count; i++) {
+        const struct vnic_fanout_member *member = &set->members[i];
+        struct net_device *member_dev = READ_ONCE(member->dev);
+
+        // As a switch floods a frame to every port but the one it came in on
+        if (!member_dev || member_dev == dev || (member->addr && member->addr == saddr)) {
+            continue;
+        }
+        if (prev) {
+            clone = skb_clone(skb, GFP_ATOMIC);
+            if (!clone) {
+                vnic_count_drops(prev, VNIC_DROP_NO_MEM, 1);
+            } else {
+                vnic_count(dev, VNIC_FANOUT_CLONED);
+                if (__vnic_rx(prev, clone, NULL) == NET_RX_SUCCESS) {
+                    delivered++;
+                }
+            }
+        }
+        prev = member_dev;
+    }
+
+    if (!prev) {
+        vnic_drop(dev, skb, VNIC_DROP_NO_DEST);
+        return 0;
+    }
+    if (__vnic_rx(prev, skb, txq) == NET_RX_SUCCESS) {
+        delivered++;
+    }
+    return delivered;
+}
+
+/**
+ * ===============================================================
+ *                          Building the table
+ * ===============================================================
+ */
+
+static void vnic_fanout_free_table(struct vnic_fanout_table *table) {
+    struct vnic_fanout_set *set;
+    struct hlist_node *tmp;
+    int bkt;
+
+    if (!table) {
+        return;
+    }
+    hash_for_each_safe(table->sets, bkt, tmp, set, node) {
+        kfree(set->members);
+        kfree(set);
+    }
+    kfree(table->allmulti.members);
+    kfree(table);
+}
+
+static void vnic_fanout_free_rcu(struct rcu_head *head) {
+    vnic_fanout_free_table(container_of(head, struct vnic_fanout_table, rcu));
+}
+
+/**
+ * Adds dev to set, unless it is already a member. Each vnic is added to every set it
+ * belongs to before the next vnic is, so it can only be the last member added
+ * Returns 0 on success, -ENOMEM on failure
+ */
+static int vnic_fanout_add_member(struct vnic_fanout_set *set, struct net_device *dev,
+                                  __be32 addr, gfp_t gfp) {
+    struct vnic_fanout_member *members;
+
+    if (set->count && set->members[set->count - 1].dev == dev) {
+        return 0;
+    }
+    if (set->count == set->size) {
+        members = krealloc(set->members, max(4U, 2 * set->size) * sizeof(*members), gfp);
+        if (!members) {
+            return -ENOMEM;
+        }
+        set->members = members;
+        set->size = max(4U, 2 * set->size);
+    }
+    set->members[set->count].dev = dev;
+    set->members[set->count].addr = addr;
+    set->count++;
+    return 0;
+}
+
+/**
+ * Finds the set with key in a table being built, adding an empty one if there is none
+ * Returns NULL if memory runs out
+ */
+static struct vnic_fanout_set *vnic_fanout_get_set(struct vnic_fanout_table *table, u64 key,
+                                                   gfp_t gfp) {
+    struct vnic_fanout_set *set = vnic_fanout_find(table, key);
+
+    if (!set) {
+        set = kzalloc(sizeof(struct vnic_fanout_set), gfp);
+        if (set) {
+            set->key = key;
+            hash_add(table->sets, &set->node, key);
+        }
+    }
+    return set;
+}
+
+/**
+ * Adds dev to the sets of the subnets it has addresses in, and of the multicast groups
+ * it listens to. Must be called under RTNL
+ * Returns 0 on success, -ENOMEM on failure
+ */
+static int vnic_fanout_add_dev(struct vnic_fanout_table *table, struct net_device *dev) {
+    struct in_device *in_dev = __in_dev_get_rtnl(dev);
+    struct vnic_fanout_set *set;
+    struct netdev_hw_addr *ha;
+    const struct in_ifaddr *ifa;
+    __be32 addr = 0;
+    int result = 0;
+
+    if (in_dev) {
+        in_dev_for_each_ifa_rtnl(ifa, in_dev) {
+            if (!addr) {
+                addr = ifa->ifa_local;
+            }
+            // Addresses with no broadcast, such as /32s, have no subnet to broadcast to
+            if (!ifa->ifa_broadcast) {
+                continue;
+            }
+            set = vnic_fanout_get_set(table, FANOUT_KEY_BROADCAST | ntohl(ifa->ifa_broadcast),
+                                      GFP_KERNEL);
+            if (!set) {
+                return -ENOMEM;
+            }
+            if (!set->count) {
+                set->prefix = ifa->ifa_local & ifa->ifa_mask;
+                set->mask = ifa->ifa_mask;
+                hlist_add_head(&set->subnet_node, &table->subnets);
+            }
+            if (vnic_fanout_add_member(set, dev, ifa->ifa_local, GFP_KERNEL)) {
+                return -ENOMEM;
+            }
+        }
+    }
+
+    if (dev->flags & (IFF_ALLMULTI | IFF_PROMISC)) {
+        return vnic_fanout_add_member(&table->allmulti, dev, addr, GFP_KERNEL);
+    }
+
+    netif_addr_lock_bh(dev);
+    netdev_for_each_mc_addr(ha, dev) {
+        // Only MACs which IPv4 groups map to, 01:00:5e followed by 23 bits of the group
+        if (ha->addr[0] != 0x01 || ha->addr[1] != 0x00 || ha->addr[2] != 0x5e ||
+            (ha->addr[3] & 0x80)) {
+            continue;
+        }
+        set = vnic_fanout_get_set(table, ether_addr_to_u64(ha->addr), GFP_ATOMIC);
+        if (!set || vnic_fanout_add_member(set, dev, addr, GFP_ATOMIC)) {
+            result = -ENOMEM;
+            break;
+        }
+    }
+    netif_addr_unlock_bh(dev);
+    return result;
+}
+
+/**
+ * Builds a new table from the addresses and multicast lists of every vnic, and replaces
+ * the current one with it. The current table is kept if memory runs out, which leaves no
+ * destroyed vnic in it, as they are cleared from it in place.
+ * Must be called under RTNL
+ */
+static void vnic_fanout_rebuild(void) {
+    struct vnic_fanout_table *table, *old;
+    struct vnic_fanout_set *set;
+    struct net_device *dev;
+    unsigned int i;
+    int bkt;
+
+    table = kzalloc(sizeof(struct vnic_fanout_table), GFP_KERNEL);
+    if (!table) {
+        goto fail;
+    }
+    hash_init(table->sets);
+    INIT_HLIST_HEAD(&table->subnets);
+
+    for (dev = vnic_next(NULL); dev; dev = vnic_next(dev)) {
+        if (vnic_netsim_role(dev) != VNIC_NETSIM_NONE) {
+            continue;
+        }
+        if (vnic_fanout_add_dev(table, dev)) {
+            goto fail;
+        }
+    }
+
+    // Vnics in allmulti mode receive the groups other vnics have joined as well
+    for (i = 0; i < table->allmulti.count; i++) {
+        hash_for_each(table->sets, bkt, set, node) {
+            if (!(set->key & FANOUT_KEY_BROADCAST) &&
+                vnic_fanout_add_member(set, table->allmulti.members[i].dev,
+                                       table->allmulti.members[i].addr, GFP_KERNEL)) {
+                goto fail;
+            }
+        }
+    }
+
+    if (hash_empty(table->sets) && !table->allmulti.count) {
+        vnic_fanout_free_table(table);
+        table = NULL;
+    }
+    old = rcu_replace_pointer(vnic_fanout_table, table, lockdep_rtnl_is_held());
+    if (table) {
+        static_branch_enable(&vnic_fanout_key);
+    } else {
+        static_branch_disable(&vnic_fanout_key);
+    }
+    if (old) {
+        call_rcu(&old->rcu, vnic_fanout_free_rcu);
+    }
+    return;
+
+fail:
+    vnic_fanout_free_table(table);
+    printk(KERN_ALERT "vnic: Error - out of memory building the broadcast and multicast table\n");
+}
+
+static void vnic_fanout_work_fn(struct work_struct *work) {
+    rtnl_lock();
+    vnic_fanout_rebuild();
+    rtnl_unlock();
+}
+
+/**
+ * ndo_set_rx_mode method. The multicast list or flags of dev have changed, so the table is
+ * rebuilt. Called with the address list of dev locked, so the rebuild is left to a work item
+ */
+void vnic_fanout_set_rx_mode(struct net_device *dev) {
+    schedule_work(&vnic_fanout_work);
+}
+
+static void vnic_fanout_clear_member(struct vnic_fanout_set *set, struct net_device *dev) {
+    unsigned int i;
+
+    for (i = 0; i < set->count; i++) {
+        if (set->members[i].dev == dev) {
+            WRITE_ONCE(set->members[i].dev, NULL);
+            return;
+        }
+    }
+}
+
+/**
+ * Removes dev from the table, in place, so that it cannot fail. Tables built from then
+ * on leave dev out, as it is no longer in the list of vnics, and drop its cleared members.
+ * Must be called under RTNL, after dev has been removed from the list of vnics, and
+ * before waiting for senders which may still be using the table
+ */
+void vnic_fanout_remove_dev(struct net_device *dev) {
+    struct vnic_fanout_table *table = rtnl_dereference(vnic_fanout_table);
+    struct vnic_fanout_set *set;
+    int bkt;
+
+    if (!table) {
+        return;
+    }
+    vnic_fanout_clear_member(&table->allmulti, dev);
+    hash_for_each(table->sets, bkt, set, node) {
+        vnic_fanout_clear_member(set, dev);
+    }
+}
+
+/**
+ * Rebuilds the table when an address of a vnic is added or removed
+ */
+static int vnic_fanout_inetaddr_event(struct notifier_block *nb, unsigned long event,
+                                      void *ptr) {
+    struct in_ifaddr *ifa = ptr;
+
+    if (vnic_is_vnic(ifa->ifa_dev->dev)) {
+        schedule_work(&vnic_fanout_work);
+    }
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block vnic_fanout_inetaddr_notifier = {
+    .notifier_call = vnic_fanout_inetaddr_event,
+};
+
+/**
+ * ===============================================================
+ *                             debugfs
+ * ===============================================================
+ */
+
+static void vnic_fanout_show_members(struct seq_file *m, const struct vnic_fanout_set *set) {
+    struct net_device *dev;
+    unsigned int i;
+
+    for (i = 0; i < set->count; i++) {
+        dev = READ_ONCE(set->members[i].dev);
+        if (dev) {
+            seq_printf(m, " %s", dev->name);
+        }
+    }
+}
+
+/**
+ * Lists each multicast group and subnet with the vnics it is delivered to
+ */
+static int vnic_fanout_show(struct seq_file *m, void *v) {
+    const struct vnic_fanout_table *table;
+    const struct vnic_fanout_set *set;
+    u8 mac[ETH_ALEN];
+    __be32 addr;
+    int bkt;
+
+    seq_printf(m, "%-9s %-17s %-18s %s\n", "type", "address", "subnet", "vnics");
+    rcu_read_lock();
+    table = rcu_dereference(vnic_fanout_table);
+    if (table) {
+        hash_for_each(table->sets, bkt, set, node) {
+            if (set->key & FANOUT_KEY_BROADCAST) {
+                addr = htonl((u32)set->key);
+                seq_printf(m, "%-9s %-17pI4 %15pI4/%-2d", "broadcast", &addr, &set->prefix,
+                           inet_mask_len(set->mask));
+            } else {
+                u64_to_ether_addr(set->key, mac);
+                seq_printf(m, "%-9s %pM %-18s", "multicast", mac, "-");
+            }
+            vnic_fanout_show_members(m, set);
+            seq_putc(m, '\n');
+        }
+        if (table->allmulti.count) {
+            seq_printf(m, "%-9s %-17s %-18s", "allmulti", "-", "-");
+            vnic_fanout_show_members(m, &table->allmulti);
+            seq_putc(m, '\n');
+        }
+    }
+    rcu_read_unlock();
+    return 0;
+}
+
+static int vnic_fanout_open(struct inode *inode, struct file *file) {
+    return single_open(file, vnic_fanout_show, NULL);
+}
+
+static const struct file_operations vnic_fanout_fops = {
+    .owner = THIS_MODULE,
+    .open = vnic_fanout_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+void vnic_fanout_debugfs_init(struct dentry *root) {
+    debugfs_create_file("fanout", 0400, root, NULL, &vnic_fanout_fops);
+}
+
+/**
+ * ===============================================================
+ *                        Setup and cleanup
+ * ===============================================================
+ */
+
+/**
+ * Starts following the addresses of the vnics. Must be called before any vnic is created
+ * Returns 0 on success, or a negative error
+ */
+int vnic_fanout_init(void) {
+    int result = register_inetaddr_notifier(&vnic_fanout_inetaddr_notifier);
+
+    vnic_fanout_notifier_registered = !result;
+    return result;
+}
+
+/**
+ * Stops following addresses and frees the table. Must be called once every vnic has been
+ * destroyed
+ */
+void vnic_fanout_cleanup(void) {
+    struct vnic_fanout_table *table;
+
+    if (vnic_fanout_notifier_registered) {
+        unregister_inetaddr_notifier(&vnic_fanout_inetaddr_notifier);
+        vnic_fanout_notifier_registered = false;
+    }
+    cancel_work_sync(&vnic_fanout_work);
+
+    table = rcu_dereference_protected(vnic_fanout_table, true);
+    RCU_INIT_POINTER(vnic_fanout_table, NULL);
+    static_branch_disable(&vnic_fanout_key);
+    synchronize_net();
+    vnic_fanout_free_table(table);
+}
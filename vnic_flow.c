@@ -0,0 +1,401 @@
+/**
+ * Flows which bypass the network simulator
+ *
+ * Packets from a vnic go to the network simulator, which decides what happens to them.
+ * For flows it only passes on unchanged, the simulator can install a verdict to deliver
+ * their packets straight to the destination vnic instead, so that they no longer cross
+ * two more devices and userspace. Flows are keyed by protocol, addresses and ports, and
+ * are installed through ioctls on /dev/vnic_netsim, or through
+ * /sys/kernel/debug/vnic/flows by simulators which use the sockets of vnic0 and vnic1.
+ *
+ * The table holds at most flow_table_size flows. A flow which has carried no packets for
+ * flow_idle_timeout seconds is removed, sending its packets through the simulator again,
+ * and the flows a simulator added are removed when it closes /dev/vnic_netsim.
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/in.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/jump_label.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/rtnetlink.h>
+#include <net/ip.h>
+
+#include "vnic.h"
+#include "vnic_core.h"
+#include "vnic_netsim.h"
+
+/**
+ * Command line arguments for loading the module
+ * flow_table_size : int, the most flows which can bypass the simulator at once.
+ * flow_idle_timeout : int, seconds without a packet after which a flow is removed.
+ */
+static int flow_table_size = 4096;
+static int flow_idle_timeout = 30;
+module_param(flow_table_size, int, 0644);
+module_param(flow_idle_timeout, int, 0644);
+
+#define FLOW_HASH_BITS 10
+
+/**
+ * Enabled while any flow exists, so that vnic_xmit only looks for flows when there are some
+ */
+DEFINE_STATIC_KEY_FALSE(vnic_flow_key);
+
+struct vnic_flow_key {
+    __be32 saddr;
+    __be32 daddr;
+    __be16 sport;
+    __be16 dport;
+    u8 protocol;
+};
+
+struct vnic_flow {
+    struct hlist_node node;
+    struct rcu_head rcu;
+    struct vnic_flow_key key;
+    struct net_device *dev;
+    int owner;               /* Shard of the simulator which added the flow, -1 for debugfs */
+    unsigned long last_used; /* jiffies when the flow last carried a packet */
+};
+
+/**
+ * Flows, keyed by vnic_flow_hash. Changed under vnic_flow_mutex
+ */
+static DEFINE_HASHTABLE(vnic_flows, FLOW_HASH_BITS);
+static DEFINE_MUTEX(vnic_flow_mutex);
+static int vnic_flow_count;
+
+static void vnic_flow_age(struct work_struct *work);
+static DECLARE_DELAYED_WORK(vnic_flow_aging, vnic_flow_age);
+
+static inline u32 vnic_flow_hash(const struct vnic_flow_key *key) {
+    return jhash_3words((__force u32)key->saddr, (__force u32)key->daddr,
+                        ((__force u32)key->sport << 16) | (__force u32)key->dport,
+                        key->protocol);
+}
+
+static inline bool vnic_flow_key_equal(const struct vnic_flow_key *a,
+                                       const struct vnic_flow_key *b) {
+    return a->saddr == b->saddr && a->daddr == b->daddr && a->sport == b->sport &&
+           a->dport == b->dport && a->protocol == b->protocol;
+}
+
+/**
+ * Must be called under rcu_read_lock(), or vnic_flow_mutex
+ */
+static struct vnic_flow *vnic_flow_find(const struct vnic_flow_key *key) {
+    struct vnic_flow *flow;
+
+    hash_for_each_possible_rcu(vnic_flows, flow, node, vnic_flow_hash(key)) {
+        if (vnic_flow_key_equal(&flow->key, key)) {
+            return flow;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Finds the vnic a packet on its way to the network simulator should go to instead.
+ * Fragments are left to the simulator, since only the first carries the ports.
+ * Must be called under rcu_read_lock_bh(), as is the case in vnic_xmit.
+ * Returns NULL if the packet is not in a flow which bypasses the simulator
+ */
+struct net_device *vnic_flow_lookup(struct sk_buff *skb, struct iphdr *iph) {
+    struct vnic_flow_key key = {
+        .saddr = iph->saddr,
+        .daddr = iph->daddr,
+        .protocol = iph->protocol,
+    };
+    struct vnic_flow *flow;
+    __be16 *ports, buf[2];
+
+    if (ip_is_fragment(iph)) {
+        return NULL;
+    }
+    if (iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP) {
+        ports = skb_header_pointer(skb, skb_network_offset(skb) + iph->ihl * 4,
+                                   sizeof(buf), buf);
+        if (!ports) {
+            return NULL;
+        }
+        key.sport = ports[0];
+        key.dport = ports[1];
+    }
+
+    flow = vnic_flow_find(&key);
+    if (!flow) {
+        return NULL;
+    }
+    // Only written once a jiffy, so that a busy flow does not bounce its cache line
+    if (READ_ONCE(flow->last_used) != jiffies) {
+        WRITE_ONCE(flow->last_used, jiffies);
+    }
+    return flow->dev;
+}
+
+static void vnic_flow_remove(struct vnic_flow *flow) {
+    hash_del_rcu(&flow->node);
+    kfree_rcu(flow, rcu);
+    if (--vnic_flow_count == 0) {
+        static_branch_disable(&vnic_flow_key);
+        cancel_delayed_work(&vnic_flow_aging);
+    }
+}
+
+static inline unsigned long vnic_flow_timeout(void) {
+    return max(flow_idle_timeout, 1) * HZ;
+}
+
+/**
+ * Adds a flow delivered straight to dev, or changes the vnic of an existing one, on
+ * behalf of owner, a simulator shard or -1. Must be called under RTNL, which keeps dev from being destroyed until the flow is added.
+ * Returns 0 on success, -ENOSPC if the table is full, -ENOMEM on failure
+ */
+static int vnic_flow_add(const struct vnic_flow_key *key, struct net_device *dev, int owner) {
+    struct vnic_flow *flow, *old;
+    int result = 0;
+
+    flow = kzalloc(sizeof(struct vnic_flow), GFP_KERNEL);
+    if (!flow) {
+        return -ENOMEM;
+    }
+    flow->key = *key;
+    flow->dev = dev;
+    flow->owner = owner;
+    flow->last_used = jiffies;
+
+    mutex_lock(&vnic_flow_mutex);
+    old = vnic_flow_find(key);
+    if (old) {
+        hlist_replace_rcu(&old->node, &flow->node);
+        kfree_rcu(old, rcu);
+    } else if (vnic_flow_count >= flow_table_size) {
+        kfree(flow);
+        result = -ENOSPC;
+    } else {
+        hash_add_rcu(vnic_flows, &flow->node, vnic_flow_hash(key));
+        if (vnic_flow_count++ == 0) {
+            static_branch_enable(&vnic_flow_key);
+            schedule_delayed_work(&vnic_flow_aging, vnic_flow_timeout() / 2);
+        }
+    }
+    mutex_unlock(&vnic_flow_mutex);
+    return result;
+}
+
+/**
+ * Removes a flow, so that its packets go through the simulator again
+ * Returns 0 on success, -ENOENT if there is no such flow
+ */
+static int vnic_flow_del(const struct vnic_flow_key *key) {
+    struct vnic_flow *flow;
+
+    mutex_lock(&vnic_flow_mutex);
+    flow = vnic_flow_find(key);
+    if (flow) {
+        vnic_flow_remove(flow);
+    }
+    mutex_unlock(&vnic_flow_mutex);
+    return flow ? 0 : -ENOENT;
+}
+
+/**
+ * Removes every flow, or only those to dev if dev is not NULL, and only those added by
+ * the simulator shard owner if owner is not -1
+ */
+static void vnic_flow_remove_all(struct net_device *dev, int owner) {
+    struct hlist_node *tmp;
+    struct vnic_flow *flow;
+    int bkt;
+
+    mutex_lock(&vnic_flow_mutex);
+    hash_for_each_safe(vnic_flows, bkt, tmp, flow, node) {
+        if ((!dev || flow->dev == dev) && (owner < 0 || flow->owner == owner)) {
+            vnic_flow_remove(flow);
+        }
+    }
+    mutex_unlock(&vnic_flow_mutex);
+}
+
+void vnic_flow_clear(void) {
+    vnic_flow_remove_all(NULL, -1);
+}
+
+/**
+ * Removes the flows added by the simulator of shard, once it has closed the device
+ */
+void vnic_flow_clear_shard(int shard) {
+    vnic_flow_remove_all(NULL, shard);
+}
+
+/**
+ * Removes every flow to dev. Must be called under RTNL, before waiting for senders which
+ * may still be using the flows
+ */
+void vnic_flow_remove_dev(struct net_device *dev) {
+    vnic_flow_remove_all(dev, -1);
+}
+
+/**
+ * Removes the flows which have been idle for longer than flow_idle_timeout
+ */
+static void vnic_flow_age(struct work_struct *work) {
+    unsigned long timeout = vnic_flow_timeout();
+    struct hlist_node *tmp;
+    struct vnic_flow *flow;
+    int bkt;
+
+    mutex_lock(&vnic_flow_mutex);
+    hash_for_each_safe(vnic_flows, bkt, tmp, flow, node) {
+        if (time_after(jiffies, READ_ONCE(flow->last_used) + timeout)) {
+            vnic_flow_remove(flow);
+        }
+    }
+    if (vnic_flow_count) {
+        schedule_delayed_work(&vnic_flow_aging, timeout / 2);
+    }
+    mutex_unlock(&vnic_flow_mutex);
+}
+
+/**
+ * Adds or removes a flow described by the simulator of shard through an ioctl
+ * Returns 0 on success, or a negative error
+ */
+int vnic_flow_ioctl(unsigned int cmd, const struct vnic_netsim_flow *nf, int shard) {
+    struct vnic_flow_key key = {
+        .saddr = nf->saddr,
+        .daddr = nf->daddr,
+        .sport = nf->sport,
+        .dport = nf->dport,
+        .protocol = nf->protocol,
+    };
+    char name[IFNAMSIZ];
+    struct net_device *dev;
+    int result;
+
+    if (cmd == VNIC_NETSIM_IOC_FLOW_DEL) {
+        return vnic_flow_del(&key);
+    }
+
+    strscpy(name, nf->dev, IFNAMSIZ);
+    rtnl_lock();
+    dev = find_vnic_by_name(name);
+    result = dev ? vnic_flow_add(&key, dev, shard) : -ENODEV;
+    rtnl_unlock();
+    return result;
+}
+
+/**
+ * Lists each flow with its vnic and how long it has been idle
+ */
+static int vnic_flows_show(struct seq_file *m, void *v) {
+    struct vnic_flow *flow;
+    int bkt;
+
+    seq_printf(m, "%-5s %-21s %-21s %-15s %8s\n", "proto", "src", "dst", "dev", "idle_ms");
+    rcu_read_lock();
+    hash_for_each_rcu(vnic_flows, bkt, flow, node) {
+        seq_printf(m, "%-5u %15pI4:%-5u %15pI4:%-5u %-15s %8u\n", flow->key.protocol,
+                   &flow->key.saddr, ntohs(flow->key.sport), &flow->key.daddr,
+                   ntohs(flow->key.dport), flow->dev->name,
+                   jiffies_to_msecs(jiffies - READ_ONCE(flow->last_used)));
+    }
+    rcu_read_unlock();
+    return 0;
+}
+
+static int vnic_flows_open(struct inode *inode, struct file *file) {
+    return single_open(file, vnic_flows_show, NULL);
+}
+
+/**
+ * Handles a command written to the flows file:
+ * "add PROTO SADDR SPORT DADDR DPORT VNIC", "del PROTO SADDR SPORT DADDR DPORT" or "clear".
+ * PROTO is an IP protocol number. Ports are 0 for protocols other than TCP and UDP
+ */
+static ssize_t vnic_flows_write(struct file *file, const char __user *user_buf, size_t count,
+                                loff_t *ppos) {
+    struct vnic_flow_key key = {};
+    char buf[128];
+    char cmd[8], saddr[16], daddr[16], name[IFNAMSIZ];
+    unsigned int protocol, sport, dport;
+    u32 ip_addr;
+    struct net_device *dev;
+    int fields, result;
+
+    if (count >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    if (copy_from_user(buf, user_buf, count)) {
+        return -EFAULT;
+    }
+    buf[count] = '\0';
+
+    fields = sscanf(buf, "%7s %u %15s %u %15s %u %15s", cmd, &protocol, saddr, &sport, daddr,
+                    &dport, name);
+    if (fields == 1 && strcmp(cmd, "clear") == 0) {
+        vnic_flow_clear();
+        return count;
+    }
+    if (fields < 6 || protocol > U8_MAX || sport > U16_MAX || dport > U16_MAX) {
+        return -EINVAL;
+    }
+    if (vnic_parse_ip(saddr, strlen(saddr), &ip_addr)) {
+        return -EINVAL;
+    }
+    key.saddr = htonl(ip_addr);
+    if (vnic_parse_ip(daddr, strlen(daddr), &ip_addr)) {
+        return -EINVAL;
+    }
+    key.daddr = htonl(ip_addr);
+    key.sport = htons(sport);
+    key.dport = htons(dport);
+    key.protocol = protocol;
+
+    if (strcmp(cmd, "add") == 0 && fields == 7) {
+        rtnl_lock();
+        dev = find_vnic_by_name(name);
+        result = dev ? vnic_flow_add(&key, dev, -1) : -ENODEV;
+        rtnl_unlock();
+    } else if (strcmp(cmd, "del") == 0 && fields == 6) {
+        result = vnic_flow_del(&key);
+    } else {
+        return -EINVAL;
+    }
+    return result ? result : count;
+}
+
+static const struct file_operations vnic_flows_fops = {
+    .owner = THIS_MODULE,
+    .open = vnic_flows_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+    .write = vnic_flows_write,
+};
+
+void vnic_flow_debugfs_init(struct dentry *root) {
+    debugfs_create_file("flows", 0600, root, NULL, &vnic_flows_fops);
+}
+
+/**
+ * Removes every flow and stops aging
+ */
+void vnic_flow_cleanup(void) {
+    vnic_flow_clear();
+    cancel_delayed_work_sync(&vnic_flow_aging);
+}
@@ -0,0 +1,507 @@
+/**
+ * Latency histograms of the time packets spend inside the module
+ *
+ * While measurement is on, each packet is stamped as it is sent by a vnic, and the time
+ * it took is recorded when it is received by its destination, or placed in the rx ring
+ * of the network simulator. Times are kept per source and destination vnic, and per
+ * stage of the path through the module:
+ *  - direct: from one vnic to another, over an emulated link or a route
+ *  - to-netsim: from a vnic to the network simulator
+ *  - in-netsim: from the rx ring of the simulator to its tx ring, for simulators which
+ *    pass back the tstamp of each descriptor, as described in vnic_netsim.h
+ *  - from-netsim: from the network simulator to a vnic
+ *
+ * Each CPU records into its own log-linear histograms, with LATENCY_SUB_BUCKETS buckets
+ * for each power of 2 nanoseconds, so recording takes no lock and no atomic operation,
+ * and percentiles are accurate to within 1 / LATENCY_SUB_BUCKETS. Histograms are read
+ * and controlled through /sys/kernel/debug/vnic/latency.
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/hash.h>
+#include <linux/ktime.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/jump_label.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <net/net_namespace.h>
+
+#include "vnic.h"
+#include "if_vnic.h"
+
+/**
+ * Command line arguments for loading the module
+ * latency_pairs : int, the number of source, destination and stage combinations which
+ *                 can be measured at once. Rounded up to a power of 2.
+ */
+static int latency_pairs = 256;
+module_param(latency_pairs, int, 0644);
+
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+// Times of 2^LATENCY_MAX_SHIFT ns, about 18 minutes, or more go in the last bucket
+#define LATENCY_MAX_SHIFT 40
+#define LATENCY_BUCKETS ((LATENCY_MAX_SHIFT - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+static const char *const vnic_latency_stage_names[VNIC_LATENCY_STAGE_MAX] = {
+    [VNIC_LATENCY_DIRECT] = "direct",
+    [VNIC_LATENCY_TO_NETSIM] = "to-netsim",
+    [VNIC_LATENCY_IN_NETSIM] = "in-netsim",
+    [VNIC_LATENCY_FROM_NETSIM] = "from-netsim",
+};
+
+/**
+ * A source, destination and stage which times are recorded for. Entries are claimed
+ * under vnic_latency_insert_lock, and never change once used is set. Devices are kept by
+ * their network namespace and ifindex, which is not reused for a new device, and named
+ * when the histograms are read, since a source may be destroyed while its packets are
+ * still on their way
+ */
+struct vnic_latency_entry {
+    struct vnic_latency_dev src;
+    struct vnic_latency_dev dst;
+    enum vnic_latency_stage stage;
+    bool used;
+};
+
+/**
+ * Histograms of one CPU, LATENCY_BUCKETS counts for each entry
+ */
+struct vnic_latency_cpu {
+    u64 untracked; /* Times which found every entry taken */
+    u32 counts[];
+};
+
+/**
+ * One measurement, from being turned on or reset until being turned off or reset.
+ * Replaced rather than cleared, so that recording needs no lock against a reset
+ */
+struct vnic_latency {
+    u32 epoch; /* Stamps from before this measurement are ignored */
+    u32 entry_count;
+    struct vnic_latency_entry *entries;
+    struct vnic_latency_cpu * __percpu *cpus;
+};
+
+/**
+ * Patched in while measurement is on, so that packets are only stamped then
+ */
+DEFINE_STATIC_KEY_FALSE(vnic_latency_key);
+
+static struct vnic_latency __rcu *vnic_latency_active;
+static DEFINE_MUTEX(vnic_latency_mutex);
+static DEFINE_SPINLOCK(vnic_latency_insert_lock);
+static u32 vnic_latency_epochs;
+
+static inline u32 vnic_latency_bucket(u64 ns) {
+    int shift;
+
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return ns;
+    }
+    if (ns >> LATENCY_MAX_SHIFT) {
+        return LATENCY_BUCKETS - 1;
+    }
+    shift = fls64(ns) - 1 - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS) + ((ns >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/**
+ * Returns the longest time, in ns, recorded in a bucket
+ */
+static u64 vnic_latency_bucket_max(u32 bucket) {
+    int shift;
+
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    if (bucket == LATENCY_BUCKETS - 1) {
+        return U64_MAX;
+    }
+    shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    return (((u64)LATENCY_SUB_BUCKETS + (bucket & (LATENCY_SUB_BUCKETS - 1))) << shift) +
+           (1ULL << shift) - 1;
+}
+
+static inline struct vnic_latency_dev vnic_latency_dev(const struct net_device *dev) {
+    return (struct vnic_latency_dev){ .net = dev_net(dev)->ns.inum, .ifindex = dev->ifindex };
+}
+
+static inline bool vnic_latency_dev_is(struct vnic_latency_dev a, struct vnic_latency_dev b) {
+    return a.net == b.net && a.ifindex == b.ifindex;
+}
+
+static inline bool vnic_latency_entry_is(struct vnic_latency_entry *entry,
+                                         struct vnic_latency_dev src, struct vnic_latency_dev dst,
+                                         enum vnic_latency_stage stage) {
+    return vnic_latency_dev_is(entry->src, src) && vnic_latency_dev_is(entry->dst, dst) &&
+           entry->stage == stage;
+}
+
+/**
+ * Finds the entry for src, dst and stage, claiming one if they have none.
+ * Returns its index, or -1 if every entry is taken
+ */
+static int vnic_latency_find(struct vnic_latency *latency, struct vnic_latency_dev src,
+                             struct vnic_latency_dev dst, enum vnic_latency_stage stage) {
+    u32 mask = latency->entry_count - 1;
+    u32 start = hash_64(((u64)(src.net ^ dst.net) << 32) ^ ((u64)src.ifindex << 16) ^
+                        ((u64)dst.ifindex << 2) ^ stage, 32) & mask;
+    u32 i, index = 0;
+
+    // Entries are never released, so the first unused entry ends the search
+    for (i = 0; i < latency->entry_count; i++) {
+        struct vnic_latency_entry *entry = &latency->entries[(start + i) & mask];
+
+        if (!smp_load_acquire(&entry->used)) {
+            break;
+        }
+        if (vnic_latency_entry_is(entry, src, dst, stage)) {
+            return (start + i) & mask;
+        }
+    }
+    if (i == latency->entry_count) {
+        return -1;
+    }
+
+    // Another CPU may have claimed the entry, or one for the same devices, in the meantime
+    spin_lock(&vnic_latency_insert_lock);
+    for (; i < latency->entry_count; i++) {
+        struct vnic_latency_entry *entry;
+
+        index = (start + i) & mask;
+        entry = &latency->entries[index];
+        if (!entry->used) {
+            entry->src = src;
+            entry->dst = dst;
+            entry->stage = stage;
+            // Pairs with the acquire above. Readers see the whole entry
+            smp_store_release(&entry->used, true);
+            break;
+        }
+        if (vnic_latency_entry_is(entry, src, dst, stage)) {
+            break;
+        }
+    }
+    spin_unlock(&vnic_latency_insert_lock);
+    return i < latency->entry_count ? (int)index : -1;
+}
+
+static void vnic_latency_record(struct vnic_latency *latency, struct vnic_latency_dev src,
+                                struct vnic_latency_dev dst, enum vnic_latency_stage stage,
+                                u64 stamp) {
+    struct vnic_latency_cpu *cpu = *this_cpu_ptr(latency->cpus);
+    u64 now = ktime_get_ns();
+    int index;
+
+    // Stamps from the simulator may be from the future
+    if (now < stamp) {
+        return;
+    }
+    index = vnic_latency_find(latency, src, dst, stage);
+    if (index < 0) {
+        cpu->untracked++;
+        return;
+    }
+    cpu->counts[index * LATENCY_BUCKETS + vnic_latency_bucket(now - stamp)]++;
+}
+
+/**
+ * Stamps a packet being sent from src to dst with the time, and the stage it is starting.
+ * Must be called with bottom halves disabled, as is the case in vnic_xmit.
+ */
+void vnic_latency_stamp(struct sk_buff *skb, struct net_device *src, struct net_device *dst) {
+    struct vnic_latency *latency = rcu_dereference_bh(vnic_latency_active);
+    struct vnic_skb_cb *cb = VNIC_SKB_CB(skb);
+
+    if (!latency) {
+        cb->epoch = 0;
+        return;
+    }
+    cb->stamp = ktime_get_ns();
+    cb->epoch = latency->epoch;
+    cb->src = vnic_latency_dev(src);
+    if (vnic_netsim_role(src) == VNIC_NETSIM_TX) {
+        cb->stage = VNIC_LATENCY_FROM_NETSIM;
+    } else if (vnic_netsim_role(dst) == VNIC_NETSIM_RX) {
+        cb->stage = VNIC_LATENCY_TO_NETSIM;
+    } else {
+        cb->stage = VNIC_LATENCY_DIRECT;
+    }
+}
+
+/**
+ * Records the time since a packet was stamped, as it is delivered to dst. Packets stamped
+ * before measurement was turned on or reset, or not stamped at all, are ignored.
+ * Must be called with bottom halves disabled.
+ */
+void vnic_latency_deliver(struct sk_buff *skb, struct net_device *dst) {
+    struct vnic_latency *latency = rcu_dereference_bh(vnic_latency_active);
+    struct vnic_skb_cb *cb = VNIC_SKB_CB(skb);
+
+    if (latency && cb->epoch == latency->epoch && cb->stage < VNIC_LATENCY_STAGE_MAX) {
+        vnic_latency_record(latency, cb->src, vnic_latency_dev(dst), cb->stage, cb->stamp);
+        // A packet sent back out by XDP_TX is only counted once
+        cb->epoch = 0;
+    }
+}
+
+/**
+ * Records a time from a stamp kept outside the packet, such as in a descriptor of the
+ * simulator's rings. Must be called with bottom halves disabled.
+ */
+void vnic_latency_add(const struct net_device *src, const struct net_device *dst,
+                      enum vnic_latency_stage stage, u64 stamp) {
+    struct vnic_latency *latency = rcu_dereference_bh(vnic_latency_active);
+
+    if (latency && src && dst) {
+        vnic_latency_record(latency, vnic_latency_dev(src), vnic_latency_dev(dst), stage,
+                            stamp);
+    }
+}
+
+static void vnic_latency_free(struct vnic_latency *latency) {
+    int cpu;
+
+    if (latency->cpus) {
+        for_each_possible_cpu(cpu) {
+            kvfree(*per_cpu_ptr(latency->cpus, cpu));
+        }
+        free_percpu(latency->cpus);
+    }
+    kvfree(latency->entries);
+    kfree(latency);
+}
+
+static struct vnic_latency *vnic_latency_alloc(void) {
+    struct vnic_latency *latency = kzalloc(sizeof(struct vnic_latency), GFP_KERNEL);
+    int cpu;
+
+    if (!latency) {
+        return NULL;
+    }
+    latency->entry_count = roundup_pow_of_two(clamp(latency_pairs, 1, 65536));
+    latency->entries = kvcalloc(latency->entry_count, sizeof(struct vnic_latency_entry),
+                                GFP_KERNEL);
+    latency->cpus = alloc_percpu(struct vnic_latency_cpu *);
+    if (!latency->entries || !latency->cpus) {
+        vnic_latency_free(latency);
+        return NULL;
+    }
+
+    for_each_possible_cpu(cpu) {
+        struct vnic_latency_cpu *histograms;
+
+        histograms = kvzalloc_node(struct_size(histograms, counts,
+                                               (size_t)latency->entry_count * LATENCY_BUCKETS),
+                                   GFP_KERNEL, cpu_to_node(cpu));
+        if (!histograms) {
+            vnic_latency_free(latency);
+            return NULL;
+        }
+        *per_cpu_ptr(latency->cpus, cpu) = histograms;
+    }
+
+    // 0 is never an epoch, so packets which were not stamped are never counted
+    if (++vnic_latency_epochs == 0) {
+        vnic_latency_epochs++;
+    }
+    latency->epoch = vnic_latency_epochs;
+    return latency;
+}
+
+/**
+ * Replaces the measurement with latency, which is NULL to stop measuring, and frees the
+ * old one once no CPU can still be recording into it. Called under vnic_latency_mutex
+ */
+static void vnic_latency_replace(struct vnic_latency *latency) {
+    struct vnic_latency *old = rcu_dereference_protected(vnic_latency_active,
+                                                         lockdep_is_held(&vnic_latency_mutex));
+
+    rcu_assign_pointer(vnic_latency_active, latency);
+    if (latency && !old) {
+        static_branch_enable(&vnic_latency_key);
+    } else if (!latency && old) {
+        static_branch_disable(&vnic_latency_key);
+    }
+    if (old) {
+        synchronize_net();
+        vnic_latency_free(old);
+    }
+}
+
+/**
+ * Copies the name of a device into name, or "if" and its ifindex if it has been destroyed
+ */
+static void vnic_latency_name(struct vnic_latency_dev latency_dev, char *name) {
+    struct net_device *dev = NULL;
+    struct net *net;
+
+    rcu_read_lock();
+    for_each_net_rcu(net) {
+        if (net->ns.inum == latency_dev.net) {
+            dev = dev_get_by_index_rcu(net, latency_dev.ifindex);
+            break;
+        }
+    }
+    if (dev) {
+        strscpy(name, dev->name, IFNAMSIZ);
+    } else {
+        snprintf(name, IFNAMSIZ, "if%d", latency_dev.ifindex);
+    }
+    rcu_read_unlock();
+}
+
+/**
+ * Lists the count and percentiles of each histogram, in ns
+ */
+static int vnic_latency_show(struct seq_file *m, void *v) {
+    static const u32 permille[] = { 500, 990, 999 };
+    struct vnic_latency *latency;
+    u64 *counts;
+    u64 untracked = 0;
+    u32 i, bucket;
+    int cpu;
+
+    counts = kvmalloc_array(LATENCY_BUCKETS, sizeof(u64), GFP_KERNEL);
+    if (!counts) {
+        return -ENOMEM;
+    }
+
+    mutex_lock(&vnic_latency_mutex);
+    latency = rcu_dereference_protected(vnic_latency_active, lockdep_is_held(&vnic_latency_mutex));
+    if (!latency) {
+        seq_puts(m, "# off\n");
+        goto out;
+    }
+
+    seq_printf(m, "%-15s %-15s %-11s %12s %12s %12s %12s %12s\n", "src", "dst", "stage",
+               "count", "p50_ns", "p99_ns", "p999_ns", "max_ns");
+    for (i = 0; i < latency->entry_count; i++) {
+        struct vnic_latency_entry *entry = &latency->entries[i];
+        char src_name[IFNAMSIZ], dst_name[IFNAMSIZ];
+        u64 total = 0, seen = 0;
+        u64 values[ARRAY_SIZE(permille)];
+        u64 max = 0;
+        int next = 0;
+
+        if (!smp_load_acquire(&entry->used)) {
+            continue;
+        }
+        for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            counts[bucket] = 0;
+            for_each_possible_cpu(cpu) {
+                struct vnic_latency_cpu *histograms = *per_cpu_ptr(latency->cpus, cpu);
+
+                counts[bucket] += READ_ONCE(histograms->counts[i * LATENCY_BUCKETS + bucket]);
+            }
+            total += counts[bucket];
+        }
+
+        for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            if (!counts[bucket]) {
+                continue;
+            }
+            seen += counts[bucket];
+            max = vnic_latency_bucket_max(bucket);
+            // The percentile is in this bucket once it holds the time ranked total * p
+            while (next < ARRAY_SIZE(permille) && seen * 1000 >= total * permille[next]) {
+                values[next++] = max;
+            }
+        }
+        if (!total) {
+            continue;
+        }
+        vnic_latency_name(entry->src, src_name);
+        vnic_latency_name(entry->dst, dst_name);
+        seq_printf(m, "%-15s %-15s %-11s %12llu %12llu %12llu %12llu %12llu\n",
+                   src_name, dst_name, vnic_latency_stage_names[entry->stage],
+                   total, values[0], values[1], values[2], max);
+    }
+
+    for_each_possible_cpu(cpu) {
+        untracked += READ_ONCE((*per_cpu_ptr(latency->cpus, cpu))->untracked);
+    }
+    if (untracked) {
+        seq_printf(m, "# %llu packets not recorded because all %u entries were in use\n",
+                   untracked, latency->entry_count);
+    }
+out:
+    mutex_unlock(&vnic_latency_mutex);
+    kvfree(counts);
+    return 0;
+}
+
+static int vnic_latency_open(struct inode *inode, struct file *file) {
+    return single_open(file, vnic_latency_show, NULL);
+}
+
+/**
+ * Handles a command written to the latency file
+ * "on" starts measuring, "off" stops, and "reset" clears the histograms
+ */
+static ssize_t vnic_latency_write(struct file *file, const char __user *user_buf, size_t count,
+                                  loff_t *ppos) {
+    struct vnic_latency *latency = NULL;
+    char buf[16];
+    bool running;
+
+    if (count >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    if (copy_from_user(buf, user_buf, count)) {
+        return -EFAULT;
+    }
+    buf[count] = '\0';
+    strim(buf);
+
+    mutex_lock(&vnic_latency_mutex);
+    running = rcu_access_pointer(vnic_latency_active) != NULL;
+    if (strcmp(buf, "on") == 0 || (strcmp(buf, "reset") == 0 && running)) {
+        latency = vnic_latency_alloc();
+        if (!latency) {
+            mutex_unlock(&vnic_latency_mutex);
+            return -ENOMEM;
+        }
+        vnic_latency_replace(latency);
+    } else if (strcmp(buf, "off") == 0) {
+        vnic_latency_replace(NULL);
+    } else if (strcmp(buf, "reset") != 0) {
+        mutex_unlock(&vnic_latency_mutex);
+        return -EINVAL;
+    }
+    mutex_unlock(&vnic_latency_mutex);
+    return count;
+}
+
+static const struct file_operations vnic_latency_fops = {
+    .owner = THIS_MODULE,
+    .open = vnic_latency_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+    .write = vnic_latency_write,
+};
+
+void vnic_latency_debugfs_init(struct dentry *root) {
+    debugfs_create_file("latency", 0600, root, NULL, &vnic_latency_fops);
+}
+
+/**
+ * Stops measuring and frees the histograms
+ */
+void vnic_latency_cleanup(void) {
+    mutex_lock(&vnic_latency_mutex);
+    vnic_latency_replace(NULL);
+    mutex_unlock(&vnic_latency_mutex);
+}
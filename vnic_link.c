@@ -0,0 +1,607 @@
+/**
+ * In-kernel link emulation between pairs of vnics
+ *
+ * A link from one vnic to another adds delay, jitter, a rate limit and random loss to
+ * the packets sent over it. Packets which would wait longer than the limit of the link to
+ * be sent, behind its rate limit, are dropped, as a full queue drops them. Packets between vnics joined by a link are delivered by the
+ * kernel, without going through the network simulator. Links are directional and are
+ * configured through /sys/kernel/debug/vnic/links.
+ *
+ * Delayed packets are held in a hierarchical timing wheel on each CPU, so that adding
+ * and expiring a packet costs O(1) however many are in flight. The wheel itself is part
+ * of the routing core, in vnic_core.c, so that it is tested in userspace. Packets in a
+ * level 0 slot are delivered when the wheel comes round to it. An hrtimer, expiring in
+ * softirq context on the CPU of the wheel, is set for the next slot which needs handling.
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/hashtable.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/jump_label.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/rtnetlink.h>
+
+#include "vnic.h"
+#include "vnic_core.h"
+
+// One tick of the wheels is 2^LINK_TICK_SHIFT ns, about a microsecond, so the 2^32 ticks
+// the wheels cover are a little over an hour
+#define LINK_TICK_SHIFT 10
+// How long packets may wait behind the rate limit of a link, unless set
+#define LINK_DEFAULT_LIMIT_US 100000
+
+#define LINK_HASH_BITS 8
+
+/**
+ * Enabled while any link exists, so that vnic_xmit only looks for links when there are some
+ */
+DEFINE_STATIC_KEY_FALSE(vnic_link_key);
+
+struct vnic_link {
+    struct hlist_node node;
+    struct rcu_head rcu;
+    struct net_device *src;
+    struct net_device *dst;
+
+    // Parameters, as configured
+    u64 delay_us;
+    u64 jitter_us;
+    u64 rate_kbit; /* 0 for no limit */
+    u64 limit_us;  /* Longest a packet may wait behind the rate limit */
+    u32 loss_ppm;  /* Packets lost per million */
+
+    // Parameters, as used on the data path
+    u64 delay_ns;
+    u64 jitter_ns;
+    u64 limit_ns;
+    u32 loss_threshold; /* Packets are lost when a random u32 is below this */
+
+    spinlock_t lock;   /* Protects the fields below, shared by every CPU sending over the link */
+    u64 next_free_ns;  /* When the link has finished sending the packets before */
+    u64 sent;
+    u64 lost;
+    u64 overlimit;
+};
+
+/**
+ * Links, keyed by the ifindex of both ends. Changed under vnic_link_mutex
+ */
+static DEFINE_HASHTABLE(vnic_links, LINK_HASH_BITS);
+static DEFINE_MUTEX(vnic_link_mutex);
+static int vnic_link_count;
+
+/**
+ * Where a delayed packet is going, and when. Kept in skb->cb while the packet is in a wheel
+ */
+struct vnic_link_cb {
+    struct vnic_wheel_entry entry;
+    struct net_device *dst;
+};
+
+// Kept after the latency stamp, which is still needed once the packet is delivered
+#define VNIC_LINK_CB(skb) ((struct vnic_link_cb *)((skb)->cb + sizeof(struct vnic_skb_cb)))
+
+static inline struct sk_buff *vnic_link_skb(struct vnic_wheel_entry *entry) {
+    return container_of((void *)((char *)entry - sizeof(struct vnic_skb_cb)), struct sk_buff, cb);
+}
+
+/**
+ * Timing wheel of one CPU. Used on that CPU by senders with bottom halves disabled and by
+ * its timer in softirq context, so its lock is only contended when a vnic is destroyed and
+ * its packets are taken out of every wheel.
+ */
+struct vnic_link_wheel {
+    spinlock_t lock;
+    u64 timer_tick; /* When the timer is set for, if it is queued */
+    struct hrtimer timer;
+    struct vnic_wheel wheel;
+};
+
+static DEFINE_PER_CPU(struct vnic_link_wheel *, vnic_link_wheels);
+
+static inline u64 vnic_link_key_of(struct net_device *src, struct net_device *dst) {
+    return ((u64)src->ifindex << 32) | (u32)dst->ifindex;
+}
+
+static inline u64 vnic_link_now(void) {
+    return ktime_get_ns() >> LINK_TICK_SHIFT;
+}
+
+/**
+ * Finds the link from src to dst. Must be called under rcu_read_lock
+ * Returns NULL if the vnics are not joined by a link
+ */
+struct vnic_link *vnic_link_find(struct net_device *src, struct net_device *dst) {
+    u64 key = vnic_link_key_of(src, dst);
+    struct vnic_link *link;
+
+    hash_for_each_possible_rcu(vnic_links, link, node, key) {
+        if (link->src == src && link->dst == dst) {
+            return link;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Sets the timer for the next tick which needs handling, unless it is already set for
+ * an earlier one
+ */
+static void vnic_link_wheel_arm(struct vnic_link_wheel *wheel) {
+    u64 next = vnic_wheel_next(&wheel->wheel);
+
+    if (next == U64_MAX) {
+        return;
+    }
+    if (!hrtimer_is_queued(&wheel->timer) || next < wheel->timer_tick) {
+        wheel->timer_tick = next;
+        hrtimer_start(&wheel->timer, ns_to_ktime(next << LINK_TICK_SHIFT),
+                      HRTIMER_MODE_ABS_PINNED_SOFT);
+    }
+}
+
+/**
+ * Passes the packet of each entry in a list to its destination
+ */
+static void vnic_link_deliver(struct vnic_wheel_entry *list) {
+    struct vnic_wheel_entry *next;
+    struct sk_buff *skb;
+
+    for (; list; list = next) {
+        next = list->next;
+        skb = vnic_link_skb(list);
+        vnic_rx(VNIC_LINK_CB(skb)->dst, skb);
+    }
+    vnic_batch_flush();
+}
+
+static enum hrtimer_restart vnic_link_timer(struct hrtimer *timer) {
+    struct vnic_link_wheel *wheel = container_of(timer, struct vnic_link_wheel, timer);
+    struct vnic_wheel_entry *due;
+    u64 next;
+
+    spin_lock(&wheel->lock);
+    due = vnic_wheel_run(&wheel->wheel, vnic_link_now());
+
+    next = vnic_wheel_next(&wheel->wheel);
+    if (next != U64_MAX) {
+        wheel->timer_tick = next;
+        hrtimer_set_expires(timer, ns_to_ktime(next << LINK_TICK_SHIFT));
+    }
+    spin_unlock(&wheel->lock);
+
+    // Softirq context is already an RCU-bh read side section, as vnic_rx needs
+    vnic_link_deliver(due);
+    return next != U64_MAX ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+/**
+ * ===============================================================
+ *                           Data path
+ * ===============================================================
+ */
+
+/**
+ * Sends skb over link to dst. The packet is lost, delivered straight away, or held in
+ * the timing wheel of this CPU until it is due. Must be called under rcu_read_lock_bh.
+ * Returns NET_RX_SUCCESS, or NET_RX_DROP if the packet was dropped
+ */
+int vnic_link_xmit(struct vnic_link *link, struct net_device *dst, struct sk_buff *skb) {
+    struct vnic_link_wheel *wheel;
+    u64 now = ktime_get_ns();
+    u64 due = now;
+    u64 delay;
+    enum vnic_drop_reason reason = VNIC_DROP_MAX; /* Not dropped */
+
+    spin_lock(&link->lock);
+    if (link->loss_threshold && prandom_u32() < link->loss_threshold) {
+        link->lost++;
+        reason = VNIC_DROP_LINK_LOSS;
+    } else if (link->rate_kbit && link->next_free_ns > now + link->limit_ns) {
+        // The packets before it would hold it back for longer than the limit
+        link->overlimit++;
+        reason = VNIC_DROP_LINK_LIMIT;
+    } else {
+        link->sent++;
+        if (link->rate_kbit) {
+            // The packet arrives once its last bit has been sent
+            due = max(now, link->next_free_ns) +
+                  div64_u64((u64)skb->len * 8 * USEC_PER_SEC, link->rate_kbit);
+            link->next_free_ns = due;
+        }
+    }
+    spin_unlock(&link->lock);
+
+    if (reason != VNIC_DROP_MAX) {
+        vnic_drop(link->src, skb, reason);
+        return NET_RX_DROP;
+    }
+
+    // Jitter is uniform in [-jitter, jitter] around the delay, and never makes it negative
+    delay = link->delay_ns;
+    if (link->jitter_ns) {
+        delay += mul_u64_u32_shr(2 * link->jitter_ns, prandom_u32(), 32);
+        delay = delay > link->jitter_ns ? delay - link->jitter_ns : 0;
+    }
+    due = (due + delay) >> LINK_TICK_SHIFT;
+
+    if (due <= now >> LINK_TICK_SHIFT) {
+        return vnic_rx(dst, skb);
+    }
+
+    wheel = this_cpu_read(vnic_link_wheels);
+    spin_lock(&wheel->lock);
+    if (vnic_wheel_next(&wheel->wheel) == U64_MAX) {
+        // Catch the clock of an empty wheel up, so that the packet goes in a low level
+        wheel->wheel.clock = max(wheel->wheel.clock, now >> LINK_TICK_SHIFT);
+    }
+    // A packet due in a tick the timer has already handled is late, and goes in the
+    // current slot
+    VNIC_LINK_CB(skb)->dst = dst;
+    VNIC_LINK_CB(skb)->entry.due = due;
+    vnic_wheel_insert(&wheel->wheel, &VNIC_LINK_CB(skb)->entry);
+    vnic_link_wheel_arm(wheel);
+    spin_unlock(&wheel->lock);
+    return NET_RX_SUCCESS;
+}
+
+/**
+ * ===============================================================
+ *                         Configuration
+ * ===============================================================
+ */
+
+/**
+ * Adds a link from src to dst, or replaces the parameters of an existing one.
+ * Returns 0 on success, -ENOMEM on failure
+ */
+static int vnic_link_set(struct net_device *src, struct net_device *dst, u64 delay_us,
+                         u64 jitter_us, u64 rate_kbit, u64 limit_us, u32 loss_ppm) {
+    struct vnic_link *link, *old;
+
+    link = kzalloc(sizeof(struct vnic_link), GFP_KERNEL);
+    if (!link) {
+        return -ENOMEM;
+    }
+    link->src = src;
+    link->dst = dst;
+    link->delay_us = delay_us;
+    link->jitter_us = jitter_us;
+    link->rate_kbit = rate_kbit;
+    link->limit_us = limit_us;
+    link->loss_ppm = loss_ppm;
+    link->delay_ns = delay_us * NSEC_PER_USEC;
+    link->jitter_ns = jitter_us * NSEC_PER_USEC;
+    link->limit_ns = limit_us * NSEC_PER_USEC;
+    link->loss_threshold = div_u64((u64)loss_ppm * U32_MAX, 1000000);
+    spin_lock_init(&link->lock);
+
+    mutex_lock(&vnic_link_mutex);
+    rcu_read_lock();
+    old = vnic_link_find(src, dst);
+    rcu_read_unlock();
+    if (old) {
+        hlist_replace_rcu(&old->node, &link->node);
+        kfree_rcu(old, rcu);
+    } else {
+        hash_add_rcu(vnic_links, &link->node, vnic_link_key_of(src, dst));
+        if (vnic_link_count++ == 0) {
+            static_branch_enable(&vnic_link_key);
+        }
+    }
+    mutex_unlock(&vnic_link_mutex);
+    return 0;
+}
+
+/**
+ * Removes the link from src to dst. Packets already sent over it are still delivered
+ * Returns 0 on success, -ENOENT if there is no such link
+ */
+static int vnic_link_del(struct net_device *src, struct net_device *dst) {
+    struct vnic_link *link;
+
+    mutex_lock(&vnic_link_mutex);
+    rcu_read_lock();
+    link = vnic_link_find(src, dst);
+    rcu_read_unlock();
+    if (link) {
+        hash_del_rcu(&link->node);
+        kfree_rcu(link, rcu);
+        if (--vnic_link_count == 0) {
+            static_branch_disable(&vnic_link_key);
+        }
+    }
+    mutex_unlock(&vnic_link_mutex);
+    return link ? 0 : -ENOENT;
+}
+
+static void vnic_link_clear(void) {
+    struct hlist_node *tmp;
+    struct vnic_link *link;
+    int bkt;
+
+    mutex_lock(&vnic_link_mutex);
+    hash_for_each_safe(vnic_links, bkt, tmp, link, node) {
+        hash_del_rcu(&link->node);
+        kfree_rcu(link, rcu);
+    }
+    if (vnic_link_count) {
+        vnic_link_count = 0;
+        static_branch_disable(&vnic_link_key);
+    }
+    mutex_unlock(&vnic_link_mutex);
+}
+
+/**
+ * Removes every link from or to dev, so that no more of its packets go into the wheels
+ * once the senders still using the links have finished. Must be called under RTNL
+ */
+void vnic_link_remove_dev(struct net_device *dev) {
+    struct hlist_node *tmp;
+    struct vnic_link *link;
+    int bkt;
+
+    mutex_lock(&vnic_link_mutex);
+    hash_for_each_safe(vnic_links, bkt, tmp, link, node) {
+        if (link->src != dev && link->dst != dev) {
+            continue;
+        }
+        hash_del_rcu(&link->node);
+        kfree_rcu(link, rcu);
+        if (--vnic_link_count == 0) {
+            static_branch_disable(&vnic_link_key);
+        }
+    }
+    mutex_unlock(&vnic_link_mutex);
+}
+
+static bool vnic_link_entry_to(struct vnic_wheel_entry *entry, void *dev) {
+    return VNIC_LINK_CB(vnic_link_skb(entry))->dst == dev;
+}
+
+/**
+ * Frees the packets in the wheels which are going to dev. Must be called after
+ * vnic_link_remove_dev and synchronize_net, so that no more are added.
+ * Returns once packets taken out of the wheels by a timer before then have been delivered
+ */
+void vnic_link_purge_dev(struct net_device *dev) {
+    struct vnic_wheel_entry *purged, *next;
+    struct vnic_link_wheel *wheel;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        wheel = per_cpu(vnic_link_wheels, cpu);
+        spin_lock_bh(&wheel->lock);
+        purged = vnic_wheel_remove(&wheel->wheel, vnic_link_entry_to, dev);
+        // An emptied wheel leaves its timer to expire with nothing to do
+        spin_unlock_bh(&wheel->lock);
+
+        for (; purged; purged = next) {
+            next = purged->next;
+            kfree_skb(vnic_link_skb(purged));
+        }
+    }
+    // Timers deliver outside the lock of their wheel, in softirq context
+    synchronize_net();
+}
+
+/**
+ * Lists each link with its parameters and counters
+ */
+static int vnic_links_show(struct seq_file *m, void *v) {
+    struct vnic_link *link;
+    u64 sent, lost, overlimit;
+    int bkt;
+
+    seq_printf(m, "%-15s %-15s %10s %10s %10s %10s %8s %12s %12s %12s\n", "src", "dst",
+               "delay_us", "jitter_us", "rate_kbit", "limit_us", "loss_ppm", "sent", "lost",
+               "overlimit");
+    rcu_read_lock();
+    hash_for_each_rcu(vnic_links, bkt, link, node) {
+        spin_lock_bh(&link->lock);
+        sent = link->sent;
+        lost = link->lost;
+        overlimit = link->overlimit;
+        spin_unlock_bh(&link->lock);
+        seq_printf(m, "%-15s %-15s %10llu %10llu %10llu %10llu %8u %12llu %12llu %12llu\n",
+                   link->src->name, link->dst->name, link->delay_us, link->jitter_us,
+                   link->rate_kbit, link->limit_us, link->loss_ppm, sent, lost, overlimit);
+    }
+    rcu_read_unlock();
+    return 0;
+}
+
+static int vnic_links_open(struct inode *inode, struct file *file) {
+    return single_open(file, vnic_links_show, NULL);
+}
+
+/**
+ * Returns the next token separated by spaces or tabs from *s, or NULL if there are none
+ */
+static char *vnic_links_next_token(char **s) {
+    char *token;
+
+    while ((token = strsep(s, " \t")) != NULL && !*token) {
+    }
+    return token;
+}
+
+/**
+ * Changes the links. Accepts one command per write:
+ *     set <src vnic> <dst vnic> [delay=<us>] [jitter=<us>] [rate=<kbit/s>] [limit=<us>]
+ *         [loss=<ppm>]
+ *         adds a link from src to dst, or replaces the parameters of an existing one.
+ *         limit is how long packets may wait behind the rate limit before they are
+ *         dropped, LINK_DEFAULT_LIMIT_US if left out. Other parameters which are left
+ *         out are 0, meaning no delay, rate limit or loss
+ *     del <src vnic> <dst vnic>   removes the link from src to dst
+ *     clear                       removes every link
+ */
+static ssize_t vnic_links_write(struct file *file, const char __user *user_buf,
+                                size_t count, loff_t *ppos) {
+    char buf[160];
+    char *cmd, *src_name, *dst_name;
+    u64 delay_us = 0, jitter_us = 0, rate_kbit = 0, loss_ppm = 0;
+    u64 limit_us = LINK_DEFAULT_LIMIT_US;
+    struct net_device *src, *dst;
+    char *params, *param, *value;
+    int result;
+
+    if (count >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    if (copy_from_user(buf, user_buf, count)) {
+        return -EFAULT;
+    }
+    buf[count] = '\0';
+
+    params = strim(buf);
+    cmd = vnic_links_next_token(&params);
+    if (cmd && strcmp(cmd, "clear") == 0) {
+        vnic_link_clear();
+        return count;
+    }
+    src_name = vnic_links_next_token(&params);
+    dst_name = vnic_links_next_token(&params);
+    if (!dst_name) {
+        return -EINVAL;
+    }
+
+    if (strcmp(cmd, "del") == 0) {
+        if (vnic_links_next_token(&params)) {
+            return -EINVAL;
+        }
+    } else if (strcmp(cmd, "set") != 0) {
+        return -EINVAL;
+    }
+
+    while ((param = vnic_links_next_token(&params)) != NULL) {
+        u64 *target;
+
+        value = strchr(param, '=');
+        if (!value) {
+            return -EINVAL;
+        }
+        *value++ = '\0';
+
+        if (strcmp(param, "delay") == 0) {
+            target = &delay_us;
+        } else if (strcmp(param, "jitter") == 0) {
+            target = &jitter_us;
+        } else if (strcmp(param, "rate") == 0) {
+            target = &rate_kbit;
+        } else if (strcmp(param, "limit") == 0) {
+            target = &limit_us;
+        } else if (strcmp(param, "loss") == 0) {
+            target = &loss_ppm;
+        } else {
+            return -EINVAL;
+        }
+        if (kstrtou64(value, 10, target)) {
+            return -EINVAL;
+        }
+    }
+    // Delays are limited to what the timing wheels can hold
+    if (loss_ppm > 1000000 || delay_us > U32_MAX || jitter_us > U32_MAX || limit_us > U32_MAX) {
+        return -ERANGE;
+    }
+
+    // Holding RTNL keeps the vnics from being destroyed until the link is in the table
+    rtnl_lock();
+    src = find_vnic_by_name(src_name);
+    dst = find_vnic_by_name(dst_name);
+    if (!src || !dst) {
+        result = -ENODEV;
+    } else if (strcmp(cmd, "del") == 0) {
+        result = vnic_link_del(src, dst);
+    } else {
+        result = vnic_link_set(src, dst, delay_us, jitter_us, rate_kbit, limit_us, loss_ppm);
+    }
+    rtnl_unlock();
+    return result ? result : count;
+}
+
+static const struct file_operations vnic_links_fops = {
+    .owner = THIS_MODULE,
+    .open = vnic_links_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+    .write = vnic_links_write,
+};
+
+void vnic_link_debugfs_init(struct dentry *root) {
+    debugfs_create_file("links", 0600, root, NULL, &vnic_links_fops);
+}
+
+/**
+ * ===============================================================
+ *                        Setup and cleanup
+ * ===============================================================
+ */
+
+/**
+ * Allocates the timing wheel of each CPU
+ * Returns 0 on success, -ENOMEM on failure
+ */
+int vnic_link_init(void) {
+    struct vnic_link_wheel *wheel;
+    int cpu;
+
+    BUILD_BUG_ON(sizeof(struct vnic_skb_cb) + sizeof(struct vnic_link_cb) >
+                 sizeof_field(struct sk_buff, cb));
+
+    for_each_possible_cpu(cpu) {
+        wheel = kzalloc_node(sizeof(struct vnic_link_wheel), GFP_KERNEL, cpu_to_node(cpu));
+        if (!wheel) {
+            vnic_link_cleanup();
+            return -ENOMEM;
+        }
+        spin_lock_init(&wheel->lock);
+        hrtimer_init(&wheel->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_PINNED_SOFT);
+        wheel->timer.function = vnic_link_timer;
+        per_cpu(vnic_link_wheels, cpu) = wheel;
+    }
+    return 0;
+}
+
+/**
+ * Removes every link, then stops the timers and frees the packets still in the wheels.
+ * Must be called once no sender can reach a link any more, such as after every vnic has
+ * been destroyed, which purges its links and packets through vnic_link_purge_dev
+ */
+void vnic_link_cleanup(void) {
+    struct vnic_link_wheel *wheel;
+    struct vnic_wheel_entry *list, *next;
+    int cpu;
+
+    vnic_link_clear();
+    // Once no sender can still be using a link, nothing more is added to the wheels
+    synchronize_net();
+
+    for_each_possible_cpu(cpu) {
+        wheel = per_cpu(vnic_link_wheels, cpu);
+        if (!wheel) {
+            continue;
+        }
+        hrtimer_cancel(&wheel->timer);
+        for (list = vnic_wheel_remove(&wheel->wheel, NULL, NULL); list; list = next) {
+            next = list->next;
+            kfree_skb(vnic_link_skb(list));
+        }
+        kfree(wheel);
+        per_cpu(vnic_link_wheels, cpu) = NULL;
+    }
+}
@@ -0,0 +1,2722 @@
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/moduleparam.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/ip.h>   // Using struct iphdr
+#include <linux/in.h>
+#include <linux/ptr_ring.h>
+#include <linux/cpumask.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/jump_label.h>
+#include <linux/printk.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/ethtool.h>
+#include <linux/ktime.h>
+#include <linux/rtnetlink.h>
+#include <net/rtnetlink.h>
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>
+#include <linux/filter.h>
+#include <net/xdp.h>
+#include <net/neighbour.h>
+#include <net/arp.h>
+
+#include "vnic.h"
+#include "vnic_core.h"
+#include "if_vnic.h"
+
+#define CREATE_TRACE_POINTS
+#include "vnic_trace.h"
+
+MODULE_AUTHOR("Samuel Bailey");
+MODULE_LICENSE("Dual BSD/GPL");
+
+/**
+ * Command line arguments for loading the module
+ * print_packet : bool, whether the packets should be hex dumped on transmission.
+ *                Can be changed at runtime through /sys/module/vnic/parameters/print_packet
+ * rx_ring_size : int, the number of packets each receive queue can hold waiting for NAPI to receive them.
+ * num_queues : int, the number of transmit and receive queues per device. 0 uses one queue per online CPU.
+ * netsim_shards : int, the number of network simulator shards, each with its own pair of
+ *                 vnics, between which packets are spread by flow.
+ * ip_mappings : Comma separated ip addresses of the vnics to instantiate on module load, one
+ *               per vnic. The first two of each shard are the network simulator, the receiving
+ *               vnic then the sending one. More vnics can be created later with
+ *               `ip link add type vnic`
+ * mac_mappings : Comma separated MAC addresses of the vnics, in the same order as ip_mappings
+ */
+static int print_packet = 0;
+static int rx_ring_size = 1024;
+static int num_queues = 0;
+static int netsim_shards = 1;
+static char *ip_mappings = "192.168.0.1,192.168.1.2";
+// The default values spell out 0VNIC0 and 0VNIC1. The first bit is 0 by convention to say they do not support multicast
+static char *mac_mappings = "00:54:4e:49:43:00,00:54:4e:49:43:00";
+
+/**
+ * Patched in when print_packet is set, so that the check for hex dumping a packet costs
+ * nothing while it is off
+ */
+static DEFINE_STATIC_KEY_FALSE(print_packet_key);
+
+static int print_packet_set(const char *val, const struct kernel_param *kp) {
+    int result = param_set_int(val, kp);
+
+    if (result) {
+        return result;
+    }
+    if (print_packet) {
+        static_branch_enable(&print_packet_key);
+    } else {
+        static_branch_disable(&print_packet_key);
+    }
+    return 0;
+}
+
+static const struct kernel_param_ops print_packet_ops = {
+    .set = print_packet_set,
+    .get = param_get_int,
+};
+
+module_param_cb(print_packet, &print_packet_ops, &print_packet, 0644);
+module_param(rx_ring_size, int, 0444);
+module_param(num_queues, int, 0444);
+module_param(netsim_shards, int, 0444);
+module_param(ip_mappings, charp, 0444);
+module_param(mac_mappings, charp, 0444);
+
+/**
+ * ===============================================================
+ *               Variables for storing module data
+ * ===============================================================
+ */
+
+
+/**
+ * Packet counters for a single transmit or receive queue. Each queue only has one writer
+ * at a time: the transmit lock of the queue is held in vnic_xmit, and NAPI serialises
+ * vnic_poll.
+ */
+struct vnic_queue_stats {
+    u64 packets;
+    u64 bytes;
+    struct u64_stats_sync syncp;
+};
+
+/**
+ * Counters which can be written by any CPU, such as drops by the receiving device.
+ * Kept per-CPU so that they can be updated without locks or atomics.
+ */
+struct vnic_pcpu_stats {
+    u64 drops[VNIC_DROP_MAX];
+    u64 counters[VNIC_COUNTER_MAX];
+    struct u64_stats_sync syncp;
+};
+
+/**
+ * State for a single receive queue of a device. Each queue has its own ring and NAPI
+ * context, so packets on different queues can be received on different CPUs.
+ */
+struct vnic_queue {
+    struct ptr_ring rx_ring; /* Bounded ring of incoming skbs and XDP frames, drained by NAPI */
+    struct napi_struct napi;
+    struct net_device *dev;
+    u16 index;
+    struct vnic_queue_stats rx_stats;
+    struct xdp_rxq_info xdp_rxq;
+    struct vnic_ring_waiters tx_waiters; /* Transmit queues stopped until the ring has room */
+} ____cacheline_aligned_in_smp;
+
+/**
+ * A transmit queue stopped because the ring it was sending to was full. The ring is
+ * identified by its waiters, which is all a waiter touches of it. Only looked at by a
+ * receiver with waiting senders, so no lock is taken on the fast path
+ */
+struct vnic_tx_waiter {
+    struct list_head node; /* In the list of ring_waiters while the queue is stopped */
+    struct vnic_ring_waiters *ring_waiters; /* NULL if not waiting. Changed under its lock */
+    struct netdev_queue *txq;
+};
+
+static void vnic_tx_cancel(struct net_device *dev);
+
+/**
+ * Private structure for each device that is instantiated
+ * Used for passing packets in and out.
+ * 
+ * Originally from `snull.c` in Linux Device Drivers 3rd Ed.
+ */
+struct vnic_priv {
+    int status;
+    struct vnic_queue *queues; /* One per receive queue of the device */
+    struct vnic_queue_stats *tx_stats; /* One per transmit queue of the device */
+    struct vnic_tx_waiter *tx_waiters; /* One per transmit queue of the device */
+    struct vnic_pcpu_stats __percpu *stats;
+    int tx_packetlen;
+    u8 *tx_packetdata;
+    spinlock_t lock;
+    struct net_device *dev;
+    struct list_head list; /* In vnic_list */
+    u32 ip_addr; /* Address the device was created with, 0 if none */
+    u8 netsim_role; /* enum vnic_netsim_role */
+    u8 netsim_shard; /* Shard of the network simulator, if netsim_role is not VNIC_NETSIM_NONE */
+    struct bpf_prog __rcu *xdp_prog; /* Run on every received packet, if set */
+};
+
+/**
+ * Every vnic, whether created on module load or through netlink, in the order they
+ * were registered. Changed under RTNL
+ */
+static LIST_HEAD(vnic_list);
+
+/**
+ * Devices for the network simulator, one pair for each shard. All traffic goes to the
+ * netsim_rxdevs of a shard before being forwarded to its destination
+ * netsim_rxdevs receive data into the network simulator
+ * Both are cleared when their device is destroyed, so read them with READ_ONCE under RCU
+ */
+struct net_device *netsim_rxdevs[VNIC_NETSIM_MAX_SHARDS];
+/**
+ * netsim_txdevs transmit data from network simulator to other devices
+ */
+struct net_device *netsim_txdevs[VNIC_NETSIM_MAX_SHARDS];
+
+static inline bool vnic_is_netsim_rx(const struct net_device *dev) {
+    return ((struct vnic_priv *)netdev_priv(dev))->netsim_role == VNIC_NETSIM_RX;
+}
+
+static inline bool vnic_is_netsim_tx(const struct net_device *dev) {
+    return ((struct vnic_priv *)netdev_priv(dev))->netsim_role == VNIC_NETSIM_TX;
+}
+
+/**
+ * Returns the role of a vnic for the network simulator, VNIC_NETSIM_NONE if dev is NULL
+ */
+u8 vnic_netsim_role(const struct net_device *dev) {
+    return dev ? ((struct vnic_priv *)netdev_priv(dev))->netsim_role : VNIC_NETSIM_NONE;
+}
+
+/**
+ * Returns the shard of the network simulator a vnic belongs to. Only meaningful for
+ * vnics with a role for the simulator
+ */
+int vnic_netsim_shard(const struct net_device *dev) {
+    return ((struct vnic_priv *)netdev_priv(dev))->netsim_shard;
+}
+
+/**
+ * Returns the number of shards of the network simulator
+ */
+int vnic_netsim_shard_count(void) {
+    return netsim_shards;
+}
+
+/**
+ * Returns the IPv4 address of a vnic in host byte order, or 0 if it has none.
+ * Must be called under RTNL, which the address is changed under
+ */
+u32 vnic_ip_addr(const struct net_device *dev) {
+    return ((struct vnic_priv *)netdev_priv(dev))->ip_addr;
+}
+
+static const struct header_ops my_header_ops = {
+    .create = vnic_header,
+    .cache = vnic_header_cache,
+    .cache_update = vnic_header_cache_update,
+};
+
+// Doesn't contain a vnic_rx method
+static const struct net_device_ops my_ops = {
+    .ndo_init = vnic_dev_init,
+    .ndo_uninit = vnic_dev_uninit,
+    .ndo_open = vnic_open,
+    .ndo_stop = vnic_release,
+    .ndo_start_xmit = vnic_xmit,
+    .ndo_select_queue = vnic_select_queue,
+    .ndo_get_stats64 = vnic_get_stats64,
+    .ndo_set_mac_address = eth_mac_addr,
+    .ndo_validate_addr = eth_validate_addr,
+    .ndo_bpf = vnic_bpf,
+    .ndo_xdp_xmit = vnic_xdp_xmit,
+    .ndo_set_rx_mode = vnic_fanout_set_rx_mode,
+};
+
+/**
+ * Returns whether dev is a vnic
+ */
+bool vnic_is_vnic(const struct net_device *dev) {
+    return dev->netdev_ops == &my_ops;
+}
+
+static const struct ethtool_ops vnic_ethtool_ops;
+static struct rtnl_link_ops vnic_rtnl_link_ops;
+
+/**
+ * ===============================================================
+ *                         Helper methods
+ * ===============================================================
+ */
+
+/**
+ * Table of IP addresses to net_devices, from vnic_core.c.
+ * Lookups are lock-free under RCU. Changes are made under ip_table_mutex, either in place,
+ * or by building a resized copy of the table and publishing it in place of the old one.
+ */
+static struct vnic_ip_table __rcu *ip_addr_lookup_table;
+static DEFINE_MUTEX(ip_table_mutex);
+
+static void vnic_neigh_refresh(void);
+
+// Lookups are made from vnic_xmit and header_ops, which run under rcu_read_lock_bh(), and
+// from netlink and debugfs under rcu_read_lock(). Old tables are freed with call_rcu(),
+// which waits for both
+#define ip_table_dereference(p) rcu_dereference_check(p, rcu_read_lock_held() || \
+                                                      rcu_read_lock_bh_held() || \
+                                                      lockdep_is_held(&ip_table_mutex))
+
+static void free_ip_table_rcu(struct rcu_head *head) {
+    vnic_ip_table_free(container_of(head, struct vnic_ip_table, rcu));
+}
+
+/**
+ * Creates an empty lookup table of IP addresses to net_device structures for fast access
+ * This is allocated on the heap, so remember to free the memory on closure.
+ * The table is sized for entries devices, so that they can be added without resizing it
+ * 
+ * Uses the global ip_addr_lookup_table to be accessible anywhere in the module
+ * Returns 0 on success, -ENOMEM on failure
+ */
+int setup_hash_table(int entries) {
+    struct vnic_ip_table *table = vnic_ip_table_alloc(entries);
+
+    if (!table) {
+        return -ENOMEM;
+    }
+    rcu_assign_pointer(ip_addr_lookup_table, table);
+    return 0;
+}
+
+/**
+ * Frees the ip_addr_lookup_table
+ */
+void free_hash_table(void) {
+    LOG("Freed ip_addr_lookup_table\n");
+    vnic_ip_table_free(rcu_dereference_protected(ip_addr_lookup_table, 1));
+    RCU_INIT_POINTER(ip_addr_lookup_table, NULL);
+}
+
+/**
+ * Replaces the published table with a copy sized for entries devices, without tombstones.
+ * Readers of the old table are allowed to finish before it is freed.
+ * Must be called with ip_table_mutex held. Returns 0 on success, -ENOMEM on failure
+ */
+static int ip_table_rebuild(int entries) {
+    struct vnic_ip_table *old_table = ip_table_dereference(ip_addr_lookup_table);
+    struct vnic_ip_table *new_table = vnic_ip_table_alloc(entries);
+
+    if (!new_table) {
+        return -ENOMEM;
+    }
+    vnic_ip_table_copy(new_table, old_table);
+
+    rcu_assign_pointer(ip_addr_lookup_table, new_table);
+    call_rcu(&old_table->rcu, free_ip_table_rcu);
+    return 0;
+}
+
+/**
+ * Stores a reference to the given device in the hash table, replacing any device already
+ * stored for ip_addr. The table is grown when it becomes more than 3/4 full.
+ * Safe to call while packets are being looked up. Must not be called in atomic context.
+ * 
+ * returns 1 for success, 0 for failure to insert
+ */
+int add_dev_to_hash_table(u32 ip_addr, struct net_device *dev) {
+    struct vnic_ip_table *table;
+    int entries;
+    int result;
+
+    mutex_lock(&ip_table_mutex);
+    table = ip_table_dereference(ip_addr_lookup_table);
+    entries = vnic_ip_table_resize_hint(table, true);
+    if (entries && !ip_table_rebuild(entries)) {
+        table = ip_table_dereference(ip_addr_lookup_table);
+    }
+    result = vnic_ip_table_insert(table, ip_addr, dev);
+    mutex_unlock(&ip_table_mutex);
+    vnic_neigh_refresh();
+    return result;
+}
+
+/**
+ * Removes the device stored for ip_addr from the hash table. The table is shrunk when
+ * less than 1/8 of it is in use.
+ * Safe to call while packets are being looked up.
+ * 
+ * returns 1 if an entry was removed, 0 if there was no entry for ip_addr
+ */
+int remove_dev_from_hash_table(u32 ip_addr) {
+    struct vnic_ip_table *table;
+    int entries;
+    int result;
+
+    mutex_lock(&ip_table_mutex);
+    table = ip_table_dereference(ip_addr_lookup_table);
+    result = vnic_ip_table_remove(table, ip_addr);
+    if (result && (entries = vnic_ip_table_resize_hint(table, false))) {
+        ip_table_rebuild(entries);
+    }
+    mutex_unlock(&ip_table_mutex);
+    if (result) {
+        vnic_neigh_refresh();
+    }
+    return result;
+}
+
+/**
+ * Removes every entry for dev from the hash table, such as when dev is destroyed.
+ * Lookups which started before the removal may still return dev until a grace period
+ * has passed.
+ */
+static void remove_all_from_hash_table(struct net_device *dev) {
+    struct vnic_ip_table *table;
+    int entries;
+
+    mutex_lock(&ip_table_mutex);
+    table = ip_table_dereference(ip_addr_lookup_table);
+    if (vnic_ip_table_remove_value(table, dev) && (entries = vnic_ip_table_resize_hint(table, false))) {
+        ip_table_rebuild(entries);
+    }
+    mutex_unlock(&ip_table_mutex);
+}
+
+/**
+ * Returns a pointer to the net device with the defined IP address.
+ * Pointer is NULL if no device exists with the IP address
+ * Must be called under rcu_read_lock() or rcu_read_lock_bh()
+ */
+struct net_device *get_dev_from_hash_table(u32 ip_addr) {
+    struct vnic_ip_table *table = ip_table_dereference(ip_addr_lookup_table);
+    struct net_device *device;
+    int probes;
+
+    device = vnic_ip_table_lookup(table, ip_addr, &probes);
+    trace_vnic_lookup(ip_addr, device, probes);
+    return device;
+}
+
+/**
+ * Routes of prefixes to next hop vnics, for destinations with no entry of their own in
+ * the lookup table, from vnic_core.c. Rebuilt and published whole on every change, under
+ * ip_table_mutex. NULL while there are no routes
+ */
+static struct vnic_lpm __rcu *vnic_routes;
+// Enabled while there are routes, so that the data path does not look for them otherwise
+DEFINE_STATIC_KEY_FALSE(vnic_route_key);
+
+static void free_routes_rcu(struct rcu_head *head) {
+    vnic_lpm_free(container_of(head, struct vnic_lpm, rcu));
+}
+
+/**
+ * Replaces the forwarding table with one built from count routes.
+ * Must be called with ip_table_mutex held. Returns 0 on success, -ENOMEM on failure
+ */
+static int publish_routes(struct vnic_route *routes, int count) {
+    struct vnic_lpm *old_lpm = ip_table_dereference(vnic_routes);
+    struct vnic_lpm *new_lpm = NULL;
+
+    if (count && !(new_lpm = vnic_lpm_build(routes, count))) {
+        return -ENOMEM;
+    }
+    rcu_assign_pointer(vnic_routes, new_lpm);
+    if (new_lpm && !old_lpm) {
+        static_branch_enable(&vnic_route_key);
+    } else if (!new_lpm && old_lpm) {
+        static_branch_disable(&vnic_route_key);
+    }
+    if (old_lpm) {
+        call_rcu(&old_lpm->rcu, free_routes_rcu);
+    }
+    return 0;
+}
+
+/**
+ * Routes prefix/prefix_len to dev, replacing any route for the same prefix.
+ * Safe to call while packets are being forwarded.
+ * Returns 0 on success, -ENOMEM on failure
+ */
+int vnic_route_add(u32 prefix, int prefix_len, struct net_device *dev) {
+    struct vnic_lpm *lpm;
+    struct vnic_route *routes;
+    int count = 0;
+    int result = -ENOMEM;
+    int i;
+
+    prefix &= vnic_prefix_mask(prefix_len);
+    mutex_lock(&ip_table_mutex);
+    lpm = ip_table_dereference(vnic_routes);
+    routes = kvmalloc_array(lpm ? lpm->route_count + 1 : 1, sizeof(struct vnic_route), GFP_KERNEL);
+    if (routes) {
+        for (i = 0; lpm && i < lpm->route_count; i++) {
+            if (lpm->routes[i].prefix != prefix || lpm->routes[i].prefix_len != prefix_len) {
+                routes[count++] = lpm->routes[i];
+            }
+        }
+        routes[count].prefix = prefix;
+        routes[count].prefix_len = prefix_len;
+        routes[count++].value = dev;
+        result = publish_routes(routes, count);
+        kvfree(routes);
+    }
+    mutex_unlock(&ip_table_mutex);
+    if (!result) {
+        vnic_neigh_refresh();
+    }
+    return result;
+}
+
+/**
+ * Removes the route for prefix/prefix_len, or if dev is not NULL, every route through dev.
+ * Routes through a device being destroyed must not outlive it, so if memory runs out
+ * while rebuilding the table for dev, every route is removed instead.
+ * Returns 0 on success, -ENOENT if there was no such route, or -ENOMEM
+ */
+int vnic_route_del(u32 prefix, int prefix_len, struct net_device *dev) {
+    struct vnic_lpm *lpm;
+    struct vnic_route *routes;
+    int count = 0;
+    int result = -ENOENT;
+    int i;
+
+    prefix &= vnic_prefix_mask(prefix_len);
+    mutex_lock(&ip_table_mutex);
+    lpm = ip_table_dereference(vnic_routes);
+    if (!lpm) {
+        goto out;
+    }
+    routes = kvmalloc_array(lpm->route_count, sizeof(struct vnic_route), GFP_KERNEL);
+    for (i = 0; routes && i < lpm->route_count; i++) {
+        if (dev ? lpm->routes[i].value != dev :
+            lpm->routes[i].prefix != prefix || lpm->routes[i].prefix_len != prefix_len) {
+            routes[count++] = lpm->routes[i];
+        }
+    }
+    if (routes && count == lpm->route_count) {
+        kvfree(routes);
+        goto out;
+    }
+    result = routes ? publish_routes(routes, count) : -ENOMEM;
+    if (result && dev) {
+        printk(KERN_WARNING "vnic: Out of memory removing routes through %s, removing all routes\n",
+               dev->name);
+        result = publish_routes(NULL, 0);
+    }
+    kvfree(routes);
+out:
+    mutex_unlock(&ip_table_mutex);
+    // The neighbours of a vnic being destroyed are left for it to flush
+    if (!result && !dev) {
+        vnic_neigh_refresh();
+    }
+    return result;
+}
+
+/**
+ * Returns the device packets to ip_addr are sent to: the device with that address, or the
+ * next hop of the longest route to it. routed is set if the device was found by a route.
+ * Must be called under rcu_read_lock() or rcu_read_lock_bh()
+ */
+struct net_device *get_dev_for_ip(u32 ip_addr, bool *routed) {
+    struct net_device *device = get_dev_from_hash_table(ip_addr);
+    struct vnic_lpm *lpm;
+
+    *routed = false;
+    if (device || !static_branch_unlikely(&vnic_route_key)) {
+        return device;
+    }
+    lpm = ip_table_dereference(vnic_routes);
+    if (lpm && (device = vnic_lpm_lookup(lpm, ip_addr))) {
+        *routed = true;
+    }
+    return device;
+}
+
+/**
+ * For debugging
+ */
+void print_netdev_name(struct net_device *dev) {
+    if (dev->name == NULL) {
+        printk(KERN_CONT "NULL");
+    } else {
+        if (dev->name[0] == '\0') {
+            printk(KERN_CONT "Empty");
+        } else {
+            printk(KERN_CONT "%s", dev->name);
+        }
+    }
+}
+
+/**
+ * Hex dumps the linear data of a packet to the kernel log
+ * Only called when print_packet is set
+ */
+void vnic_print_skb(struct net_device *dev, struct sk_buff *skb) {
+    printk(KERN_DEBUG "vnic: %s: len is %u\n", dev->name, skb->len);
+    print_hex_dump(KERN_DEBUG, "vnic: ", DUMP_PREFIX_OFFSET, 16, 1,
+                   skb->data, skb_headlen(skb), false);
+}
+
+/**
+ * Finds the destination device from the ip-header.
+ * Packets to the network simulator are spread between its shards by a hash of their flow,
+ * which is the same in both directions, so that each shard sees whole conversations.
+ * \param send_dev pointer to the device from which the data is being sent
+ * \return Pointer to the net_device to send the packet to.
+ */
+struct net_device *find_dest_dev(struct sk_buff *skb, struct iphdr *iph, struct net_device *send_dev) {
+    bool routed;
+
+    if (!vnic_is_netsim_tx(send_dev)) {
+        // Sending packet TO netsim
+        if (netsim_shards == 1) {
+            return READ_ONCE(netsim_rxdevs[0]);
+        }
+        return READ_ONCE(netsim_rxdevs[reciprocal_scale(__skb_get_hash_symmetric(skb), netsim_shards)]);
+    }
+    // Sending packet FROM netsim, to the destination or the next hop towards it
+    return get_dev_for_ip(ntohl(iph->daddr), &routed);
+}
+
+/**
+ * ===============================================================
+ *                         Module methods
+ * ===============================================================
+ */
+
+/**
+ * Init function for VNICs
+ * This will only be called if using alloc_netdev() instead of alloc_etherdev()
+ */
+void vnic_init(struct net_device *dev) {
+    struct vnic_priv *priv;
+
+    // Assign some fields of the device
+    ether_setup(dev);
+
+    dev->flags |= IFF_NOARP;
+    // Packets are passed between vnics without being touched, so checksums and
+    // segmentation can be left to whoever finally needs them, as veth does
+    dev->features |= VNIC_FEATURES;
+    dev->hw_features |= VNIC_FEATURES;
+    dev->hw_enc_features |= VNIC_FEATURES;
+    dev->vlan_features |= VNIC_FEATURES;
+
+    priv = netdev_priv(dev);
+
+    // Zero out private memory
+    memset(priv, 0, sizeof(struct vnic_priv));
+    priv->dev = dev;
+    INIT_LIST_HEAD(&priv->list);
+
+    // Devices are freed by unregister_netdevice, however they were created
+    dev->needs_free_netdev = true;
+
+    dev->netdev_ops = &my_ops;
+    dev->header_ops = &my_header_ops;
+    dev->ethtool_ops = &vnic_ethtool_ops;
+}
+
+/**
+ * Builds the ethernet header of a packet which has no cached header, such as the first
+ * packets to a neighbour, or packets sent through packet sockets.
+ * The destination is the MAC address of the vnic the IP destination of the packet
+ * belongs to, or the next hop towards it, if there is one.
+ */
+int vnic_header(struct sk_buff *skb, struct net_device *dev,
+                unsigned short type, const void *daddr,
+                const void *saddr, unsigned int len) {
+    struct ethhdr *eth = (struct ethhdr *)skb_push(skb, ETH_HLEN);
+    struct iphdr *iph;
+    u32 ip_dest;
+    struct net_device *dest_dev;
+    bool routed;
+
+    // Set the protocol
+    eth->h_proto = htons(type);
+    // If saddr or daddr is null, set to the addres of this device, else don't change
+    memcpy(eth->h_source, saddr ? saddr : dev->dev_addr, dev->addr_len);
+    memcpy(eth->h_dest, daddr ? daddr : dev->dev_addr, dev->addr_len);
+
+    // Only IPv4 packets whose header has been written can be looked up
+    if (type != ETH_P_IP ||
+        skb_network_header(skb) + sizeof(struct iphdr) > skb_tail_pointer(skb)) {
+        return (dev->hard_header_len);
+    }
+
+    // Find the destination IP address of the packet, in order to determine the MAC address to route to
+    iph = ip_hdr(skb);
+    ip_dest = ntohl(iph->daddr);
+    dest_dev = get_dev_for_ip(ip_dest, &routed);
+    if (!dest_dev) {
+        // No registered device or route for the ip addr, traced by vnic_lookup
+        return (dev->hard_header_len);
+    }
+    memcpy(eth->h_dest, dest_dev->dev_addr, dev->addr_len);
+    return (dev->hard_header_len);
+}
+
+/**
+ * Copies the MAC address of the vnic an IPv4 neighbour belongs to, or of the next hop
+ * towards it, into the destination of eth.
+ * Returns false, leaving eth unchanged, if there is no such vnic
+ */
+static bool vnic_resolve_neigh(const struct neighbour *neigh, struct ethhdr *eth) {
+    struct net_device *dest_dev;
+    bool routed;
+
+    if (neigh->tbl != &arp_tbl) {
+        return false;
+    }
+    rcu_read_lock_bh();
+    dest_dev = get_dev_for_ip(ntohl(*(__be32 *)neigh->primary_key), &routed);
+    if (dest_dev) {
+        memcpy(eth->h_dest, dest_dev->dev_addr, ETH_ALEN);
+    }
+    rcu_read_unlock_bh();
+    return dest_dev != NULL;
+}
+
+/**
+ * Caches the ethernet header for a neighbour, so that the stack copies it onto each
+ * packet instead of calling vnic_header. Vnics do not use ARP, so the destination is
+ * resolved from the address of the neighbour once, when it is first used.
+ * Neighbours with no vnic, such as broadcast and multicast ones, cache the address of the
+ * neighbour, which is what vnic_header would write for them, so that their packets take
+ * the lockless path too. vnic_neigh_refresh rewrites the header if a vnic takes over
+ * the address later.
+ * Called with the lock of the neighbour held
+ */
+int vnic_header_cache(const struct neighbour *neigh, struct hh_cache *hh, __be16 type) {
+    struct ethhdr *eth = (struct ethhdr *)(((u8 *)hh->hh_data) + HH_DATA_OFF(sizeof(*eth)));
+
+    if (type != htons(ETH_P_IP) || !vnic_resolve_neigh(neigh, eth)) {
+        return eth_header_cache(neigh, hh, type);
+    }
+    eth->h_proto = type;
+    memcpy(eth->h_source, neigh->dev->dev_addr, ETH_ALEN);
+    // Pairs with the READ_ONCE of hh_len by the stack before it uses the header
+    smp_store_release(&hh->hh_len, ETH_HLEN);
+    return 0;
+}
+
+/**
+ * Updates a cached header, when the address of the neighbour changes or when the lookup
+ * table or routes change. Called with the seqlock of the header held for writing
+ */
+void vnic_header_cache_update(struct hh_cache *hh, const struct net_device *dev,
+                              const unsigned char *haddr) {
+    struct neighbour *neigh = container_of(hh, struct neighbour, hh);
+    struct ethhdr *eth = (struct ethhdr *)(((u8 *)hh->hh_data) + HH_DATA_OFF(sizeof(*eth)));
+
+    if (!vnic_resolve_neigh(neigh, eth)) {
+        memcpy(eth->h_dest, haddr, ETH_ALEN);
+    }
+}
+
+static void vnic_neigh_refresh_one(struct neighbour *neigh, void *cookie) {
+    struct hh_cache *hh = &neigh->hh;
+
+    if (neigh->dev->header_ops != &my_header_ops) {
+        return;
+    }
+    // The lock of the neighbour keeps its header from being cached while it is updated
+    write_lock(&neigh->lock);
+    if (READ_ONCE(hh->hh_len)) {
+        write_seqlock(&hh->hh_lock);
+        vnic_header_cache_update(hh, neigh->dev, neigh->ha);
+        write_sequnlock(&hh->hh_lock);
+    }
+    write_unlock(&neigh->lock);
+}
+
+/**
+ * Brings the cached headers of the neighbours of every vnic up to date, after the lookup
+ * table or routes have changed. Must be called after the change has been published
+ */
+static void vnic_neigh_refresh(void) {
+    neigh_for_each(&arp_tbl, vnic_neigh_refresh_one, NULL);
+}
+
+/**
+ * Receive rings hold both skbs and XDP frames. Frames, sent through ndo_xdp_xmit, are
+ * marked by setting the lowest bit of their pointer
+ */
+#define VNIC_XDP_FLAG 1UL
+
+static inline bool vnic_is_xdp_frame(void *ptr) {
+    return (unsigned long)ptr & VNIC_XDP_FLAG;
+}
+
+static inline void *vnic_xdp_to_ptr(struct xdp_frame *frame) {
+    return (void *)((unsigned long)frame | VNIC_XDP_FLAG);
+}
+
+static inline struct xdp_frame *vnic_ptr_to_xdp(void *ptr) {
+    return (struct xdp_frame *)((unsigned long)ptr & ~VNIC_XDP_FLAG);
+}
+
+/**
+ * Frees a packet taken from a receive ring without receiving it
+ */
+static void vnic_free_rx_ptr(void *ptr) {
+    if (vnic_is_xdp_frame(ptr)) {
+        xdp_return_frame(vnic_ptr_to_xdp(ptr));
+    } else {
+        dev_kfree_skb_any(ptr);
+    }
+}
+
+/**
+ * Frees the receive rings of the first count queues of the device, along with any
+ * packets that were never received
+ */
+static void vnic_free_queues(struct net_device *dev, int count) {
+    struct vnic_priv *priv = netdev_priv(dev);
+    int i;
+
+    if (priv->tx_waiters) {
+        vnic_tx_cancel(dev);
+    }
+    for (i = 0; i < count; i++) {
+        // Senders which found the device full cannot be left waiting on a freed ring
+        vnic_tx_wake(&priv->queues[i].tx_waiters);
+        if (xdp_rxq_info_is_reg(&priv->queues[i].xdp_rxq)) {
+            xdp_rxq_info_unreg(&priv->queues[i].xdp_rxq);
+        }
+        netif_napi_del(&priv->queues[i].napi);
+        ptr_ring_cleanup(&priv->queues[i].rx_ring, vnic_free_rx_ptr);
+    }
+    kfree(priv->queues);
+    priv->queues = NULL;
+    kfree(priv->tx_stats);
+    priv->tx_stats = NULL;
+    kfree(priv->tx_waiters);
+    priv->tx_waiters = NULL;
+    free_percpu(priv->stats);
+    priv->stats = NULL;
+}
+
+/**
+ * Allocates a receive ring and NAPI context for each receive queue of the device, and
+ * the statistics of the device.
+ * Called by register_netdev()
+ */
+int vnic_dev_init(struct net_device *dev) {
+    struct vnic_priv *priv = netdev_priv(dev);
+    int i;
+    int result;
+
+    priv->queues = kcalloc(dev->num_rx_queues, sizeof(struct vnic_queue), GFP_KERNEL);
+    priv->tx_stats = kcalloc(dev->num_tx_queues, sizeof(struct vnic_queue_stats), GFP_KERNEL);
+    priv->tx_waiters = kcalloc(dev->num_tx_queues, sizeof(struct vnic_tx_waiter), GFP_KERNEL);
+    priv->stats = netdev_alloc_pcpu_stats(struct vnic_pcpu_stats);
+    if (!priv->queues || !priv->tx_stats || !priv->tx_waiters || !priv->stats) {
+        vnic_free_queues(dev, 0);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < dev->num_tx_queues; i++) {
+        u64_stats_init(&priv->tx_stats[i].syncp);
+        INIT_LIST_HEAD(&priv->tx_waiters[i].node);
+        priv->tx_waiters[i].txq = netdev_get_tx_queue(dev, i);
+    }
+
+    for (i = 0; i < dev->num_rx_queues; i++) {
+        struct vnic_queue *queue = &priv->queues[i];
+
+        queue->dev = dev;
+        queue->index = i;
+        u64_stats_init(&queue->rx_stats.syncp);
+        vnic_ring_waiters_init(&queue->tx_waiters);
+        if ((result = ptr_ring_init(&queue->rx_ring, rx_ring_size, GFP_KERNEL))) {
+            vnic_free_queues(dev, i);
+            return result;
+        }
+        // Packets are received in batches by vnic_poll rather than one at a time
+        netif_napi_add(dev, &queue->napi, vnic_poll, NAPI_POLL_WEIGHT);
+
+        // Buffers which XDP programs see from this queue are whole pages, freed with put_page
+        if ((result = xdp_rxq_info_reg(&queue->xdp_rxq, dev, i)) ||
+            (result = xdp_rxq_info_reg_mem_model(&queue->xdp_rxq, MEM_TYPE_PAGE_SHARED, NULL))) {
+            vnic_free_queues(dev, i + 1);
+            return result;
+        }
+    }
+
+    list_add_tail(&priv->list, &vnic_list);
+    return 0;
+}
+
+/**
+ * Stops anything else in the module from sending packets to the device, then frees its
+ * receive queues and statistics. Called by unregister_netdevice(), with RTNL held
+ */
+void vnic_dev_uninit(struct net_device *dev) {
+    struct vnic_priv *priv = netdev_priv(dev);
+
+    list_del_init(&priv->list);
+    if (priv->netsim_role == VNIC_NETSIM_RX) {
+        WRITE_ONCE(netsim_rxdevs[priv->netsim_shard], NULL);
+    } else if (priv->netsim_role == VNIC_NETSIM_TX) {
+        WRITE_ONCE(netsim_txdevs[priv->netsim_shard], NULL);
+    }
+    remove_all_from_hash_table(dev);
+    vnic_route_del(0, 0, dev);
+    vnic_link_remove_dev(dev);
+    vnic_flow_remove_dev(dev);
+    vnic_pktgen_remove_dev(dev);
+    vnic_fanout_remove_dev(dev);
+
+    // Wait for senders which found the device before it was removed, then drop the
+    // packets they left waiting on emulated links
+    synchronize_net();
+    vnic_link_purge_dev(dev);
+
+    vnic_free_queues(dev, dev->num_rx_queues);
+}
+
+/**
+ * ===============================================================
+ *                           Statistics
+ * ===============================================================
+ */
+
+/**
+ * Adds a packet of len bytes to the counters of a queue
+ * Must only be called by the single writer of the queue
+ */
+static inline void vnic_queue_stats_add(struct vnic_queue_stats *stats, unsigned int len) {
+    u64_stats_update_begin(&stats->syncp);
+    stats->packets++;
+    stats->bytes += len;
+    u64_stats_update_end(&stats->syncp);
+}
+
+static void vnic_queue_stats_read(struct vnic_queue_stats *stats, u64 *packets, u64 *bytes) {
+    unsigned int start;
+
+    do {
+        start = u64_stats_fetch_begin(&stats->syncp);
+        *packets = stats->packets;
+        *bytes = stats->bytes;
+    } while (u64_stats_fetch_retry(&stats->syncp, start));
+}
+
+/**
+ * Sums the per-CPU counters of a device into drops and counters
+ */
+static void vnic_pcpu_stats_read(struct vnic_priv *priv, u64 *drops, u64 *counters) {
+    int cpu;
+    int i;
+
+    memset(drops, 0, sizeof(u64) * VNIC_DROP_MAX);
+    memset(counters, 0, sizeof(u64) * VNIC_COUNTER_MAX);
+
+    for_each_possible_cpu(cpu) {
+        struct vnic_pcpu_stats *stats = per_cpu_ptr(priv->stats, cpu);
+        u64 cpu_drops[VNIC_DROP_MAX];
+        u64 cpu_counters[VNIC_COUNTER_MAX];
+        unsigned int start;
+
+        do {
+            start = u64_stats_fetch_begin(&stats->syncp);
+            memcpy(cpu_drops, stats->drops, sizeof(cpu_drops));
+            memcpy(cpu_counters, stats->counters, sizeof(cpu_counters));
+        } while (u64_stats_fetch_retry(&stats->syncp, start));
+
+        for (i = 0; i < VNIC_DROP_MAX; i++) {
+            drops[i] += cpu_drops[i];
+        }
+        for (i = 0; i < VNIC_COUNTER_MAX; i++) {
+            counters[i] += cpu_counters[i];
+        }
+    }
+}
+
+/**
+ * Records that count packets on dev have been dropped, where they are freed by the caller,
+ * such as XDP frames. Must be called with bottom halves disabled.
+ */
+void vnic_count_drops(struct net_device *dev, enum vnic_drop_reason reason, unsigned int count) {
+    struct vnic_pcpu_stats *stats = this_cpu_ptr(((struct vnic_priv *)netdev_priv(dev))->stats);
+
+    u64_stats_update_begin(&stats->syncp);
+    stats->drops[reason] += count;
+    u64_stats_update_end(&stats->syncp);
+}
+
+/**
+ * Records that a packet on dev has been dropped, and frees it.
+ * Drops before a destination is found are counted against the transmitting device,
+ * while drops by the destination are counted against the receiving device.
+ * Must be called with bottom halves disabled.
+ */
+void vnic_drop(struct net_device *dev, struct sk_buff *skb, enum vnic_drop_reason reason) {
+    trace_vnic_drop(dev, skb, reason);
+    vnic_count_drops(dev, reason, 1);
+    dev_kfree_skb_any(skb);
+}
+
+/**
+ * Records an event on dev, such as a packet being sent to, or from, the network simulator
+ * Must be called with bottom halves disabled.
+ */
+void vnic_count(struct net_device *dev, enum vnic_counter counter) {
+    struct vnic_pcpu_stats *stats = this_cpu_ptr(((struct vnic_priv *)netdev_priv(dev))->stats);
+
+    u64_stats_update_begin(&stats->syncp);
+    stats->counters[counter]++;
+    u64_stats_update_end(&stats->syncp);
+}
+
+/**
+ * ndo_get_stats64 method. Sums the counters of all queues and CPUs of the device
+ */
+void vnic_get_stats64(struct net_device *dev, struct rtnl_link_stats64 *stats) {
+    struct vnic_priv *priv = netdev_priv(dev);
+    u64 drops[VNIC_DROP_MAX];
+    u64 counters[VNIC_COUNTER_MAX];
+    u64 packets, bytes;
+    int i;
+
+    for (i = 0; i < dev->real_num_tx_queues; i++) {
+        vnic_queue_stats_read(&priv->tx_stats[i], &packets, &bytes);
+        stats->tx_packets += packets;
+        stats->tx_bytes += bytes;
+    }
+
+    for (i = 0; i < dev->real_num_rx_queues; i++) {
+        vnic_queue_stats_read(&priv->queues[i].rx_stats, &packets, &bytes);
+        stats->rx_packets += packets;
+        stats->rx_bytes += bytes;
+    }
+
+    vnic_pcpu_stats_read(priv, drops, counters);
+    stats->tx_dropped = drops[VNIC_DROP_NO_DEST] + drops[VNIC_DROP_TOO_SHORT] +
+                        drops[VNIC_DROP_LINK_LOSS] + drops[VNIC_DROP_LINK_LIMIT];
+    stats->rx_dropped = drops[VNIC_DROP_DEST_DOWN] + drops[VNIC_DROP_RX_FULL] +
+                        drops[VNIC_DROP_NO_MEM] + drops[VNIC_DROP_XDP];
+}
+
+/**
+ * Names of the counters reported by `ethtool -S`, which are not per-queue
+ * Drop counters are in the order of enum vnic_drop_reason, then the others in the order
+ * of enum vnic_counter
+ */
+static const char vnic_gstrings_stats[][ETH_GSTRING_LEN] = {
+    "lookup_miss",
+    "dest_down",
+    "too_short",
+    "rx_queue_full",
+    "no_mem",
+    "link_loss",
+    "link_limit",
+    "xdp_drop",
+    "netsim_forwarded",
+    "xdp_tx",
+    "xdp_redirect",
+    "routed",
+    "tx_stopped",
+    "flow_bypassed",
+    "fanout_cloned",
+};
+
+#define VNIC_GLOBAL_STATS_LEN ARRAY_SIZE(vnic_gstrings_stats)
+// Packets and bytes for each queue
+#define VNIC_QUEUE_STATS_LEN 2
+
+static void vnic_get_drvinfo(struct net_device *dev, struct ethtool_drvinfo *info) {
+    strlcpy(info->driver, "vnic", sizeof(info->driver));
+}
+
+static int vnic_get_sset_count(struct net_device *dev, int sset) {
+    switch (sset) {
+    case ETH_SS_STATS:
+        return VNIC_GLOBAL_STATS_LEN +
+               (dev->real_num_tx_queues + dev->real_num_rx_queues) * VNIC_QUEUE_STATS_LEN;
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+static void vnic_get_strings(struct net_device *dev, u32 stringset, u8 *buf) {
+    int i;
+
+    BUILD_BUG_ON(VNIC_GLOBAL_STATS_LEN != VNIC_DROP_MAX + VNIC_COUNTER_MAX);
+    if (stringset != ETH_SS_STATS) {
+        return;
+    }
+
+    memcpy(buf, vnic_gstrings_stats, sizeof(vnic_gstrings_stats));
+    buf += sizeof(vnic_gstrings_stats);
+
+    for (i = 0; i < dev->real_num_tx_queues; i++) {
+        snprintf(buf, ETH_GSTRING_LEN, "tx_queue_%u_packets", i);
+        buf += ETH_GSTRING_LEN;
+        snprintf(buf, ETH_GSTRING_LEN, "tx_queue_%u_bytes", i);
+        buf += ETH_GSTRING_LEN;
+    }
+    for (i = 0; i < dev->real_num_rx_queues; i++) {
+        snprintf(buf, ETH_GSTRING_LEN, "rx_queue_%u_packets", i);
+        buf += ETH_GSTRING_LEN;
+        snprintf(buf, ETH_GSTRING_LEN, "rx_queue_%u_bytes", i);
+        buf += ETH_GSTRING_LEN;
+    }
+}
+
+static void vnic_get_ethtool_stats(struct net_device *dev,
+                                   struct ethtool_stats *stats, u64 *data) {
+    struct vnic_priv *priv = netdev_priv(dev);
+    u64 drops[VNIC_DROP_MAX];
+    int i;
+
+    vnic_pcpu_stats_read(priv, drops, &data[VNIC_DROP_MAX]);
+    memcpy(data, drops, sizeof(drops));
+    data += VNIC_GLOBAL_STATS_LEN;
+
+    for (i = 0; i < dev->real_num_tx_queues; i++) {
+        vnic_queue_stats_read(&priv->tx_stats[i], &data[0], &data[1]);
+        data += VNIC_QUEUE_STATS_LEN;
+    }
+    for (i = 0; i < dev->real_num_rx_queues; i++) {
+        vnic_queue_stats_read(&priv->queues[i].rx_stats, &data[0], &data[1]);
+        data += VNIC_QUEUE_STATS_LEN;
+    }
+}
+
+static const struct ethtool_ops vnic_ethtool_ops = {
+    .get_drvinfo = vnic_get_drvinfo,
+    .get_link = ethtool_op_get_link,
+    .get_sset_count = vnic_get_sset_count,
+    .get_strings = vnic_get_strings,
+    .get_ethtool_stats = vnic_get_ethtool_stats,
+};
+
+/**
+ * Stub for open
+ * The MAC address of the device is set when it is created
+ */
+int vnic_open(struct net_device *dev) {
+    struct vnic_priv *priv = netdev_priv(dev);
+    int i;
+
+    printk("vnic: vnic_open called\n");
+    printk(KERN_INFO "vnic: opening device %pMF", dev->dev_addr);
+    for (i = 0; i < dev->real_num_rx_queues; i++) {
+        napi_enable(&priv->queues[i].napi);
+    }
+    for (i = 0; i < dev->num_tx_queues; i++) {
+        netdev_tx_reset_queue(netdev_get_tx_queue(dev, i));
+    }
+    // Queues left waiting on a ring when the device was stopped start again here instead
+    vnic_tx_cancel(dev);
+    netif_tx_start_all_queues(dev);
+    return 0;
+}
+
+/**
+ * Stops the device, dropping any packets still waiting to be received
+ */
+int vnic_release(struct net_device *dev) {
+    struct vnic_priv *priv = netdev_priv(dev);
+    void *ptr;
+    int i;
+
+    printk("vnic: vnic_release called\n");
+    netif_tx_stop_all_queues(dev);
+
+    for (i = 0; i < dev->real_num_rx_queues; i++) {
+        napi_disable(&priv->queues[i].napi);
+        while ((ptr = ptr_ring_consume_bh(&priv->queues[i].rx_ring))) {
+            vnic_free_rx_ptr(ptr);
+        }
+        // Senders waiting for room now find the device down, and drop their packets
+        vnic_tx_wake(&priv->queues[i].tx_waiters);
+    }
+    return 0;
+}
+
+/**
+ * Chooses the transmit queue for a packet from its flow hash, so that packets of one
+ * flow stay in order while different flows are spread over all queues
+ */
+u16 vnic_select_queue(struct net_device *dev, struct sk_buff *skb,
+                      struct net_device *sb_dev) {
+    return reciprocal_scale(skb_get_hash(skb), dev->real_num_tx_queues);
+}
+
+/**
+ * ===============================================================
+ *                        Batched delivery
+ * ===============================================================
+ */
+
+// The most packets which are held back on a CPU before being delivered
+#define VNIC_BATCH_SIZE 64
+
+/**
+ * Packets waiting on a CPU to be delivered to receive queues. Delivery is deferred while
+ * the stack says more packets are coming (xmit_more), so that each receive queue is
+ * locked, and its NAPI scheduled, once per batch rather than once per packet.
+ * Packets sent through ndo_start_xmit are counted by Byte Queue Limits against the
+ * transmit queue they came from until the batch is delivered.
+ * Only used with bottom halves disabled, so needs no lock.
+ */
+struct vnic_batch {
+    unsigned int count;
+    struct vnic_queue *queues[VNIC_BATCH_SIZE];
+    struct sk_buff *skbs[VNIC_BATCH_SIZE];
+    struct netdev_queue *txqs[VNIC_BATCH_SIZE]; /* NULL if not sent through a transmit queue */
+    unsigned int lens[VNIC_BATCH_SIZE];
+};
+
+static DEFINE_PER_CPU(struct vnic_batch, vnic_batches);
+
+/**
+ * Delivers every packet in the batch of this CPU. Packets for the same receive queue are
+ * added to its ring under one acquisition of the ring lock, in the order they were sent,
+ * then the queue is woken once.
+ * Must be called with bottom halves disabled.
+ */
+void vnic_batch_flush(void) {
+    struct vnic_batch *batch = this_cpu_ptr(&vnic_batches);
+    struct sk_buff *dropped[VNIC_BATCH_SIZE];
+    unsigned int drop_count = 0;
+    unsigned int i, j;
+
+    for (i = 0; i < batch->count; i++) {
+        struct vnic_queue *queue = batch->queues[i];
+
+        if (!batch->skbs[i]) {
+            // Already delivered with an earlier packet for the same queue
+            continue;
+        }
+
+        spin_lock(&queue->rx_ring.producer_lock);
+        for (j = i; j < batch->count; j++) {
+            if (batch->queues[j] != queue || !batch->skbs[j]) {
+                continue;
+            }
+            if (__ptr_ring_produce(&queue->rx_ring, batch->skbs[j])) {
+                dropped[drop_count++] = batch->skbs[j];
+            } else {
+                trace_vnic_rx(queue->dev, batch->skbs[j], queue->index);
+            }
+            batch->skbs[j] = NULL;
+        }
+        spin_unlock(&queue->rx_ring.producer_lock);
+
+        napi_schedule(&queue->napi);
+
+        // Drop outside of the ring lock
+        while (drop_count) {
+            vnic_drop(queue->dev, dropped[--drop_count], VNIC_DROP_RX_FULL);
+        }
+    }
+
+    // The packets have left their transmit queues, whether they were delivered or dropped
+    for (i = 0; i < batch->count; i++) {
+        struct netdev_queue *txq = batch->txqs[i];
+        unsigned int packets = 0, bytes = 0;
+
+        if (!txq) {
+            continue;
+        }
+        for (j = i; j < batch->count; j++) {
+            if (batch->txqs[j] == txq) {
+                packets++;
+                bytes += batch->lens[j];
+                batch->txqs[j] = NULL;
+            }
+        }
+        netdev_tx_completed_queue(txq, packets, bytes);
+    }
+    batch->count = 0;
+}
+
+/**
+ * Adds a packet for a receive queue to the batch of this CPU, flushing the batch if it
+ * is full. txq is the transmit queue the packet was sent from, or NULL.
+ * Must be called with bottom halves disabled.
+ */
+static void vnic_batch_add(struct vnic_queue *queue, struct sk_buff *skb,
+                           struct netdev_queue *txq) {
+    struct vnic_batch *batch = this_cpu_ptr(&vnic_batches);
+
+    if (txq) {
+        batch->lens[batch->count] = skb->len;
+        netdev_tx_sent_queue(txq, skb->len);
+    }
+    batch->queues[batch->count] = queue;
+    batch->skbs[batch->count] = skb;
+    batch->txqs[batch->count] = txq;
+    if (++batch->count == VNIC_BATCH_SIZE) {
+        vnic_batch_flush();
+    }
+}
+
+/**
+ * ===============================================================
+ *                          Backpressure
+ * ===============================================================
+ */
+
+/**
+ * Takes a waiter off the ring it is waiting on, if it is. Must be called under RTNL or
+ * rcu_read_lock_bh(): the rings of vnics are only freed under RTNL, and the rings of the
+ * network simulator a grace period after their waiters have been woken
+ */
+static void vnic_tx_unwait(struct vnic_tx_waiter *waiter) {
+    struct vnic_ring_waiters *ring_waiters = READ_ONCE(waiter->ring_waiters);
+
+    if (!ring_waiters) {
+        return;
+    }
+    spin_lock_bh(&ring_waiters->lock);
+    // The ring may have woken the waiter since
+    if (waiter->ring_waiters == ring_waiters) {
+        list_del_init(&waiter->node);
+        WRITE_ONCE(waiter->ring_waiters, NULL);
+    }
+    spin_unlock_bh(&ring_waiters->lock);
+}
+
+/**
+ * Stops a transmit queue of dev until the ring of ring_waiters has room, as a NIC stops
+ * its queue when its descriptor ring fills. The caller must check for room again
+ * afterwards, since the ring may have been drained before the queue was stopped.
+ * Must be called with the transmit queue locked, as in ndo_start_xmit.
+ */
+static void vnic_tx_wait(struct net_device *dev, u16 queue_index,
+                         struct vnic_ring_waiters *ring_waiters) {
+    struct vnic_tx_waiter *waiter = &((struct vnic_priv *)netdev_priv(dev))->tx_waiters[queue_index];
+
+    netif_tx_stop_queue(waiter->txq);
+    // A stopped queue is only started again by a wake, or when the device is opened, which
+    // both take its waiter off its ring, so this only finds a waiter left behind by a bug
+    if (unlikely(READ_ONCE(waiter->ring_waiters))) {
+        vnic_tx_unwait(waiter);
+    }
+    spin_lock_bh(&ring_waiters->lock);
+    list_add_tail(&waiter->node, &ring_waiters->list);
+    WRITE_ONCE(waiter->ring_waiters, ring_waiters);
+    spin_unlock_bh(&ring_waiters->lock);
+    vnic_count(dev, VNIC_TX_STOPPED);
+
+    // Pairs with the barrier in vnic_tx_wake. Either the receiver sees this waiter, or
+    // the caller sees the room the receiver made
+    smp_mb();
+}
+
+/**
+ * Wakes every transmit queue waiting for room in the ring of ring_waiters.
+ * Called by the receiver after taking packets from the ring, and before the ring is freed.
+ */
+void vnic_tx_wake(struct vnic_ring_waiters *ring_waiters) {
+    struct vnic_tx_waiter *waiter, *next;
+
+    // Pairs with the barrier in vnic_tx_wait
+    smp_mb();
+    if (likely(list_empty(&ring_waiters->list))) {
+        return;
+    }
+
+    spin_lock_bh(&ring_waiters->lock);
+    list_for_each_entry_safe(waiter, next, &ring_waiters->list, node) {
+        list_del_init(&waiter->node);
+        WRITE_ONCE(waiter->ring_waiters, NULL);
+        netif_tx_wake_queue(waiter->txq);
+        // The simulator's packets are not held in a qdisc, so the rest of them have
+        // to be sent again from its tx ring
+        if (vnic_is_netsim_tx(waiter->txq->dev)) {
+            vnic_netsim_tx_resume(waiter->txq->dev);
+        }
+    }
+    spin_unlock_bh(&ring_waiters->lock);
+}
+
+/**
+ * Stops every transmit queue of dev from waiting, before the device is started again or
+ * freed. Must be called under RTNL
+ */
+static void vnic_tx_cancel(struct net_device *dev) {
+    struct vnic_priv *priv = netdev_priv(dev);
+    int i;
+
+    rcu_read_lock_bh();
+    for (i = 0; i < dev->num_tx_queues; i++) {
+        vnic_tx_unwait(&priv->tx_waiters[i]);
+    }
+    rcu_read_unlock_bh();
+}
+
+/**
+ * Chooses the receive queue of dev for a packet, from its flow hash, so that a flow is
+ * always received on the same queue
+ */
+static inline struct vnic_queue *vnic_rx_queue(struct net_device *dev, struct sk_buff *skb) {
+    struct vnic_priv *priv = netdev_priv(dev);
+
+    return &priv->queues[reciprocal_scale(skb_get_hash(skb), dev->real_num_rx_queues)];
+}
+
+/**
+ * Finds whether the ring dev would receive skb on is full.
+ * Returns the waiting senders of the ring if it is full, or NULL if the packet
+ * fits, or would be dropped for another reason
+ */
+static struct vnic_ring_waiters *vnic_rx_busy(struct net_device *dev, struct sk_buff *skb) {
+    struct vnic_ring_waiters *ring_waiters;
+    struct vnic_queue *queue;
+    int busy;
+
+    if (vnic_is_netsim_rx(dev) &&
+        (busy = vnic_netsim_rx_busy(dev, skb->len, &ring_waiters)) != -ENODEV) {
+        return busy ? ring_waiters : NULL;
+    }
+    if (!netif_running(dev)) {
+        return NULL;
+    }
+    queue = vnic_rx_queue(dev, skb);
+    // Looks at the slot the next packet goes in without taking the producer lock. A stale
+    // answer only costs a packet dropped when the batch is delivered, or a retried stop
+    return __ptr_ring_full(&queue->rx_ring) ? &queue->tx_waiters : NULL;
+}
+
+/**
+ * Stops the transmit queue of a packet if the ring it would be received on is full, so
+ * that the packet waits in the qdisc rather than being dropped.
+ * Returns true if the packet should be handed back with NETDEV_TX_BUSY
+ */
+static bool vnic_tx_throttle(struct net_device *dev, u16 queue_index,
+                             struct net_device *dest_dev, struct sk_buff *skb) {
+    struct vnic_ring_waiters *ring_waiters = vnic_rx_busy(dest_dev, skb);
+
+    if (likely(!ring_waiters)) {
+        return false;
+    }
+    vnic_tx_wait(dev, queue_index, ring_waiters);
+    if (vnic_rx_busy(dest_dev, skb)) {
+        return true;
+    }
+    // The ring was drained while the queue was being stopped
+    vnic_tx_wake(ring_waiters);
+    return false;
+}
+
+
+/**
+ * Sends a single packet from dev towards its destination
+ */
+static netdev_tx_t vnic_xmit_one(struct sk_buff *skb, struct net_device *dev) {
+    struct vnic_priv *priv = netdev_priv(dev);
+    u16 queue_index = skb_get_queue_mapping(skb);
+    unsigned int length;
+    struct iphdr *iph;
+    struct net_device *dest_dev = NULL;
+    struct vnic_link *link = NULL;
+    struct net_device *flow_dev;
+    const struct vnic_fanout_set *fanout = NULL;
+    bool routed = false;
+    bool bypassed = false;
+    int result;
+
+    // Whatever the qdisc or IP layer left in skb->cb must not pass for a latency stamp,
+    // whether or not measurement is on now
+    VNIC_SKB_CB(skb)->epoch = 0;
+
+    if (static_branch_unlikely(&print_packet_key)) {
+        vnic_print_skb(dev, skb);
+    }
+
+    // From LDD3 snull. Make sure the packet is long enough to extract an ethernet and ip header,
+    // and that they are in the linear part of a GSO or scatter-gather packet
+    if (!pskb_may_pull(skb, sizeof(struct ethhdr) + sizeof(struct iphdr))) {
+        vnic_drop(dev, skb, VNIC_DROP_TOO_SHORT);
+        return NETDEV_TX_OK;
+    }
+
+    // pad short packets with 0s. The skb is freed if it cannot be padded
+    if (skb_put_padto(skb, ETH_ZLEN)) {
+        return NETDEV_TX_OK;
+    }
+
+    // Get the IP address header. Padding may have moved the data, so only after padding
+    iph = ip_hdr(skb);
+
+    // Save timestamp for start of transmission
+    netif_trans_update(dev);
+
+    // Vnics joined by an emulated link send to each other directly, and packets to
+    // destinations behind a route are forwarded to the next hop without the simulator
+    if ((static_branch_unlikely(&vnic_link_key) || static_branch_unlikely(&vnic_route_key)) &&
+        !vnic_is_netsim_tx(dev)) {
+        dest_dev = get_dev_for_ip(ntohl(iph->daddr), &routed);
+        if (dest_dev && static_branch_unlikely(&vnic_link_key)) {
+            link = vnic_link_find(dev, dest_dev);
+        }
+    }
+    // If the source address is NOT the network simulator, send it to the network simulator.
+    if (!link && !routed) {
+        // Broadcast and multicast packets from the simulator go to every vnic listening for
+        // them. Directed broadcasts are only looked for once no vnic has the address
+        if (static_branch_unlikely(&vnic_fanout_key) && vnic_is_netsim_tx(dev) &&
+            (ipv4_is_multicast(iph->daddr) || ipv4_is_lbcast(iph->daddr))) {
+            fanout = vnic_fanout_lookup(iph);
+        } else {
+            dest_dev = find_dest_dev(skb, iph, dev);
+            if (!dest_dev && static_branch_unlikely(&vnic_fanout_key) && vnic_is_netsim_tx(dev)) {
+                fanout = vnic_fanout_lookup(iph);
+            }
+        }
+        // Flows the simulator has handed back to the kernel go straight to their vnic
+        if (static_branch_unlikely(&vnic_flow_key) && !vnic_is_netsim_tx(dev) &&
+            (flow_dev = vnic_flow_lookup(skb, iph))) {
+            dest_dev = flow_dev;
+            bypassed = true;
+        }
+    }
+    if (dest_dev && !link && vnic_tx_throttle(dev, queue_index, dest_dev, skb)) {
+        return NETDEV_TX_BUSY;
+    }
+    if (static_branch_unlikely(&vnic_capture_key)) {
+        vnic_capture_skb(skb);
+    }
+    if (static_branch_unlikely(&vnic_latency_key)) {
+        vnic_latency_stamp(skb, dev, dest_dev);
+    }
+    trace_vnic_xmit(dev, skb, iph, dest_dev);
+    if (fanout) {
+        vnic_count(dev, VNIC_NETSIM_FORWARDED);
+        length = skb->len;
+        if (vnic_fanout_xmit(fanout, dev, skb, netdev_get_tx_queue(dev, queue_index))) {
+            vnic_queue_stats_add(&priv->tx_stats[queue_index], length);
+        }
+        return NETDEV_TX_OK;
+    }
+    if (!dest_dev) {
+        // Drop the packet if destination is null
+        vnic_drop(dev, skb, VNIC_DROP_NO_DEST);
+        return NETDEV_TX_OK;
+    }
+    if (routed) {
+        vnic_count(dev, VNIC_ROUTED);
+    } else if (bypassed) {
+        vnic_count(dev, VNIC_FLOW_BYPASSED);
+    } else if (!link && (vnic_is_netsim_tx(dev) || vnic_is_netsim_rx(dest_dev))) {
+        vnic_count(dev, VNIC_NETSIM_FORWARDED);
+    }
+
+    // Otherwise, queue the packet on the selected device. It is received later by vnic_poll
+    length = skb->len;
+    if (link) {
+        result = vnic_link_xmit(link, dest_dev, skb);
+    } else {
+        result = __vnic_rx(dest_dev, skb, netdev_get_tx_queue(dev, queue_index));
+    }
+    if (result == NET_RX_SUCCESS) {
+        vnic_queue_stats_add(&priv->tx_stats[queue_index], length);
+    }
+
+    return NETDEV_TX_OK;
+}
+
+/**
+ * Method for transmit
+ * Packets are delivered in batches, which are flushed once the stack has no more
+ * packets waiting to be sent (xmit_more is false), or once the queue has been stopped,
+ * by Byte Queue Limits or because the destination is full.
+ */
+netdev_tx_t vnic_xmit(struct sk_buff *skb, struct net_device *dev) {
+    struct netdev_queue *txq = skb_get_tx_queue(dev, skb);
+    netdev_tx_t result = vnic_xmit_one(skb, dev);
+
+    if (!netdev_xmit_more() || netif_xmit_stopped(txq)) {
+        vnic_batch_flush();
+    }
+    return result;
+}
+
+/**
+ * Transmits skb from dev through its ndo_start_xmit, as pktgen does, for packets made
+ * inside the module by the network simulator and the packet generator.
+ * more is passed on as xmit_more. Must be called with bottom halves disabled.
+ * Returns NETDEV_TX_BUSY, without consuming the packet, if the queue is stopped.
+ */
+netdev_tx_t vnic_inject_xmit(struct net_device *dev, struct sk_buff *skb, bool more) {
+    struct netdev_queue *txq;
+    netdev_tx_t result = NETDEV_TX_BUSY;
+
+    skb_set_queue_mapping(skb, vnic_select_queue(dev, skb, NULL));
+    txq = skb_get_tx_queue(dev, skb);
+
+    __netif_tx_lock(txq, smp_processor_id());
+    if (!netif_xmit_frozen_or_drv_stopped(txq)) {
+        result = netdev_start_xmit(skb, dev, txq, more);
+    }
+    __netif_tx_unlock(txq);
+    return result;
+}
+
+/**
+ * Queues a packet on a receive ring of dev, and schedules NAPI on that ring to receive it.
+ * The ring is chosen from the flow hash of the packet, so a flow is always received on
+ * the same queue. The packet is dropped if dev is not running, or if the ring is full.
+ * Delivery to the ring is deferred to the batch of this CPU, so the caller must call
+ * vnic_batch_flush() once it has no more packets to send.
+ * txq is the transmit queue the packet was sent from, for Byte Queue Limits, or NULL.
+ * Must be called with bottom halves disabled, as is the case in vnic_xmit.
+ * Returns NET_RX_SUCCESS, or NET_RX_DROP if the packet was dropped.
+ */
+int __vnic_rx(struct net_device *dev, struct sk_buff *skb, struct netdev_queue *txq) {
+    struct vnic_queue *queue;
+    int result;
+
+    // While the simulator has /dev/vnic_netsim open, its packets go to the shared ring
+    if (vnic_is_netsim_rx(dev) && (result = vnic_netsim_rx(dev, skb)) != -ENODEV) {
+        return result;
+    }
+
+    if (!netif_running(dev)) {
+        vnic_drop(dev, skb, VNIC_DROP_DEST_DOWN);
+        return NET_RX_DROP;
+    }
+
+    queue = vnic_rx_queue(dev, skb);
+
+    // Clear state belonging to the sending device, such as its route, in case the
+    // receiving device is in a different network namespace
+    skb_scrub_packet(skb, !net_eq(dev_net(skb->dev), dev_net(dev)));
+    skb_record_rx_queue(skb, queue->index);
+
+    vnic_batch_add(queue, skb, txq);
+    return NET_RX_SUCCESS;
+}
+
+int vnic_rx(struct net_device *dev, struct sk_buff *skb) {
+    return __vnic_rx(dev, skb, NULL);
+}
+
+/**
+ * Passes a received packet to the stack through GRO
+ */
+static void vnic_receive_skb(struct vnic_queue *queue, struct sk_buff *skb) {
+    if (static_branch_unlikely(&vnic_latency_key)) {
+        vnic_latency_deliver(skb, queue->dev);
+    }
+    vnic_queue_stats_add(&queue->rx_stats, skb->len);
+    // ip_summed is left as the sender set it. CHECKSUM_PARTIAL packets have not had
+    // their checksums filled in, which the stack accepts as already verified
+    skb->protocol = eth_type_trans(skb, queue->dev);
+    napi_gro_receive(&queue->napi, skb);
+}
+
+/**
+ * ===============================================================
+ *                              XDP
+ * ===============================================================
+ */
+
+// The longest packet which can be copied onto a page of the page cache for XDP, behind
+// at least XDP_PACKET_HEADROOM and with skb_shared_info
+#define VNIC_XDP_MAX_LEN VNIC_POOL_MAX_LEN
+
+/**
+ * ndo_bpf method. Attaches or detaches the XDP program run on every packet the device
+ * receives. Programs are refused while packets as long as the MTU would not fit in a
+ * page with the headroom XDP needs. Called with RTNL held
+ */
+int vnic_bpf(struct net_device *dev, struct netdev_bpf *bpf) {
+    struct vnic_priv *priv = netdev_priv(dev);
+    struct bpf_prog *old_prog;
+
+    switch (bpf->command) {
+    case XDP_SETUP_PROG:
+        if (bpf->prog && dev->mtu + ETH_HLEN > VNIC_XDP_MAX_LEN) {
+            NL_SET_ERR_MSG_MOD(bpf->extack, "MTU too large for XDP");
+            return -EOPNOTSUPP;
+        }
+        old_prog = rtnl_dereference(priv->xdp_prog);
+        rcu_assign_pointer(priv->xdp_prog, bpf->prog);
+        // NAPI may still be running the old program, but bpf_prog_put frees it after RCU
+        if (old_prog) {
+            bpf_prog_put(old_prog);
+        }
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+/**
+ * ndo_xdp_xmit method. Frames redirected to a vnic by an XDP program are received by it,
+ * as packets sent by the network simulator are, through the receive queue of this CPU.
+ * Frames are queued in order until one is too long or does not fit in the ring. The
+ * caller frees that frame and the ones after it.
+ * Must be called with bottom halves disabled, as it is by XDP_REDIRECT.
+ * Returns the number of frames queued, or a negative error if none were taken
+ */
+int vnic_xdp_xmit(struct net_device *dev, int n, struct xdp_frame **frames, u32 flags) {
+    struct vnic_priv *priv = netdev_priv(dev);
+    enum vnic_drop_reason reason = VNIC_DROP_RX_FULL;
+    struct vnic_queue *queue;
+    unsigned int max_len;
+    int i;
+
+    if (unlikely(flags & ~XDP_XMIT_FLAGS_MASK)) {
+        return -EINVAL;
+    }
+    if (unlikely(!netif_running(dev))) {
+        return -ENETDOWN;
+    }
+
+    queue = &priv->queues[smp_processor_id() % dev->real_num_rx_queues];
+    max_len = dev->mtu + dev->hard_header_len + VLAN_HLEN;
+
+    spin_lock(&queue->rx_ring.producer_lock);
+    for (i = 0; i < n; i++) {
+        if (unlikely(frames[i]->len > max_len)) {
+            reason = VNIC_DROP_XDP;
+            break;
+        }
+        if (unlikely(__ptr_ring_produce(&queue->rx_ring, vnic_xdp_to_ptr(frames[i])))) {
+            break;
+        }
+    }
+    spin_unlock(&queue->rx_ring.producer_lock);
+
+    // The frames left are dropped by the caller, for the reason the first of them was not queued
+    if (i < n) {
+        vnic_count_drops(dev, reason, n - i);
+    }
+    if (flags & XDP_XMIT_FLUSH) {
+        napi_schedule(&queue->napi);
+    }
+    return i;
+}
+
+/**
+ * Sends a packet an XDP program returned XDP_TX for back out of dev, to wherever packets
+ * sent by dev go. Packets sent back out of the simulator's receiving device go on to
+ * their destinations, as if the simulator had sent them. Emulated links are not applied.
+ * The caller must call vnic_batch_flush() once it has no more packets to send
+ */
+static void vnic_xdp_tx(struct net_device *dev, struct sk_buff *skb) {
+    struct net_device *sender = dev;
+    struct net_device *dest_dev;
+    struct iphdr *iph;
+
+    if (vnic_is_netsim_rx(dev)) {
+        sender = READ_ONCE(netsim_txdevs[vnic_netsim_shard(dev)]);
+    }
+    if (!sender || !pskb_may_pull(skb, ETH_HLEN + sizeof(struct iphdr))) {
+        vnic_drop(dev, skb, VNIC_DROP_XDP);
+        return;
+    }
+
+    skb_reset_mac_header(skb);
+    iph = (struct iphdr *)(skb->data + ETH_HLEN);
+    dest_dev = find_dest_dev(skb, iph, sender);
+    if (!dest_dev) {
+        vnic_drop(dev, skb, VNIC_DROP_NO_DEST);
+        return;
+    }
+    vnic_count(dev, VNIC_XDP_TX);
+    skb->dev = sender;
+    vnic_rx(dest_dev, skb);
+}
+
+/**
+ * Makes a packet fit to be given to an XDP program: linear, owned only by the caller, in a
+ * buffer which can become an XDP frame, with XDP_PACKET_HEADROOM in front of it and its
+ * checksum filled in. Packets which are not are copied onto a page of the page cache.
+ * Returns the packet to use, or NULL if it was dropped
+ */
+static struct sk_buff *vnic_xdp_prepare_skb(struct net_device *dev, struct sk_buff *skb) {
+    struct sk_buff *nskb;
+
+    skb_orphan(skb);
+    if (skb_shared(skb) || skb_head_is_locked(skb) || skb_is_nonlinear(skb) ||
+        skb_headroom(skb) < XDP_PACKET_HEADROOM) {
+        if (skb->len > VNIC_XDP_MAX_LEN) {
+            vnic_drop(dev, skb, VNIC_DROP_XDP);
+            return NULL;
+        }
+        // vnic_alloc_skb only gives a packet without the headroom if no page could be
+        // had for the cache
+        nskb = vnic_alloc_skb(dev, skb->len);
+        if (nskb && skb_headroom(nskb) < XDP_PACKET_HEADROOM) {
+            kfree_skb(nskb);
+            nskb = NULL;
+        }
+        if (!nskb) {
+            vnic_drop(dev, skb, VNIC_DROP_NO_MEM);
+            return NULL;
+        }
+        skb_put(nskb, skb->len);
+        // Cannot fail, as skb is at least as long as nskb
+        skb_copy_bits(skb, 0, nskb->data, skb->len);
+        skb_copy_header(nskb, skb);
+        skb_headers_offset_update(nskb, skb_headroom(nskb) - skb_headroom(skb));
+        consume_skb(skb);
+        skb = nskb;
+    }
+
+    // Frames carry no checksum offload, so the program must see the finished packet
+    if (skb->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(skb)) {
+        vnic_drop(dev, skb, VNIC_DROP_XDP);
+        return NULL;
+    }
+    return skb;
+}
+
+/**
+ * Runs prog on a single packet sent to the device by the stack or the network simulator,
+ * then receives, drops, sends back out or redirects it
+ */
+static void vnic_xdp_rcv_one(struct vnic_queue *queue, struct bpf_prog *prog, struct sk_buff *skb) {
+    struct net_device *dev = queue->dev;
+    void *orig_data, *orig_data_end;
+    struct xdp_buff xdp;
+    u32 act;
+    int off;
+
+    skb = vnic_xdp_prepare_skb(dev, skb);
+    if (!skb) {
+        return;
+    }
+
+    xdp.data_hard_start = skb->head;
+    xdp.data = skb->data;
+    xdp.data_end = xdp.data + skb->len;
+    xdp.data_meta = xdp.data;
+    xdp.rxq = &queue->xdp_rxq;
+    // The head of an skb always has tailroom for skb_shared_info
+    xdp.frame_sz = (void *)skb_end_pointer(skb) - xdp.data_hard_start +
+                   SKB_DATA_ALIGN(sizeof(struct skb_shared_info));
+    orig_data = xdp.data;
+    orig_data_end = xdp.data_end;
+
+    act = bpf_prog_run_xdp(prog, &xdp);
+    switch (act) {
+    case XDP_PASS:
+    case XDP_TX:
+        break;
+    case XDP_REDIRECT:
+        // The page becomes the buffer of a frame, which outlives the skb
+        get_page(virt_to_page(xdp.data));
+        consume_skb(skb);
+        if (xdp_do_redirect(dev, &xdp, prog)) {
+            page_frag_free(xdp.data);
+            vnic_count_drops(dev, VNIC_DROP_XDP, 1);
+            return;
+        }
+        vnic_count(dev, VNIC_XDP_REDIRECT);
+        return;
+    default:
+        bpf_warn_invalid_xdp_action(act);
+        fallthrough;
+    case XDP_ABORTED:
+        trace_xdp_exception(dev, prog, act);
+        fallthrough;
+    case XDP_DROP:
+        vnic_drop(dev, skb, VNIC_DROP_XDP);
+        return;
+    }
+
+    // The program may have moved the start or the end of the packet
+    off = orig_data - xdp.data;
+    if (off > 0) {
+        __skb_push(skb, off);
+    } else if (off < 0) {
+        __skb_pull(skb, -off);
+    }
+    off = xdp.data_end - orig_data_end;
+    if (off > 0) {
+        __skb_put(skb, off);
+    } else if (off < 0) {
+        __skb_trim(skb, skb->len + off);
+    }
+    if (xdp.data_meta != xdp.data) {
+        skb_metadata_set(skb, xdp.data - xdp.data_meta);
+    }
+
+    if (act == XDP_TX) {
+        vnic_xdp_tx(dev, skb);
+    } else {
+        vnic_receive_skb(queue, skb);
+    }
+}
+
+/**
+ * Runs prog on a packet sent to the device by the stack or the network simulator.
+ * Programs see single frames, so GSO packets are segmented first
+ */
+static void vnic_xdp_rcv_skb(struct vnic_queue *queue, struct bpf_prog *prog, struct sk_buff *skb) {
+    struct sk_buff *segs, *next;
+
+    if (!skb_is_gso(skb)) {
+        vnic_xdp_rcv_one(queue, prog, skb);
+        return;
+    }
+
+    segs = skb_gso_segment(skb, 0);
+    if (IS_ERR_OR_NULL(segs)) {
+        vnic_drop(queue->dev, skb, VNIC_DROP_NO_MEM);
+        return;
+    }
+    consume_skb(skb);
+
+    skb_list_walk_safe(segs, skb, next) {
+        skb_mark_not_on_list(skb);
+        vnic_xdp_rcv_one(queue, prog, skb);
+    }
+}
+
+/**
+ * Receives a frame sent to the device through ndo_xdp_xmit, running prog on it first if
+ * the device has one. Frames which are received, or sent back out, are built into skbs
+ * around their buffers
+ */
+static void vnic_xdp_rcv_frame(struct vnic_queue *queue, struct bpf_prog *prog,
+                               struct xdp_frame *frame) {
+    struct net_device *dev = queue->dev;
+    struct xdp_frame orig_frame;
+    struct xdp_rxq_info rxq;
+    struct sk_buff *skb;
+    struct xdp_buff xdp;
+    u32 act = XDP_PASS;
+
+    xdp_convert_frame_to_buff(frame, &xdp);
+    if (prog) {
+        // Frames keep the memory model of the driver which built them
+        rxq = queue->xdp_rxq;
+        rxq.mem = frame->mem;
+        xdp.rxq = &rxq;
+
+        act = bpf_prog_run_xdp(prog, &xdp);
+        switch (act) {
+        case XDP_PASS:
+        case XDP_TX:
+            break;
+        case XDP_REDIRECT:
+            // Redirecting writes a new frame over this one, which may be needed to free it
+            orig_frame = *frame;
+            if (xdp_do_redirect(dev, &xdp, prog)) {
+                xdp_return_frame(&orig_frame);
+                vnic_count_drops(dev, VNIC_DROP_XDP, 1);
+                return;
+            }
+            vnic_count(dev, VNIC_XDP_REDIRECT);
+            return;
+        default:
+            bpf_warn_invalid_xdp_action(act);
+            fallthrough;
+        case XDP_ABORTED:
+            trace_xdp_exception(dev, prog, act);
+            fallthrough;
+        case XDP_DROP:
+            xdp_return_frame(frame);
+            vnic_count_drops(dev, VNIC_DROP_XDP, 1);
+            return;
+        }
+    }
+
+    skb = build_skb(xdp.data_hard_start, xdp.frame_sz);
+    if (!skb) {
+        xdp_return_frame(frame);
+        vnic_count_drops(dev, VNIC_DROP_NO_MEM, 1);
+        return;
+    }
+    skb_reserve(skb, xdp.data - xdp.data_hard_start);
+    skb_put(skb, xdp.data_end - xdp.data);
+    if (xdp.data_meta != xdp.data) {
+        skb_metadata_set(skb, xdp.data - xdp.data_meta);
+    }
+    skb->dev = dev;
+    // The buffer now belongs to the skb, and the frame in its headroom is no longer needed
+    xdp_release_frame(frame);
+    xdp_scrub_frame(frame);
+
+    if (act == XDP_TX) {
+        vnic_xdp_tx(dev, skb);
+    } else {
+        vnic_receive_skb(queue, skb);
+    }
+}
+
+/**
+ * NAPI poll method. Receives up to budget packets from the receive ring of one queue,
+ * passing them through the XDP program of the device if it has one, then to the stack
+ * through GRO.
+ * Returns the number of packets received.
+ */
+int vnic_poll(struct napi_struct *napi, int budget) {
+    struct vnic_queue *queue = container_of(napi, struct vnic_queue, napi);
+    struct vnic_priv *priv = netdev_priv(queue->dev);
+    struct bpf_prog *prog;
+    void *ptr;
+    int done = 0;
+
+    rcu_read_lock();
+    prog = rcu_dereference(priv->xdp_prog);
+
+    // NAPI guarantees a single consumer, so the ring can be read without its lock
+    while (done < budget && (ptr = __ptr_ring_consume(&queue->rx_ring))) {
+        if (vnic_is_xdp_frame(ptr)) {
+            vnic_xdp_rcv_frame(queue, prog, vnic_ptr_to_xdp(ptr));
+        } else if (prog) {
+            vnic_xdp_rcv_skb(queue, prog, ptr);
+        } else {
+            vnic_receive_skb(queue, ptr);
+        }
+        done++;
+    }
+
+    if (prog) {
+        // Send on the frames redirected by the program, and the packets it sent back out
+        xdp_do_flush();
+        vnic_batch_flush();
+    }
+    rcu_read_unlock();
+
+    if (done) {
+        vnic_tx_wake(&queue->tx_waiters);
+    }
+
+    if (done < budget && napi_complete_done(napi, done)) {
+        // A packet may have been queued after the ring was found empty, but before
+        // NAPI was completed. In that case vnic_rx could not schedule NAPI, so do it here
+        if (unlikely(!__ptr_ring_empty(&queue->rx_ring))) {
+            napi_schedule(napi);
+        }
+    }
+    return done;
+}
+
+/**
+ * ===============================================================
+ *                       Netlink interface
+ * ===============================================================
+ */
+
+/**
+ * Registers a vnic, then maps its IP address to it and gives it its role for the network
+ * simulator. Used for vnics created on module load and through netlink. Addresses another
+ * vnic has are refused, rather than taken from it.
+ * Must be called with RTNL held. If registering fails the device is not freed. If its
+ * address cannot be mapped once it is registered, it is unregistered again, and freed
+ * once RTNL is released.
+ * Returns 0 on success, -EADDRINUSE if another vnic has the address, -ENOSPC if the lookup
+ * table has no room for it, or a negative error from register_netdevice
+ */
+static int vnic_register(struct net_device *dev, u8 role, u8 shard) {
+    struct vnic_priv *priv = netdev_priv(dev);
+    struct net_device *owner = NULL;
+    int result;
+
+    if (role != VNIC_NETSIM_NONE && shard >= netsim_shards) {
+        return -ERANGE;
+    }
+    if ((role == VNIC_NETSIM_RX && netsim_rxdevs[shard]) ||
+        (role == VNIC_NETSIM_TX && netsim_txdevs[shard])) {
+        return -EBUSY;
+    }
+    if (priv->ip_addr) {
+        rcu_read_lock();
+        owner = get_dev_from_hash_table(priv->ip_addr);
+        rcu_read_unlock();
+    }
+    if (owner) {
+        return -EADDRINUSE;
+    }
+
+    if ((result = register_netdevice(dev))) {
+        return result;
+    }
+
+    if (priv->ip_addr && !add_dev_to_hash_table(priv->ip_addr, dev)) {
+        printk(KERN_WARNING "vnic: %s: no room for %pI4h in the lookup table\n",
+               dev->name, &priv->ip_addr);
+        unregister_netdevice(dev);
+        return -ENOSPC;
+    }
+    priv->netsim_role = role;
+    priv->netsim_shard = shard;
+    if (role == VNIC_NETSIM_RX) {
+        WRITE_ONCE(netsim_rxdevs[shard], dev);
+    } else if (role == VNIC_NETSIM_TX) {
+        WRITE_ONCE(netsim_txdevs[shard], dev);
+    }
+    return 0;
+}
+
+static const struct nla_policy vnic_policy[IFLA_VNIC_MAX + 1] = {
+    [IFLA_VNIC_IP] = { .type = NLA_U32 },
+    [IFLA_VNIC_MAC] = { .type = NLA_BINARY, .len = ETH_ALEN },
+    [IFLA_VNIC_NETSIM] = { .type = NLA_U8 },
+    [IFLA_VNIC_NETSIM_SHARD] = { .type = NLA_U8 },
+};
+
+static int vnic_validate(struct nlattr *tb[], struct nlattr *data[],
+                         struct netlink_ext_ack *extack) {
+    if (tb[IFLA_ADDRESS]) {
+        if (nla_len(tb[IFLA_ADDRESS]) != ETH_ALEN || !is_valid_ether_addr(nla_data(tb[IFLA_ADDRESS]))) {
+            NL_SET_ERR_MSG_ATTR(extack, tb[IFLA_ADDRESS], "Invalid MAC address");
+            return -EADDRNOTAVAIL;
+        }
+    }
+    if (!data) {
+        return 0;
+    }
+    if (data[IFLA_VNIC_MAC]) {
+        if (nla_len(data[IFLA_VNIC_MAC]) != ETH_ALEN || !is_valid_ether_addr(nla_data(data[IFLA_VNIC_MAC]))) {
+            NL_SET_ERR_MSG_ATTR(extack, data[IFLA_VNIC_MAC], "Invalid MAC address");
+            return -EADDRNOTAVAIL;
+        }
+    }
+    if (data[IFLA_VNIC_NETSIM] && nla_get_u8(data[IFLA_VNIC_NETSIM]) > VNIC_NETSIM_TX) {
+        NL_SET_ERR_MSG_ATTR(extack, data[IFLA_VNIC_NETSIM], "Unknown network simulator role");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Creates a vnic for `ip link add type vnic`. rtnetlink has already allocated it, with
+ * vnic_init as its setup function, and applied generic attributes such as IFLA_ADDRESS
+ */
+static int vnic_newlink(struct net *src_net, struct net_device *dev, struct nlattr *tb[],
+                        struct nlattr *data[], struct netlink_ext_ack *extack) {
+    struct vnic_priv *priv = netdev_priv(dev);
+    u8 role = VNIC_NETSIM_NONE;
+    u8 shard = 0;
+    int result;
+
+    if (data && data[IFLA_VNIC_MAC]) {
+        memcpy(dev->dev_addr, nla_data(data[IFLA_VNIC_MAC]), ETH_ALEN);
+    } else if (!tb[IFLA_ADDRESS]) {
+        eth_hw_addr_random(dev);
+    }
+    if (data && data[IFLA_VNIC_IP]) {
+        priv->ip_addr = ntohl(nla_get_in_addr(data[IFLA_VNIC_IP]));
+    }
+    if (data && data[IFLA_VNIC_NETSIM]) {
+        role = nla_get_u8(data[IFLA_VNIC_NETSIM]);
+    }
+    if (data && data[IFLA_VNIC_NETSIM_SHARD]) {
+        shard = nla_get_u8(data[IFLA_VNIC_NETSIM_SHARD]);
+    }
+
+    result = vnic_register(dev, role, shard);
+    if (result == -EBUSY) {
+        NL_SET_ERR_MSG(extack, "Another vnic already has this network simulator role");
+    } else if (result == -ERANGE) {
+        NL_SET_ERR_MSG(extack, "No such network simulator shard, see the netsim_shards parameter");
+    } else if (result == -EADDRINUSE) {
+        NL_SET_ERR_MSG_ATTR(extack, data[IFLA_VNIC_IP], "Another vnic already has this IP address");
+    } else if (result == -ENOSPC) {
+        NL_SET_ERR_MSG(extack, "No room for the IP address in the lookup table");
+    }
+    return result;
+}
+
+/**
+ * Changes the IP address of a vnic, for `ip link set vnicN type vnic ip <ip_addr>`.
+ * Addresses another vnic has are refused, rather than taken from it
+ */
+static int vnic_changelink(struct net_device *dev, struct nlattr *tb[], struct nlattr *data[],
+                           struct netlink_ext_ack *extack) {
+    struct vnic_priv *priv = netdev_priv(dev);
+    u32 ip_addr;
+
+    if (data && (data[IFLA_VNIC_MAC] || data[IFLA_VNIC_NETSIM] || data[IFLA_VNIC_NETSIM_SHARD])) {
+        NL_SET_ERR_MSG(extack, "Only the IP address of a vnic can be changed");
+        return -EOPNOTSUPP;
+    }
+    if (!data || !data[IFLA_VNIC_IP]) {
+        return 0;
+    }
+
+    ip_addr = ntohl(nla_get_in_addr(data[IFLA_VNIC_IP]));
+    if (ip_addr) {
+        struct net_device *owner;
+
+        rcu_read_lock();
+        owner = get_dev_from_hash_table(ip_addr);
+        rcu_read_unlock();
+        if (owner && owner != dev) {
+            NL_SET_ERR_MSG_ATTR(extack, data[IFLA_VNIC_IP], "Another vnic already has this IP address");
+            return -EADDRINUSE;
+        }
+    }
+    if (ip_addr && !add_dev_to_hash_table(ip_addr, dev)) {
+        return -ENOSPC;
+    }
+    if (priv->ip_addr && priv->ip_addr != ip_addr) {
+        struct net_device *old_dev;
+
+        // The old address may have been given to another vnic through debugfs since
+        rcu_read_lock();
+        old_dev = get_dev_from_hash_table(priv->ip_addr);
+        rcu_read_unlock();
+        if (old_dev == dev) {
+            remove_dev_from_hash_table(priv->ip_addr);
+        }
+    }
+    priv->ip_addr = ip_addr;
+    return 0;
+}
+
+static size_t vnic_get_size(const struct net_device *dev) {
+    return nla_total_size(sizeof(__be32)) + /* IFLA_VNIC_IP */
+           nla_total_size(sizeof(u8)) +     /* IFLA_VNIC_NETSIM */
+           nla_total_size(sizeof(u8));      /* IFLA_VNIC_NETSIM_SHARD */
+}
+
+static int vnic_fill_info(struct sk_buff *skb, const struct net_device *dev) {
+    struct vnic_priv *priv = netdev_priv(dev);
+
+    if ((priv->ip_addr && nla_put_in_addr(skb, IFLA_VNIC_IP, htonl(priv->ip_addr))) ||
+        nla_put_u8(skb, IFLA_VNIC_NETSIM, priv->netsim_role) ||
+        (priv->netsim_role != VNIC_NETSIM_NONE &&
+         nla_put_u8(skb, IFLA_VNIC_NETSIM_SHARD, priv->netsim_shard))) {
+        return -EMSGSIZE;
+    }
+    return 0;
+}
+
+static unsigned int vnic_get_num_queues(void) {
+    return num_queues;
+}
+
+static struct rtnl_link_ops vnic_rtnl_link_ops = {
+    .kind = "vnic",
+    .priv_size = sizeof(struct vnic_priv),
+    .setup = vnic_init,
+    .maxtype = IFLA_VNIC_MAX,
+    .policy = vnic_policy,
+    .validate = vnic_validate,
+    .newlink = vnic_newlink,
+    .changelink = vnic_changelink,
+    .get_size = vnic_get_size,
+    .fill_info = vnic_fill_info,
+    .get_num_tx_queues = vnic_get_num_queues,
+    .get_num_rx_queues = vnic_get_num_queues,
+};
+
+static bool vnic_rtnl_registered;
+
+/**
+ * ===============================================================
+ *                        debugfs interface
+ * ===============================================================
+ */
+
+/**
+ * Directory for the debugfs files of the module, /sys/kernel/debug/vnic
+ */
+static struct dentry *vnic_debugfs_root;
+
+/**
+ * Finds the vnic with the given interface name, in any network namespace.
+ * Must be called with RTNL held, which also keeps the vnic from being destroyed
+ * Returns NULL if there is no such vnic
+ */
+struct net_device *find_vnic_by_name(const char *name) {
+    struct vnic_priv *priv;
+
+    ASSERT_RTNL();
+    list_for_each_entry(priv, &vnic_list, list) {
+        if (strcmp(priv->dev->name, name) == 0) {
+            return priv->dev;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Returns the vnic registered after dev, the first vnic if dev is NULL, or NULL after
+ * the last one. Must be called with RTNL held
+ */
+struct net_device *vnic_next(struct net_device *dev) {
+    struct vnic_priv *priv;
+
+    ASSERT_RTNL();
+    if (!dev) {
+        priv = list_first_entry_or_null(&vnic_list, struct vnic_priv, list);
+    } else {
+        priv = netdev_priv(dev);
+        priv = list_is_last(&priv->list, &vnic_list) ? NULL : list_next_entry(priv, list);
+    }
+    return priv ? priv->dev : NULL;
+}
+
+/**
+ * Lists each IP address in the lookup table with the name of its device
+ */
+static int ip_table_show(struct seq_file *m, void *v) {
+    struct vnic_ip_table *table;
+    struct net_device *device;
+    u32 ip_addr;
+    int i;
+
+    rcu_read_lock();
+    table = rcu_dereference(ip_addr_lookup_table);
+    seq_printf(m, "# %d entries, %d slots\n", table->count, table->len);
+    for (i = 0; i < table->len; i++) {
+        device = vnic_ip_table_entry(table, i, &ip_addr);
+        if (device) {
+            seq_printf(m, "%pI4h %s\n", &ip_addr, device->name);
+        }
+    }
+    rcu_read_unlock();
+    return 0;
+}
+
+static int ip_table_open(struct inode *inode, struct file *file) {
+    return single_open(file, ip_table_show, NULL);
+}
+
+/**
+ * Changes the lookup table while traffic is flowing. Accepts one command per write:
+ *     add <ip_addr> <vnic name>   maps ip_addr to the vnic, replacing any existing mapping
+ *     del <ip_addr>               removes the mapping for ip_addr
+ */
+static ssize_t ip_table_write(struct file *file, const char __user *user_buf,
+                              size_t count, loff_t *ppos) {
+    char buf[64];
+    char cmd[8], ip_str[16], name[IFNAMSIZ];
+    struct net_device *dev;
+    u32 ip_addr;
+    int fields;
+
+    if (count >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    if (copy_from_user(buf, user_buf, count)) {
+        return -EFAULT;
+    }
+    buf[count] = '\0';
+
+    fields = sscanf(buf, "%7s %15s %15s", cmd, ip_str, name);
+    if (fields < 2 || vnic_parse_ip(ip_str, strlen(ip_str), &ip_addr)) {
+        return -EINVAL;
+    }
+
+    if (strcmp(cmd, "add") == 0 && fields == 3) {
+        int added;
+
+        rtnl_lock();
+        dev = find_vnic_by_name(name);
+        added = dev ? add_dev_to_hash_table(ip_addr, dev) : 0;
+        rtnl_unlock();
+        if (!dev) {
+            return -ENODEV;
+        }
+        if (!added) {
+            return -ENOSPC;
+        }
+    } else if (strcmp(cmd, "del") == 0 && fields == 2) {
+        if (!remove_dev_from_hash_table(ip_addr)) {
+            return -ENOENT;
+        }
+    } else {
+        return -EINVAL;
+    }
+    return count;
+}
+
+static const struct file_operations ip_table_fops = {
+    .owner = THIS_MODULE,
+    .open = ip_table_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+    .write = ip_table_write,
+};
+
+/**
+ * Lists the routes as <prefix>/<len> <next hop>, shortest first
+ */
+static int routes_show(struct seq_file *m, void *v) {
+    struct vnic_lpm *lpm;
+    struct net_device *device;
+    int i;
+
+    rcu_read_lock();
+    lpm = rcu_dereference(vnic_routes);
+    if (lpm) {
+        seq_printf(m, "# %d routes, %d nodes\n", lpm->route_count, lpm->node_count);
+        for (i = 0; i < lpm->route_count; i++) {
+            device = lpm->routes[i].value;
+            seq_printf(m, "%pI4h/%d %s\n", &lpm->routes[i].prefix, lpm->routes[i].prefix_len,
+                       device->name);
+        }
+    } else {
+        seq_puts(m, "# 0 routes\n");
+    }
+    rcu_read_unlock();
+    return 0;
+}
+
+static int routes_open(struct inode *inode, struct file *file) {
+    return single_open(file, routes_show, NULL);
+}
+
+/**
+ * Changes the forwarding table while traffic is flowing. Accepts one command per write:
+ *     add <prefix>/<len> <vnic name>   routes the prefix to the vnic, replacing any existing route
+ *     del <prefix>/<len>               removes the route for the prefix
+ */
+static ssize_t routes_write(struct file *file, const char __user *user_buf,
+                            size_t count, loff_t *ppos) {
+    char buf[64];
+    char cmd[8], prefix_str[20], name[IFNAMSIZ];
+    struct net_device *dev;
+    u32 prefix;
+    int prefix_len;
+    int fields;
+    int result;
+
+    if (count >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    if (copy_from_user(buf, user_buf, count)) {
+        return -EFAULT;
+    }
+    buf[count] = '\0';
+
+    fields = sscanf(buf, "%7s %19s %15s", cmd, prefix_str, name);
+    if (fields < 2 || vnic_parse_prefix(prefix_str, strlen(prefix_str), &prefix, &prefix_len)) {
+        return -EINVAL;
+    }
+
+    if (strcmp(cmd, "add") == 0 && fields == 3) {
+        // RTNL keeps dev from being destroyed before its route is added
+        rtnl_lock();
+        dev = find_vnic_by_name(name);
+        result = dev ? vnic_route_add(prefix, prefix_len, dev) : -ENODEV;
+        rtnl_unlock();
+    } else if (strcmp(cmd, "del") == 0 && fields == 2) {
+        result = vnic_route_del(prefix, prefix_len, NULL);
+    } else {
+        return -EINVAL;
+    }
+    return result ? result : count;
+}
+
+static const struct file_operations routes_fops = {
+    .owner = THIS_MODULE,
+    .open = routes_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+    .write = routes_write,
+};
+
+void vnic_debugfs_init(void) {
+    vnic_debugfs_root = debugfs_create_dir("vnic", NULL);
+    debugfs_create_file("ip_table", 0600, vnic_debugfs_root, NULL, &ip_table_fops);
+    debugfs_create_file("routes", 0600, vnic_debugfs_root, NULL, &routes_fops);
+    vnic_pool_debugfs_init(vnic_debugfs_root);
+    vnic_link_debugfs_init(vnic_debugfs_root);
+    vnic_capture_debugfs_init(vnic_debugfs_root);
+    vnic_latency_debugfs_init(vnic_debugfs_root);
+    vnic_flow_debugfs_init(vnic_debugfs_root);
+    vnic_pktgen_debugfs_init(vnic_debugfs_root);
+    vnic_fanout_debugfs_init(vnic_debugfs_root);
+}
+
+void vnic_debugfs_cleanup(void) {
+    debugfs_remove_recursive(vnic_debugfs_root);
+    vnic_debugfs_root = NULL;
+}
+
+int debug_init(struct net_device *dev) {
+    ether_setup(dev);
+
+    struct net_device_ops *ops = kmalloc(sizeof(struct net_device_ops), GFP_KERNEL);
+    ops->ndo_open = vnic_open;
+    ops->ndo_stop = vnic_release;
+    ops->ndo_start_xmit = vnic_xmit;
+
+    // dev->netdev_ops->ndo_open = vnic_open;
+    // dev->netdev_ops->ndo_stop = vnic_release;
+    return 0;
+}
+
+/**
+ * EXIT functions for unloading the module
+ */
+void cleanup_vnic_module(void) {
+    printk("vnic: Unloading module\n");
+
+    // Stop the lookup table being changed through debugfs while devices are destroyed
+    vnic_debugfs_cleanup();
+    vnic_pktgen_cleanup();
+    vnic_latency_cleanup();
+    vnic_netsim_cleanup();
+
+    // Destroys every vnic, in every network namespace, including those made on module load
+    if (vnic_rtnl_registered) {
+        rtnl_link_unregister(&vnic_rtnl_link_ops);
+        vnic_rtnl_registered = false;
+    }
+    vnic_link_cleanup();
+    vnic_flow_cleanup();
+    vnic_fanout_cleanup();
+    // Old lookup tables are freed by RCU callbacks in this module
+    rcu_barrier();
+    free_hash_table();
+    // Packets built from the page caches have been freed along with the devices
+    vnic_pool_cleanup();
+
+    // Create visible break in kernel output
+    printk("vnic: \n\n\n");
+}
+
+/**
+ * Configuration of a vnic created on module load, parsed from the module parameters
+ */
+struct vnic_param_config {
+    u32 ip_addr;
+    u8 mac[ETH_ALEN];
+};
+
+// Vnics created on module load are registered this many at a time, dropping RTNL in between
+#define VNIC_REGISTER_BATCH 256
+
+/**
+ * Returns the number of comma separated entries in list
+ */
+static int count_mappings(const char *list) {
+    int count = 1;
+
+    if (!*list) {
+        return 0;
+    }
+    while ((list = strchr(list, ',')) != NULL) {
+        count++;
+        list++;
+    }
+    return count;
+}
+
+/**
+ * Parses ip_mappings and mac_mappings into a table of count configurations, in one pass
+ * over each string. The table is freed by the caller with kvfree.
+ * Returns the table, or an ERR_PTR on failure
+ */
+static struct vnic_param_config *parse_param_vnics(int count) {
+    struct vnic_param_config *configs;
+    const char *ip = ip_mappings, *mac = mac_mappings;
+    const char *ip_end, *mac_end;
+    int i;
+
+    configs = kvmalloc_array(count, sizeof(struct vnic_param_config), GFP_KERNEL);
+    if (!configs) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    for (i = 0; i < count; i++) {
+        ip_end = strchrnul(ip, ',');
+        mac_end = strchrnul(mac, ',');
+        if (vnic_parse_ip(ip, ip_end - ip, &configs[i].ip_addr)) {
+            printk(KERN_ALERT "vnic: Invalid IP address %.*s\n", (int)(ip_end - ip), ip);
+            goto invalid;
+        }
+        if (vnic_parse_mac(mac, mac_end - mac, configs[i].mac)) {
+            printk(KERN_ALERT "vnic: Invalid MAC address %.*s\n", (int)(mac_end - mac), mac);
+            goto invalid;
+        }
+        ip = ip_end + 1;
+        mac = mac_end + 1;
+    }
+    return configs;
+
+invalid:
+    kvfree(configs);
+    return ERR_PTR(-EINVAL);
+}
+
+/**
+ * Creates the vnics given by the module parameters. The first two are the network simulator.
+ * Devices are allocated without RTNL, then registered in batches, so that other users of
+ * RTNL are not held up for the whole of a large topology. Vnic i is named vnici.
+ * Returns 0 on success, or a negative error. Vnics registered before an error are
+ * destroyed along with the link type
+ */
+static int create_param_vnics(const struct vnic_param_config *configs, int count) {
+    struct net_device **devs;
+    struct net_device *dev;
+    struct vnic_priv *priv;
+    char name[IFNAMSIZ];
+    int result = 0;
+    int i, registered;
+
+    devs = kvcalloc(count, sizeof(struct net_device *), GFP_KERNEL);
+    if (!devs) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < count; i++) {
+        // Naming the device outright saves register_netdevice searching for a free number
+        snprintf(name, sizeof(name), "vnic%d", i);
+        dev = alloc_netdev_mqs(sizeof(struct vnic_priv), name, NET_NAME_ENUM, vnic_init,
+                               num_queues, num_queues);
+        if (dev == NULL) {
+            printk(KERN_ALERT "vnic: Unable to allocate space for vnic %d\n", i);
+            result = -ENOMEM;
+            goto out;
+        }
+        // Lets them be listed and destroyed along with vnics created through netlink
+        dev->rtnl_link_ops = &vnic_rtnl_link_ops;
+
+        priv = netdev_priv(dev);
+        priv->ip_addr = configs[i].ip_addr;
+        memcpy(dev->dev_addr, configs[i].mac, ETH_ALEN);
+        devs[i] = dev;
+    }
+
+    for (registered = 0; registered < count && !result;) {
+        rtnl_lock();
+        for (i = registered; i < min(registered + VNIC_REGISTER_BATCH, count); i++) {
+            dev = devs[i];
+            // Taken by a vnic created through netlink while the module was loading
+            if (__dev_get_by_name(&init_net, dev->name)) {
+                strscpy(dev->name, "vnic%d", IFNAMSIZ);
+            }
+            // The first two vnics of each shard are its receiving and sending devices
+            if (i < 2 * netsim_shards) {
+                result = vnic_register(dev, i % 2 ? VNIC_NETSIM_TX : VNIC_NETSIM_RX, i / 2);
+            } else {
+                result = vnic_register(dev, VNIC_NETSIM_NONE, 0);
+            }
+            if (result) {
+                printk(KERN_ALERT "vnic: Error - failed to register device %d\n", i);
+                // A device which was registered is freed by unregister_netdevice
+                if (dev->reg_state != NETREG_UNINITIALIZED) {
+                    devs[i] = NULL;
+                }
+                break;
+            }
+            devs[i] = NULL;
+        }
+        rtnl_unlock();
+        registered = i;
+        cond_resched();
+    }
+
+out:
+    // Free the devices which were never registered
+    for (i = 0; i < count; i++) {
+        if (devs[i]) {
+            free_netdev(devs[i]);
+        }
+    }
+    kvfree(devs);
+    return result;
+}
+
+/**
+ * INIT function for loading the module into the kernel
+ */
+int setup_vnic_module(void) {
+    struct vnic_param_config *configs;
+    int vnic_count = count_mappings(ip_mappings);
+    u64 start = ktime_get_ns();
+    int result;
+
+    if (netsim_shards < 1 || netsim_shards > VNIC_NETSIM_MAX_SHARDS) {
+        printk(KERN_ALERT "vnic: netsim_shards must be between 1 and %d\n", VNIC_NETSIM_MAX_SHARDS);
+        return -EINVAL;
+    }
+
+    if (vnic_count < 2 * netsim_shards) {
+        printk(KERN_ALERT "Number of devices must be >= 2 for each shard, since the network simulator requires a device for sending and receiving.\n");
+        return -EINVAL;
+    }
+
+    if (count_mappings(mac_mappings) != vnic_count) {
+        printk(KERN_ALERT "vnic: Number of MAC addresses should match number of IP Addresses");
+        return -EINVAL;
+    }
+
+    configs = parse_param_vnics(vnic_count);
+    if (IS_ERR(configs)) {
+        return PTR_ERR(configs);
+    }
+
+    if (num_queues <= 0) {
+        num_queues = num_online_cpus();
+    }
+
+    printk("vnic: Initialising module\n");
+    printk("vnic: Creating %d devices with %d queues\n", vnic_count, num_queues);
+
+    // Per-CPU page caches for packets built by the module
+    if ((result = vnic_pool_init())) {
+        goto out;
+    }
+    // Per-CPU timing wheels for emulated links
+    if ((result = vnic_link_init())) {
+        goto fail;
+    }
+    // Follows the addresses of the vnics, for broadcasts, before any are created
+    if ((result = vnic_fanout_init())) {
+        goto fail;
+    }
+    // Setup hashtable of ip addresses to net_devices, large enough for every vnic
+    if ((result = setup_hash_table(vnic_count))) {
+        goto fail;
+    }
+
+    // Register the link type before creating any vnics, so they can all be destroyed by
+    // unregistering it
+    if ((result = rtnl_link_register(&vnic_rtnl_link_ops))) {
+        goto fail;
+    }
+    vnic_rtnl_registered = true;
+
+    if ((result = create_param_vnics(configs, vnic_count))) {
+        goto fail;
+    }
+    printk("vnic: Created %d devices in %llu ms\n", vnic_count,
+           div_u64(ktime_get_ns() - start, NSEC_PER_MSEC));
+
+    vnic_debugfs_init();
+
+    if ((result = vnic_netsim_init())) {
+        printk(KERN_ALERT "vnic: Error - failed to register the network simulator device\n");
+        goto fail;
+    }
+    goto out;
+
+fail:
+    cleanup_vnic_module();
+out:
+    kvfree(configs);
+    return result;
+}
+
+module_init(setup_vnic_module);
+module_exit(cleanup_vnic_module);
+MODULE_ALIAS_RTNL_LINK("vnic");
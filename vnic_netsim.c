@@ -0,0 +1,662 @@
+/**
+ * Character device for the network simulator, /dev/vnic_netsim
+ *
+ * While the device is open, packets sent to the network simulator are copied into an
+ * mmap'd ring instead of being received by netsim_rxdev, and packets placed in the tx
+ * ring by the simulator are transmitted by netsim_txdev. This replaces a socket
+ * round trip per packet with one poll/ioctl per batch. See vnic_netsim.h for the layout.
+ *
+ * When the simulator is split into shards, each shard has its own rings, and the device
+ * can be opened once per shard. Each open takes the rings of the lowest shard which
+ * does not have them yet.
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#include <linux/uaccess.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/virtio_net.h>
+
+#include "vnic.h"
+#include "vnic_netsim.h"
+
+/**
+ * Command line arguments for loading the module
+ * netsim_ring_slots : int, the number of packets each ring can hold. Rounded up to a power of 2
+ * netsim_slot_size : int, the number of bytes of packet data each slot can hold
+ */
+static int netsim_ring_slots = 1024;
+static int netsim_slot_size = 2048;
+
+module_param(netsim_ring_slots, int, 0444);
+module_param(netsim_slot_size, int, 0444);
+
+// Packets are transmitted from the tx ring in chunks of this many, with bottom halves
+// disabled for each chunk
+#define NETSIM_TX_CHUNK 64
+// Longest packet accepted from the tx ring, a full GSO super-packet and its ethernet header
+#define NETSIM_TX_MAX_LEN (GSO_MAX_SIZE + ETH_HLEN)
+// Bytes of a long packet copied into the linear area of its skb, enough for its headers.
+// The rest goes in page fragments
+#define NETSIM_TX_LINEAR_LEN 128
+
+/**
+ * Kernel side state of the rings. The kernel keeps its own copy of the indices it
+ * writes, so that the simulator cannot corrupt them.
+ */
+struct vnic_netsim {
+    void *mem;
+    size_t size;
+    u32 slots;
+    u32 slot_size;
+
+    struct vnic_netsim_header *header;
+    struct vnic_netsim_desc *rx_desc;
+    struct vnic_netsim_desc *tx_desc;
+    u8 *rx_data;
+    u8 *tx_data;
+
+    u32 rx_producer;
+    spinlock_t rx_lock; /* Serialises producers of the rx ring, which may be on any CPU */
+    u32 tx_consumer;
+    struct mutex tx_mutex;
+    // Sends the rest of the tx ring once netsim_txdev is woken, after a destination was full
+    struct work_struct tx_work;
+
+    struct vnic_ring_waiters tx_waiters; /* Senders stopped until the rx ring has room */
+    wait_queue_head_t wait;
+    int shard;
+};
+
+/**
+ * The rings of each shard, or NULL if the device is not open for the shard
+ */
+static struct vnic_netsim __rcu *vnic_netsim_rings[VNIC_NETSIM_MAX_SHARDS];
+static DECLARE_BITMAP(vnic_netsim_open_shards, VNIC_NETSIM_MAX_SHARDS);
+
+/**
+ * Copies one packet into as many slots of the rx ring as it needs, with vnet describing
+ * its offloads. Called with the rx lock held.
+ * Returns false if the ring does not have room for the packet
+ */
+static bool vnic_netsim_rx_copy(struct vnic_netsim *netsim, struct sk_buff *skb,
+                                const struct virtio_net_hdr *vnet) {
+    u32 slots_needed = max_t(u32, DIV_ROUND_UP(skb->len, netsim->slot_size), 1);
+    u32 in_use = netsim->rx_producer - smp_load_acquire(&netsim->header->rx.consumer);
+    u64 tstamp = static_branch_unlikely(&vnic_latency_key) ? ktime_get_ns() : 0;
+    u32 offset = 0;
+    u32 i;
+
+    // in_use is only above slots if the simulator has corrupted its consumer index
+    if (in_use > netsim->slots || netsim->slots - in_use < slots_needed) {
+        return false;
+    }
+
+    for (i = 0; i < slots_needed; i++) {
+        u32 slot = (netsim->rx_producer + i) & (netsim->slots - 1);
+        struct vnic_netsim_desc *desc = &netsim->rx_desc[slot];
+        u32 len = min(skb->len - offset, netsim->slot_size);
+
+        desc->len = len;
+        desc->flags = i + 1 < slots_needed ? VNIC_NETSIM_DESC_MORE : 0;
+        if (i == 0) {
+            desc->vnet = *vnet;
+            desc->tstamp = tstamp;
+        } else {
+            memset(&desc->vnet, 0, sizeof(desc->vnet));
+            desc->tstamp = 0;
+        }
+        skb_copy_bits(skb, offset, netsim->rx_data + (size_t)slot * netsim->slot_size, len);
+        offset += len;
+    }
+
+    // Publish the slots to the simulator after their contents
+    netsim->rx_producer += slots_needed;
+    smp_store_release(&netsim->header->rx.producer, netsim->rx_producer);
+    return true;
+}
+
+/**
+ * Copies a packet into the rx ring, or drops it if the ring is full.
+ * Returns NET_RX_SUCCESS or NET_RX_DROP
+ */
+static int vnic_netsim_rx_one(struct vnic_netsim *netsim, struct net_device *dev,
+                              struct sk_buff *skb, const struct virtio_net_hdr *vnet) {
+    bool copied;
+
+    if (skb->len > (u64)netsim->slots * netsim->slot_size) {
+        vnic_drop(dev, skb, VNIC_DROP_RX_FULL);
+        return NET_RX_DROP;
+    }
+
+    spin_lock(&netsim->rx_lock);
+    copied = vnic_netsim_rx_copy(netsim, skb, vnet);
+    if (!copied) {
+        netsim->header->rx_dropped++;
+    }
+    spin_unlock(&netsim->rx_lock);
+
+    if (!copied) {
+        vnic_drop(dev, skb, VNIC_DROP_RX_FULL);
+        return NET_RX_DROP;
+    }
+    if (static_branch_unlikely(&vnic_latency_key)) {
+        vnic_latency_deliver(skb, dev);
+    }
+    dev_consume_skb_any(skb);
+    return NET_RX_SUCCESS;
+}
+
+/**
+ * Segments a GSO packet whose offloads cannot be described by a virtio_net_hdr, such as
+ * a tunnelled or SCTP packet, and copies the segments into the rx ring.
+ * Returns NET_RX_SUCCESS if every segment was copied, NET_RX_DROP otherwise
+ */
+static int vnic_netsim_rx_segment(struct vnic_netsim *netsim, struct net_device *dev,
+                                  struct sk_buff *skb) {
+    struct virtio_net_hdr vnet = {};
+    struct sk_buff *segs, *seg, *next;
+    int result = NET_RX_SUCCESS;
+
+    // No features, so the segments also have their checksums filled in
+    segs = skb_gso_segment(skb, 0);
+    if (IS_ERR_OR_NULL(segs)) {
+        vnic_drop(dev, skb, VNIC_DROP_NO_MEM);
+        return NET_RX_DROP;
+    }
+    consume_skb(skb);
+
+    skb_list_walk_safe(segs, seg, next) {
+        skb_mark_not_on_list(seg);
+        if (vnic_netsim_rx_one(netsim, dev, seg, &vnet) != NET_RX_SUCCESS) {
+            result = NET_RX_DROP;
+        }
+    }
+    return result;
+}
+
+/**
+ * Finds whether the rx ring of the shard of dev, a netsim_rxdev, has room for a packet
+ * of len bytes, so that senders can wait
+ * for the simulator to make room instead of their packets being dropped.
+ * Must be called under rcu_read_lock_bh().
+ * Returns -ENODEV if the device is not open, 1 if the ring is full, in which case
+ * ring_waiters is set to the senders waiting on it, or 0 otherwise
+ */
+int vnic_netsim_rx_busy(struct net_device *dev, unsigned int len,
+                        struct vnic_ring_waiters **ring_waiters) {
+    struct vnic_netsim *netsim = rcu_dereference_bh(vnic_netsim_rings[vnic_netsim_shard(dev)]);
+    u32 slots_needed;
+    u32 in_use;
+
+    if (!netsim) {
+        return -ENODEV;
+    }
+    // Packets which could never fit, and a corrupted consumer index, end in drops instead
+    if (len > (u64)netsim->slots * netsim->slot_size) {
+        return 0;
+    }
+    slots_needed = max_t(u32, DIV_ROUND_UP(len, netsim->slot_size), 1);
+    in_use = READ_ONCE(netsim->rx_producer) - smp_load_acquire(&netsim->header->rx.consumer);
+    if (in_use > netsim->slots || netsim->slots - in_use >= slots_needed) {
+        return 0;
+    }
+    *ring_waiters = &netsim->tx_waiters;
+    return 1;
+}
+
+/**
+ * Wakes senders waiting for room in the rx ring, once the simulator has emptied at least
+ * half of it. Called whenever the simulator enters the kernel, since it consumes from
+ * the ring without doing so
+ */
+static void vnic_netsim_rx_wake(struct vnic_netsim *netsim) {
+    u32 in_use = READ_ONCE(netsim->rx_producer) - smp_load_acquire(&netsim->header->rx.consumer);
+
+    if (in_use <= netsim->slots / 2) {
+        local_bh_disable();
+        vnic_tx_wake(&netsim->tx_waiters);
+        local_bh_enable();
+    }
+}
+
+/**
+ * Copies a packet sent to the network simulator into the rx ring, and wakes the simulator.
+ * Checksum and segmentation offloads are passed on in the virtio_net_hdr of the packet.
+ * dev is the netsim_rxdev of a shard. Must be called with bottom halves disabled.
+ * Returns -ENODEV if the device is not open, in which case the packet is untouched and
+ * should be received by netsim_rxdev as usual. Otherwise the packet is consumed, and
+ * NET_RX_SUCCESS or NET_RX_DROP is returned.
+ */
+int vnic_netsim_rx(struct net_device *dev, struct sk_buff *skb) {
+    struct vnic_netsim *netsim = rcu_dereference_bh(vnic_netsim_rings[vnic_netsim_shard(dev)]);
+    struct virtio_net_hdr vnet;
+    int result;
+
+    if (!netsim) {
+        return -ENODEV;
+    }
+
+    if (virtio_net_hdr_from_skb(skb, &vnet, true, true, 0)) {
+        result = vnic_netsim_rx_segment(netsim, dev, skb);
+    } else {
+        result = vnic_netsim_rx_one(netsim, dev, skb, &vnet);
+    }
+
+    if (wq_has_sleeper(&netsim->wait)) {
+        wake_up_interruptible(&netsim->wait);
+    }
+    return result;
+}
+
+/**
+ * Allocates an skb for dev, netsim_txdev, holding len bytes. Packets which fit in a page
+ * come from the page cache, longer ones are built from page fragments.
+ * Returns NULL if memory runs out
+ */
+static struct sk_buff *vnic_netsim_alloc_skb(struct net_device *dev, u32 len) {
+    struct sk_buff *skb;
+    int err;
+
+    if (len <= VNIC_POOL_MAX_LEN) {
+        skb = vnic_alloc_skb(dev, len);
+        if (skb) {
+            skb_put(skb, len);
+        }
+        return skb;
+    }
+
+    skb = alloc_skb_with_frags(VNIC_POOL_HEADROOM + NETSIM_TX_LINEAR_LEN,
+                               len - NETSIM_TX_LINEAR_LEN, PAGE_ALLOC_COSTLY_ORDER,
+                               &err, GFP_ATOMIC);
+    if (!skb) {
+        return NULL;
+    }
+    skb_reserve(skb, VNIC_POOL_HEADROOM);
+    skb_put(skb, NETSIM_TX_LINEAR_LEN);
+    skb->data_len = len - NETSIM_TX_LINEAR_LEN;
+    skb->len += skb->data_len;
+    skb->dev = dev;
+    return skb;
+}
+
+/**
+ * Builds an skb for dev, netsim_txdev, from the packet starting at index pos of the tx ring,
+ * where available slots have been produced. The number of slots the packet takes up is
+ * stored in used, which is 0 if the simulator has not produced all of them yet.
+ * Returns NULL if the slots do not hold a valid packet, or memory runs out
+ */
+static struct sk_buff *vnic_netsim_build_skb(struct vnic_netsim *netsim, struct net_device *dev,
+                                             u32 pos, u32 available, u32 *used) {
+    struct vnic_netsim_desc *first = &netsim->tx_desc[pos & (netsim->slots - 1)];
+    struct virtio_net_hdr vnet;
+    struct sk_buff *skb;
+    bool valid = true;
+    u32 offset = 0;
+    u32 len = 0;
+    u32 flags;
+    u32 i;
+
+    // Find the length of the packet, and check that every slot but the last is full
+    i = 0;
+    do {
+        struct vnic_netsim_desc *desc;
+        u32 slot_len;
+
+        if (i == available) {
+            *used = 0;
+            return NULL;
+        }
+        desc = &netsim->tx_desc[(pos + i) & (netsim->slots - 1)];
+        flags = READ_ONCE(desc->flags);
+        slot_len = READ_ONCE(desc->len);
+        if (slot_len > netsim->slot_size ||
+            ((flags & VNIC_NETSIM_DESC_MORE) && slot_len != netsim->slot_size)) {
+            valid = false;
+        }
+        len += slot_len;
+        i++;
+    } while (flags & VNIC_NETSIM_DESC_MORE);
+    *used = i;
+
+    if (!valid || len < ETH_HLEN || len > NETSIM_TX_MAX_LEN) {
+        netsim->header->tx_invalid++;
+        return NULL;
+    }
+
+    skb = vnic_netsim_alloc_skb(dev, len);
+    if (!skb) {
+        return NULL;
+    }
+    for (i = 0; i < *used; i++) {
+        u32 slot = (pos + i) & (netsim->slots - 1);
+        u32 slot_len = min(len - offset, netsim->slot_size);
+
+        skb_store_bits(skb, offset, netsim->tx_data + (size_t)slot * netsim->slot_size, slot_len);
+        offset += slot_len;
+    }
+    skb_reset_mac_header(skb);
+    skb_set_network_header(skb, ETH_HLEN);
+    skb->protocol = eth_hdr(skb)->h_proto;
+
+    memcpy(&vnet, &first->vnet, sizeof(vnet));
+    if (virtio_net_hdr_to_skb(skb, &vnet, true)) {
+        netsim->header->tx_invalid++;
+        kfree_skb(skb);
+        return NULL;
+    }
+    if (static_branch_unlikely(&vnic_latency_key) && READ_ONCE(first->tstamp)) {
+        vnic_latency_add(READ_ONCE(netsim_rxdevs[netsim->shard]), dev, VNIC_LATENCY_IN_NETSIM,
+                         READ_ONCE(first->tstamp));
+    }
+    return skb;
+}
+
+/**
+ * Transmits every complete packet the simulator has placed in the tx ring
+ * Returns the number of slots consumed, or a negative error
+ */
+static long vnic_netsim_tx(struct vnic_netsim *netsim) {
+    struct net_device *dev;
+    u32 producer;
+    u32 available;
+    u32 done = 0;
+
+    mutex_lock(&netsim->tx_mutex);
+    // netsim_txdev is not destroyed until a grace period after it is cleared
+    rcu_read_lock();
+    dev = READ_ONCE(netsim_txdevs[netsim->shard]);
+    if (!dev || !netif_running(dev)) {
+        rcu_read_unlock();
+        mutex_unlock(&netsim->tx_mutex);
+        return -ENETDOWN;
+    }
+
+    producer = smp_load_acquire(&netsim->header->tx.producer);
+    available = producer - netsim->tx_consumer;
+    if (available > netsim->slots) {
+        rcu_read_unlock();
+        mutex_unlock(&netsim->tx_mutex);
+        return -EINVAL;
+    }
+
+    while (done < available) {
+        struct sk_buff *skbs[NETSIM_TX_CHUNK];
+        u32 slots_used[NETSIM_TX_CHUNK];
+        u32 pos = done;
+        u32 count = 0;
+        bool incomplete = false;
+        int last = -1;
+        u32 i;
+
+        local_bh_disable();
+        while (count < NETSIM_TX_CHUNK && pos < available) {
+            skbs[count] = vnic_netsim_build_skb(netsim, dev, netsim->tx_consumer + pos,
+                                                available - pos, &slots_used[count]);
+            if (!slots_used[count]) {
+                // The simulator has not produced the rest of this packet yet
+                incomplete = true;
+                break;
+            }
+            if (skbs[count]) {
+                last = count;
+            }
+            pos += slots_used[count];
+            count++;
+        }
+
+        for (i = 0; i < count; i++) {
+            // The last packet of each chunk flushes anything batched behind it
+            if (skbs[i] && vnic_inject_xmit(dev, skbs[i], i != last) != NETDEV_TX_OK) {
+                // Leave this and later slots in the ring, to be retried on the next kick
+                break;
+            }
+            done += slots_used[i];
+        }
+        // Deliver anything held back by xmit_more if the chunk was cut short
+        vnic_batch_flush();
+        local_bh_enable();
+
+        if (i < count) {
+            for (; i < count; i++) {
+                kfree_skb(skbs[i]);
+            }
+            break;
+        }
+        if (incomplete) {
+            break;
+        }
+    }
+
+    rcu_read_unlock();
+
+    netsim->tx_consumer += done;
+    smp_store_release(&netsim->header->tx.consumer, netsim->tx_consumer);
+    mutex_unlock(&netsim->tx_mutex);
+    return done;
+}
+
+static void vnic_netsim_tx_work(struct work_struct *work) {
+    vnic_netsim_tx(container_of(work, struct vnic_netsim, tx_work));
+}
+
+/**
+ * Called once dev, the netsim_txdev of a shard, has been woken after a destination was
+ * full. Sends the packets left in the tx ring, since the simulator may be waiting for
+ * them to go rather than calling VNIC_NETSIM_IOC_TX again
+ */
+void vnic_netsim_tx_resume(struct net_device *dev) {
+    struct vnic_netsim *netsim;
+
+    rcu_read_lock();
+    netsim = rcu_dereference(vnic_netsim_rings[vnic_netsim_shard(dev)]);
+    if (netsim) {
+        schedule_work(&netsim->tx_work);
+    }
+    rcu_read_unlock();
+}
+
+static void vnic_netsim_fill_info(struct vnic_netsim *netsim, struct vnic_netsim_info *info) {
+    memset(info, 0, sizeof(*info));
+    info->version = VNIC_NETSIM_VERSION;
+    info->shard = netsim->shard;
+    info->slots = netsim->slots;
+    info->slot_size = netsim->slot_size;
+    info->mmap_size = netsim->size;
+    info->rx_desc_offset = (u8 *)netsim->rx_desc - (u8 *)netsim->mem;
+    info->tx_desc_offset = (u8 *)netsim->tx_desc - (u8 *)netsim->mem;
+    info->rx_data_offset = netsim->rx_data - (u8 *)netsim->mem;
+    info->tx_data_offset = netsim->tx_data - (u8 *)netsim->mem;
+}
+
+/**
+ * Allocates the rings. Each part of the mapping starts on its own page
+ */
+static struct vnic_netsim *vnic_netsim_alloc(void) {
+    struct vnic_netsim *netsim = kzalloc(sizeof(struct vnic_netsim), GFP_KERNEL);
+    size_t header_size, desc_size, data_size;
+
+    if (!netsim) {
+        return NULL;
+    }
+
+    netsim->slots = roundup_pow_of_two(max(netsim_ring_slots, 1));
+    netsim->slot_size = ALIGN(max(netsim_slot_size, ETH_FRAME_LEN), SMP_CACHE_BYTES);
+
+    header_size = PAGE_ALIGN(sizeof(struct vnic_netsim_header));
+    desc_size = PAGE_ALIGN(netsim->slots * sizeof(struct vnic_netsim_desc));
+    data_size = PAGE_ALIGN((size_t)netsim->slots * netsim->slot_size);
+    netsim->size = header_size + 2 * desc_size + 2 * data_size;
+
+    netsim->mem = vmalloc_user(netsim->size);
+    if (!netsim->mem) {
+        kfree(netsim);
+        return NULL;
+    }
+
+    netsim->header = netsim->mem;
+    netsim->rx_desc = netsim->mem + header_size;
+    netsim->tx_desc = netsim->mem + header_size + desc_size;
+    netsim->rx_data = netsim->mem + header_size + 2 * desc_size;
+    netsim->tx_data = netsim->mem + header_size + 2 * desc_size + data_size;
+
+    spin_lock_init(&netsim->rx_lock);
+    mutex_init(&netsim->tx_mutex);
+    INIT_WORK(&netsim->tx_work, vnic_netsim_tx_work);
+    vnic_ring_waiters_init(&netsim->tx_waiters);
+    init_waitqueue_head(&netsim->wait);
+    return netsim;
+}
+
+/**
+ * Only one simulator can have the device open at a time for each shard. Packets sent to
+ * the shard go to the rings from the moment it is opened.
+ */
+static int vnic_netsim_open(struct inode *inode, struct file *file) {
+    struct vnic_netsim *netsim;
+    int shard;
+
+    do {
+        shard = find_first_zero_bit(vnic_netsim_open_shards, vnic_netsim_shard_count());
+        if (shard >= vnic_netsim_shard_count()) {
+            return -EBUSY;
+        }
+    } while (test_and_set_bit(shard, vnic_netsim_open_shards));
+
+    netsim = vnic_netsim_alloc();
+    if (!netsim) {
+        clear_bit(shard, vnic_netsim_open_shards);
+        return -ENOMEM;
+    }
+    netsim->shard = shard;
+
+    file->private_data = netsim;
+    rcu_assign_pointer(vnic_netsim_rings[shard], netsim);
+    printk("vnic: network simulator shard %d attached to %s\n", shard, VNIC_NETSIM_DEV_NAME);
+    return 0;
+}
+
+/**
+ * Detaches the rings, so that packets go to netsim_rxdev again, then frees them once no
+ * CPU can still be copying into them
+ */
+static int vnic_netsim_release(struct inode *inode, struct file *file) {
+    struct vnic_netsim *netsim = file->private_data;
+
+    RCU_INIT_POINTER(vnic_netsim_rings[netsim->shard], NULL);
+    // The simulator sees every packet of the flows it handed back again
+    vnic_flow_clear_shard(netsim->shard);
+    synchronize_net();
+    // Nothing can queue the work or start waiting on the ring any more
+    cancel_work_sync(&netsim->tx_work);
+    // Senders stopped on the ring now drop to netsim_rxdev instead
+    local_bh_disable();
+    vnic_tx_wake(&netsim->tx_waiters);
+    local_bh_enable();
+    // Devices being opened or destroyed may still be looking at the ring to cancel a wait
+    synchronize_net();
+
+    printk("vnic: network simulator shard %d detached\n", netsim->shard);
+    clear_bit(netsim->shard, vnic_netsim_open_shards);
+    vfree(netsim->mem);
+    kfree(netsim);
+    return 0;
+}
+
+static int vnic_netsim_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct vnic_netsim *netsim = file->private_data;
+
+    if (vma->vm_end - vma->vm_start + (vma->vm_pgoff << PAGE_SHIFT) > netsim->size) {
+        return -EINVAL;
+    }
+    return remap_vmalloc_range(vma, netsim->mem, vma->vm_pgoff);
+}
+
+static __poll_t vnic_netsim_poll(struct file *file, poll_table *wait) {
+    struct vnic_netsim *netsim = file->private_data;
+    struct vnic_netsim_header *header = netsim->header;
+    __poll_t mask = 0;
+
+    poll_wait(file, &netsim->wait, wait);
+    vnic_netsim_rx_wake(netsim);
+
+    if (smp_load_acquire(&header->rx.producer) != READ_ONCE(header->rx.consumer)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (READ_ONCE(header->tx.producer) - smp_load_acquire(&header->tx.consumer) < netsim->slots) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    return mask;
+}
+
+static long vnic_netsim_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    struct vnic_netsim *netsim = file->private_data;
+    struct vnic_netsim_info info;
+    struct vnic_netsim_flow flow;
+
+    switch (cmd) {
+    case VNIC_NETSIM_IOC_INFO:
+        vnic_netsim_fill_info(netsim, &info);
+        if (copy_to_user((void __user *)arg, &info, sizeof(info))) {
+            return -EFAULT;
+        }
+        return 0;
+    case VNIC_NETSIM_IOC_TX:
+        vnic_netsim_rx_wake(netsim);
+        return vnic_netsim_tx(netsim);
+    case VNIC_NETSIM_IOC_FLOW_ADD:
+    case VNIC_NETSIM_IOC_FLOW_DEL:
+        if (copy_from_user(&flow, (void __user *)arg, sizeof(flow))) {
+            return -EFAULT;
+        }
+        return vnic_flow_ioctl(cmd, &flow, netsim->shard);
+    default:
+        return -ENOTTY;
+    }
+}
+
+static const struct file_operations vnic_netsim_fops = {
+    .owner = THIS_MODULE,
+    .open = vnic_netsim_open,
+    .release = vnic_netsim_release,
+    .mmap = vnic_netsim_mmap,
+    .poll = vnic_netsim_poll,
+    .unlocked_ioctl = vnic_netsim_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice vnic_netsim_miscdev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = VNIC_NETSIM_DEV_NAME,
+    .fops = &vnic_netsim_fops,
+    .mode = 0600,
+};
+
+static bool vnic_netsim_registered;
+
+int vnic_netsim_init(void) {
+    int result = misc_register(&vnic_netsim_miscdev);
+
+    vnic_netsim_registered = !result;
+    return result;
+}
+
+void vnic_netsim_cleanup(void) {
+    if (vnic_netsim_registered) {
+        misc_deregister(&vnic_netsim_miscdev);
+        vnic_netsim_registered = false;
+    }
+}
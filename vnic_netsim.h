@@ -0,0 +1,124 @@
+/**
+ * Shared memory interface of the network simulator character device, /dev/vnic_netsim
+ * This header is included by both the kernel module and the userspace simulator.
+ *
+ * The simulator mmaps the device to get two rings of fixed size packet slots:
+ *  - rx: packets sent to the network simulator. The kernel produces, the simulator consumes.
+ *  - tx: packets sent by the network simulator. The simulator produces, the kernel consumes.
+ * Producer and consumer indices run freely, and slot i of a ring is i & (slots - 1).
+ * Each side only writes its own index, and stores it with release semantics after
+ * writing (or reading) the slots it covers.
+ *
+ * The simulator consumes packets from the rx ring by advancing rx.consumer; poll()
+ * reports POLLIN while the rx ring is not empty. It sends packets by filling tx slots,
+ * advancing tx.producer, then calling the VNIC_NETSIM_IOC_TX ioctl once for the batch.
+ * If a destination is full, the ioctl consumes fewer slots than were produced, and the
+ * kernel sends the rest itself once the destination has room, advancing tx.consumer.
+ * Packets for the simulator wait while the rx ring is full, and are only sent to it
+ * once the simulator has emptied half of the ring and calls poll() or the ioctl.
+ *
+ * A packet longer than a slot, such as a 64 KB TCP super-packet, spans consecutive
+ * slots. Every slot but the last is full and has VNIC_NETSIM_DESC_MORE set. The first
+ * descriptor of a packet carries a virtio_net_hdr describing checksum and segmentation
+ * offloads still to be done, so that packets cross the simulator unsegmented and
+ * without their checksums filled in. The simulator must keep the header with the
+ * packet, and pass it back unchanged when sending the packet on.
+ *
+ * When the module is loaded with netsim_shards greater than 1, packets are spread over
+ * the shards by a hash of their flow, and the device can be opened once per shard, by
+ * one simulator process or thread each. Every open gets the rings of the lowest shard
+ * not already open, reported by VNIC_NETSIM_IOC_INFO.
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#ifndef VNIC_NETSIM_H
+#define VNIC_NETSIM_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/virtio_net.h>
+
+#define VNIC_NETSIM_VERSION 4
+#define VNIC_NETSIM_DEV_NAME "vnic_netsim"
+
+/**
+ * Indices of one ring. The producer and consumer are kept on separate cache lines
+ */
+struct vnic_netsim_ring {
+    __u32 producer;
+    __u32 producer_pad[15];
+    __u32 consumer;
+    __u32 consumer_pad[15];
+};
+
+/**
+ * Start of the mapped memory. Counters are only written by the kernel
+ */
+struct vnic_netsim_header {
+    struct vnic_netsim_ring rx;
+    struct vnic_netsim_ring tx;
+    __u64 rx_dropped; /* Packets dropped because the rx ring was full */
+    __u64 tx_invalid; /* tx slots skipped because their length was invalid */
+};
+
+// The packet continues in the next slot
+#define VNIC_NETSIM_DESC_MORE (1 << 0)
+
+/**
+ * Describes the packet, or part of a packet, in one slot
+ */
+struct vnic_netsim_desc {
+    __u32 len;   /* Bytes of packet data at the start of the slot, including the ethernet header */
+    __u32 flags; /* VNIC_NETSIM_DESC_* */
+    struct virtio_net_hdr vnet; /* Offloads, little endian. Only used in the first slot */
+    __u16 pad[3];
+    // CLOCK_MONOTONIC ns when the kernel placed the packet in the rx ring, or 0. Only
+    // set in the first slot, while latency is being measured. A simulator which copies
+    // it to the first tx slot of the packet it sends on, or leaves it 0, has the time
+    // the packet spent inside it measured as the in-netsim stage
+    __u64 tstamp;
+};
+
+/**
+ * Layout of the mapped memory, returned by VNIC_NETSIM_IOC_INFO.
+ * Offsets are in bytes from the start of the mapping
+ */
+struct vnic_netsim_info {
+    __u32 version;
+    __u32 slots;     /* Number of slots in each ring, a power of 2 */
+    __u32 slot_size; /* Bytes of packet data each slot can hold */
+    __u32 shard;     /* Shard of the network simulator the rings belong to */
+    __u64 mmap_size;
+    __u64 rx_desc_offset; /* Array of slots descriptors */
+    __u64 tx_desc_offset;
+    __u64 rx_data_offset; /* Array of slots * slot_size bytes of packet data */
+    __u64 tx_data_offset;
+};
+
+/**
+ * A flow whose packets the kernel delivers straight to the vnic named dev, instead of to
+ * the simulator. Addresses and ports are in network byte order. Ports are 0 for
+ * protocols other than TCP and UDP. Flows are removed once they have been idle for
+ * flow_idle_timeout seconds, and when the file descriptor which added them is closed
+ */
+struct vnic_netsim_flow {
+    __be32 saddr;
+    __be32 daddr;
+    __be16 sport;
+    __be16 dport;
+    __u8 protocol;
+    __u8 pad[3];
+    char dev[16];
+};
+
+#define VNIC_NETSIM_IOC_MAGIC 'V'
+// Fills in a struct vnic_netsim_info
+#define VNIC_NETSIM_IOC_INFO _IOR(VNIC_NETSIM_IOC_MAGIC, 0, struct vnic_netsim_info)
+// Transmits the packets in the tx ring. Returns the number of slots consumed
+#define VNIC_NETSIM_IOC_TX _IO(VNIC_NETSIM_IOC_MAGIC, 1)
+// Adds a flow which bypasses the simulator, or changes the vnic of an existing one
+#define VNIC_NETSIM_IOC_FLOW_ADD _IOW(VNIC_NETSIM_IOC_MAGIC, 2, struct vnic_netsim_flow)
+// Removes a flow, so that its packets come to the simulator again. dev is ignored
+#define VNIC_NETSIM_IOC_FLOW_DEL _IOW(VNIC_NETSIM_IOC_MAGIC, 3, struct vnic_netsim_flow)
+
+#endif
@@ -0,0 +1,851 @@
+/**
+ * Packet generator, controlled through /sys/kernel/debug/vnic/pktgen
+ *
+ * Applications in the namespaces run out of CPU long before the module does, so load is
+ * generated inside the module instead. Each generator is a kernel thread attached to one
+ * vnic, which transmits through the ndo_start_xmit of the vnic as pktgen does, so its
+ * packets take the same path as packets sent by the stack: to the network simulator, or
+ * over links, routes and flows. A generator either synthesises a UDP or TCP stream,
+ * spread over a number of flows and destination addresses, at a fixed rate or as fast as
+ * the vnic takes them, or replays a pcap file at its recorded timing or faster.
+ *
+ * A generator which finds its transmit queue stopped retries the same packet until the
+ * queue is woken, so packets are only lost where they would be for the stack.
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <linux/tcp.h>
+#include <linux/in.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/fs.h>
+#include <linux/swab.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/rtnetlink.h>
+#include <net/ip.h>
+#include <net/checksum.h>
+
+#include "vnic.h"
+#include "vnic_core.h"
+
+// Packets sent with xmit_more before the batch is delivered, when the rate allows it
+#define PKTGEN_BURST 32
+// Waits shorter than this are spun rather than slept, for an accurate rate
+#define PKTGEN_SPIN_NS (20 * NSEC_PER_USEC)
+// Source ports of synthesised flows start here, and the destination port is discard
+#define PKTGEN_PORT_BASE 1024
+#define PKTGEN_DEST_PORT 9
+#define PKTGEN_MAX_FLOWS (65536 - PKTGEN_PORT_BASE)
+// The longest record which can be replayed, the largest snaplen tcpdump writes
+#define PKTGEN_MAX_RECORD 262144
+
+enum vnic_pktgen_mode {
+    VNIC_PKTGEN_UDP,
+    VNIC_PKTGEN_TCP,
+    VNIC_PKTGEN_REPLAY,
+};
+
+static const char *vnic_pktgen_mode_names[] = { "udp", "tcp", "replay" };
+
+struct vnic_pktgen {
+    struct list_head list; /* In vnic_pktgens */
+    struct net_device *dev;
+    struct task_struct *task;
+    enum vnic_pktgen_mode mode;
+    int cpu; /* CPU the thread is bound to, or -1 */
+
+    // Synthesised streams. Addresses are in host byte order
+    u32 size;  /* Bytes of each packet, including the ethernet header */
+    u32 rate;  /* Packets per second, 0 for as fast as possible */
+    u32 flows;
+    u32 saddr;
+    u32 daddr; /* First destination address, flows are spread over dsts addresses */
+    u32 dsts;
+    u64 count; /* Packets to send, 0 for no limit */
+    u32 flow;  /* Flow of the next packet */
+    u8 *template;
+
+    // Replayed pcap files
+    struct file *file;
+    loff_t pos;
+    bool swapped; /* The file was written with the other byte order */
+    bool nsec;    /* Timestamps are in ns rather than us */
+    u32 speed;    /* Times faster than recorded, 0 for as fast as possible */
+    u32 loops;    /* Times to play the file, 0 for no limit */
+    u8 *buf;
+
+    // Written by the thread, read by vnic_pktgen_show
+    u64 sent;
+    u64 bytes;
+    u64 busy;    /* Times the transmit queue was stopped */
+    u64 dropped; /* Packets not sent: memory ran out, or not IPv4 */
+    u64 start_ns;
+    u64 end_ns;  /* 0 while running */
+    int error;
+};
+
+/**
+ * Every generator, running or finished. Changed under vnic_pktgen_mutex, and under RTNL
+ * for generators being added, so that vnic_pktgen_remove_dev sees them
+ */
+static LIST_HEAD(vnic_pktgens);
+static DEFINE_MUTEX(vnic_pktgen_mutex);
+
+/**
+ * ===============================================================
+ *                          Generator thread
+ * ===============================================================
+ */
+
+/**
+ * Sleeps, then spins, until ktime_get_ns() reaches due, or the thread is being stopped
+ */
+static void vnic_pktgen_wait_until(u64 due) {
+    ktime_t expires;
+
+    if ((s64)(due - ktime_get_ns()) > PKTGEN_SPIN_NS) {
+        expires = ns_to_ktime(due - PKTGEN_SPIN_NS);
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kthread_should_stop()) {
+            schedule_hrtimeout_range(&expires, 0, HRTIMER_MODE_ABS);
+        }
+        __set_current_state(TASK_RUNNING);
+    }
+    while ((s64)(due - ktime_get_ns()) > 0 && !kthread_should_stop()) {
+        cpu_relax();
+    }
+}
+
+/**
+ * Sets the headers of an skb holding a whole ethernet frame, for it to be transmitted
+ */
+static void vnic_pktgen_set_headers(struct sk_buff *skb) {
+    skb_reset_mac_header(skb);
+    skb_set_network_header(skb, ETH_HLEN);
+    skb_set_transport_header(skb, ETH_HLEN + ip_hdrlen(skb));
+    skb->protocol = htons(ETH_P_IP);
+}
+
+/**
+ * Builds the next packet of a synthesised stream, packet n of the generator.
+ * Must be called with bottom halves disabled.
+ * Returns NULL if memory runs out
+ */
+static struct sk_buff *vnic_pktgen_build(struct vnic_pktgen *gen, u64 n) {
+    u32 l4_len = gen->size - ETH_HLEN - sizeof(struct iphdr);
+    struct net_device *dest_dev;
+    struct sk_buff *skb;
+    struct ethhdr *eth;
+    struct iphdr *iph;
+    u32 flow = gen->flow;
+    bool routed;
+
+    if (++gen->flow == gen->flows) {
+        gen->flow = 0;
+    }
+
+    skb = vnic_alloc_skb(gen->dev, gen->size);
+    if (!skb) {
+        return NULL;
+    }
+    skb_put_data(skb, gen->template, gen->size);
+    vnic_pktgen_set_headers(skb);
+
+    eth = eth_hdr(skb);
+    iph = ip_hdr(skb);
+    iph->id = htons((u16)n);
+    iph->daddr = htonl(gen->daddr + flow % gen->dsts);
+    ip_send_check(iph);
+
+    // Addressed to the vnic the packet will be delivered to, as vnic_header does
+    dest_dev = get_dev_for_ip(ntohl(iph->daddr), &routed);
+    if (dest_dev) {
+        ether_addr_copy(eth->h_dest, dest_dev->dev_addr);
+    }
+
+    // The checksum is left to be filled in, like packets sent by the stack
+    if (gen->mode == VNIC_PKTGEN_UDP) {
+        struct udphdr *uh = udp_hdr(skb);
+
+        uh->source = htons(PKTGEN_PORT_BASE + flow);
+        uh->check = ~csum_tcpudp_magic(iph->saddr, iph->daddr, l4_len, IPPROTO_UDP, 0);
+        skb_partial_csum_set(skb, skb_transport_offset(skb), offsetof(struct udphdr, check));
+    } else {
+        struct tcphdr *th = tcp_hdr(skb);
+
+        th->source = htons(PKTGEN_PORT_BASE + flow);
+        th->seq = htonl((u32)n * (l4_len - sizeof(struct tcphdr)));
+        th->check = ~csum_tcpudp_magic(iph->saddr, iph->daddr, l4_len, IPPROTO_TCP, 0);
+        skb_partial_csum_set(skb, skb_transport_offset(skb), offsetof(struct tcphdr, check));
+    }
+    return skb;
+}
+
+/**
+ * Sends a synthesised stream until count packets have been sent or the thread is stopped.
+ * Packets which are already due are sent in bursts, with xmit_more set, so that they
+ * are delivered in batches as they are for the stack
+ */
+static void vnic_pktgen_synth(struct vnic_pktgen *gen) {
+    struct sk_buff *skb = NULL;
+    u64 n = 0;
+    int i;
+
+    while (!kthread_should_stop() && (!gen->count || n < gen->count)) {
+        if (!netif_running(gen->dev)) {
+            gen->error = -ENETDOWN;
+            break;
+        }
+        if (gen->rate) {
+            vnic_pktgen_wait_until(gen->start_ns + mul_u64_u32_div(n, NSEC_PER_SEC, gen->rate));
+        }
+
+        local_bh_disable();
+        for (i = 0; i < PKTGEN_BURST && (!gen->count || n < gen->count); i++) {
+            unsigned int len;
+
+            if (i && gen->rate &&
+                ktime_get_ns() < gen->start_ns + mul_u64_u32_div(n, NSEC_PER_SEC, gen->rate)) {
+                break;
+            }
+            if (!skb) {
+                skb = vnic_pktgen_build(gen, n);
+                if (!skb) {
+                    gen->dropped++;
+                    n++;
+                    continue;
+                }
+            }
+            len = skb->len;
+            if (vnic_inject_xmit(gen->dev, skb, i < PKTGEN_BURST - 1) == NETDEV_TX_BUSY) {
+                // Keep the packet, and retry it once the queue has been woken
+                gen->busy++;
+                break;
+            }
+            skb = NULL;
+            gen->sent++;
+            gen->bytes += len;
+            n++;
+        }
+        // Deliver anything held back by xmit_more if the burst was cut short
+        vnic_batch_flush();
+        local_bh_enable();
+        cond_resched();
+    }
+    kfree_skb(skb);
+}
+
+/**
+ * Reads the next record of the pcap file into the buffer of the generator, storing its
+ * timestamp in ns and its length.
+ * Returns 1 if a record was read, 0 at the end of the file, or a negative error
+ */
+static int vnic_pktgen_read(struct vnic_pktgen *gen, u64 *tstamp, u32 *len) {
+    struct vnic_pcap_record_header header;
+    ssize_t result;
+
+    result = kernel_read(gen->file, &header, sizeof(header), &gen->pos);
+    if (result < 0) {
+        return result;
+    }
+    if (result < sizeof(header)) {
+        // The end of the file, or a record cut short by the end of a capture
+        return 0;
+    }
+    if (gen->swapped) {
+        header.ts_sec = swab32(header.ts_sec);
+        header.ts_nsec = swab32(header.ts_nsec);
+        header.incl_len = swab32(header.incl_len);
+    }
+    if (header.incl_len > PKTGEN_MAX_RECORD) {
+        return -EINVAL;
+    }
+
+    result = kernel_read(gen->file, gen->buf, header.incl_len, &gen->pos);
+    if (result < 0) {
+        return result;
+    }
+    if (result < header.incl_len) {
+        return 0;
+    }
+    *tstamp = (u64)header.ts_sec * NSEC_PER_SEC +
+              (gen->nsec ? header.ts_nsec : (u64)header.ts_nsec * NSEC_PER_USEC);
+    *len = header.incl_len;
+    return 1;
+}
+
+/**
+ * Transmits skb, retrying while the transmit queue is stopped.
+ * Returns false if the packet could not be sent because the vnic went down or the thread
+ * is being stopped, in which case the packet is freed
+ */
+static bool vnic_pktgen_send(struct vnic_pktgen *gen, struct sk_buff *skb) {
+    unsigned int len = skb->len;
+    netdev_tx_t result;
+
+    for (;;) {
+        if (!netif_running(gen->dev)) {
+            gen->error = -ENETDOWN;
+            break;
+        }
+        local_bh_disable();
+        result = vnic_inject_xmit(gen->dev, skb, false);
+        local_bh_enable();
+        if (result != NETDEV_TX_BUSY) {
+            gen->sent++;
+            gen->bytes += len;
+            return true;
+        }
+        gen->busy++;
+        if (kthread_should_stop()) {
+            break;
+        }
+        cond_resched();
+    }
+    kfree_skb(skb);
+    return false;
+}
+
+/**
+ * Replays the pcap file loops times, each time with the gaps between packets divided
+ * by speed. Records which do not hold an IPv4 packet are skipped, since vnics route by
+ * IPv4 address
+ */
+static void vnic_pktgen_replay(struct vnic_pktgen *gen) {
+    u64 first = 0, loop_start = 0, tstamp;
+    struct sk_buff *skb;
+    bool started = false;
+    u32 loop = 0;
+    u32 len;
+    int result;
+
+    while (!kthread_should_stop()) {
+        result = vnic_pktgen_read(gen, &tstamp, &len);
+        if (result < 0) {
+            gen->error = result;
+            break;
+        }
+        if (result == 0) {
+            // A file with no packets is not replayed again
+            if (!started || (gen->loops && ++loop >= gen->loops)) {
+                break;
+            }
+            gen->pos = sizeof(struct vnic_pcap_file_header);
+            started = false;
+            continue;
+        }
+
+        if (!started) {
+            first = tstamp;
+            loop_start = ktime_get_ns();
+            started = true;
+        }
+        if (gen->speed && tstamp > first) {
+            vnic_pktgen_wait_until(loop_start + div_u64(tstamp - first, gen->speed));
+        }
+
+        if (len < ETH_HLEN + sizeof(struct iphdr) ||
+            ((struct ethhdr *)gen->buf)->h_proto != htons(ETH_P_IP)) {
+            gen->dropped++;
+            continue;
+        }
+        local_bh_disable();
+        skb = vnic_alloc_skb(gen->dev, len);
+        local_bh_enable();
+        if (!skb) {
+            gen->dropped++;
+            continue;
+        }
+        skb_put_data(skb, gen->buf, len);
+        vnic_pktgen_set_headers(skb);
+        if (!vnic_pktgen_send(gen, skb)) {
+            break;
+        }
+    }
+}
+
+static int vnic_pktgen_thread(void *data) {
+    struct vnic_pktgen *gen = data;
+
+    gen->start_ns = ktime_get_ns();
+    if (gen->mode == VNIC_PKTGEN_REPLAY) {
+        vnic_pktgen_replay(gen);
+    } else {
+        vnic_pktgen_synth(gen);
+    }
+    WRITE_ONCE(gen->end_ns, ktime_get_ns());
+
+    // Wait to be stopped, so that the counters can still be read until the generator is freed
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop()) {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+/**
+ * ===============================================================
+ *                       Starting and stopping
+ * ===============================================================
+ */
+
+/**
+ * Stops the thread of a generator which has been removed from vnic_pktgens, then frees it
+ */
+static void vnic_pktgen_free(struct vnic_pktgen *gen) {
+    if (gen->task) {
+        kthread_stop(gen->task);
+    }
+    if (gen->dev) {
+        dev_put(gen->dev);
+    }
+    if (gen->file) {
+        filp_close(gen->file, NULL);
+    }
+    kvfree(gen->buf);
+    kfree(gen->template);
+    kfree(gen);
+}
+
+/**
+ * Stops and frees every generator attached to dev, or every generator if dev is NULL
+ */
+static void vnic_pktgen_remove_all(struct net_device *dev) {
+    struct vnic_pktgen *gen, *tmp;
+    LIST_HEAD(removed);
+
+    mutex_lock(&vnic_pktgen_mutex);
+    list_for_each_entry_safe(gen, tmp, &vnic_pktgens, list) {
+        if (!dev || gen->dev == dev) {
+            list_move(&gen->list, &removed);
+        }
+    }
+    mutex_unlock(&vnic_pktgen_mutex);
+
+    list_for_each_entry_safe(gen, tmp, &removed, list) {
+        vnic_pktgen_free(gen);
+    }
+}
+
+/**
+ * Stops the generators attached to dev. Must be called under RTNL, before dev is
+ * destroyed, since each generator holds a reference to its vnic
+ */
+void vnic_pktgen_remove_dev(struct net_device *dev) {
+    vnic_pktgen_remove_all(dev);
+}
+
+/**
+ * Stops and frees the generator attached to the vnic named name.
+ * Returns 0 on success, -ENOENT if the vnic has no generator
+ */
+static int vnic_pktgen_stop(const char *name) {
+    struct vnic_pktgen *gen, *found = NULL;
+
+    mutex_lock(&vnic_pktgen_mutex);
+    list_for_each_entry(gen, &vnic_pktgens, list) {
+        if (strcmp(gen->dev->name, name) == 0) {
+            found = gen;
+            list_del(&gen->list);
+            break;
+        }
+    }
+    mutex_unlock(&vnic_pktgen_mutex);
+
+    if (!found) {
+        return -ENOENT;
+    }
+    vnic_pktgen_free(found);
+    return 0;
+}
+
+/**
+ * Opens the pcap file at path for replay, and checks that it holds ethernet frames
+ * Returns 0 on success, or a negative error
+ */
+static int vnic_pktgen_open_pcap(struct vnic_pktgen *gen, const char *path) {
+    struct vnic_pcap_file_header header;
+    ssize_t result;
+
+    gen->file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(gen->file)) {
+        result = PTR_ERR(gen->file);
+        gen->file = NULL;
+        return result;
+    }
+
+    result = kernel_read(gen->file, &header, sizeof(header), &gen->pos);
+    if (result < 0) {
+        return result;
+    }
+    if (result < sizeof(header)) {
+        return -EINVAL;
+    }
+    if (header.magic == swab32(PCAP_MAGIC_USEC) || header.magic == swab32(PCAP_MAGIC_NSEC)) {
+        gen->swapped = true;
+        header.magic = swab32(header.magic);
+        header.linktype = swab32(header.linktype);
+    }
+    if (header.magic != PCAP_MAGIC_USEC && header.magic != PCAP_MAGIC_NSEC) {
+        return -EINVAL;
+    }
+    if (header.linktype != PCAP_LINKTYPE_ETHERNET) {
+        return -EPROTONOSUPPORT;
+    }
+    gen->nsec = header.magic == PCAP_MAGIC_NSEC;
+
+    gen->buf = kvmalloc(PKTGEN_MAX_RECORD, GFP_KERNEL);
+    return gen->buf ? 0 : -ENOMEM;
+}
+
+/**
+ * Builds the packet every synthesised packet of gen is copied from, with the fields
+ * which do not change from packet to packet. Must be called under RTNL.
+ * Returns 0 on success, -ENOMEM on failure
+ */
+static int vnic_pktgen_make_template(struct vnic_pktgen *gen) {
+    u32 l4_len = gen->size - ETH_HLEN - sizeof(struct iphdr);
+    struct ethhdr *eth;
+    struct iphdr *iph;
+
+    gen->template = kzalloc(gen->size, GFP_KERNEL);
+    if (!gen->template) {
+        return -ENOMEM;
+    }
+
+    eth = (struct ethhdr *)gen->template;
+    ether_addr_copy(eth->h_source, gen->dev->dev_addr);
+    ether_addr_copy(eth->h_dest, gen->dev->dev_addr);
+    eth->h_proto = htons(ETH_P_IP);
+
+    iph = (struct iphdr *)(eth + 1);
+    iph->version = 4;
+    iph->ihl = sizeof(struct iphdr) / 4;
+    iph->tot_len = htons(gen->size - ETH_HLEN);
+    iph->ttl = 64;
+    iph->saddr = htonl(gen->saddr);
+
+    if (gen->mode == VNIC_PKTGEN_UDP) {
+        struct udphdr *uh = (struct udphdr *)(iph + 1);
+
+        iph->protocol = IPPROTO_UDP;
+        uh->dest = htons(PKTGEN_DEST_PORT);
+        uh->len = htons(l4_len);
+    } else {
+        struct tcphdr *th = (struct tcphdr *)(iph + 1);
+
+        iph->protocol = IPPROTO_TCP;
+        th->dest = htons(PKTGEN_DEST_PORT);
+        th->doff = sizeof(struct tcphdr) / 4;
+        th->ack = 1;
+        th->psh = 1;
+        th->window = htons(U16_MAX);
+    }
+    return 0;
+}
+
+/**
+ * Attaches gen to the vnic named name, and starts its thread.
+ * Returns 0 on success, or a negative error
+ */
+static int vnic_pktgen_start(struct vnic_pktgen *gen, const char *name) {
+    struct net_device *dev;
+    struct vnic_pktgen *other;
+    struct task_struct *task;
+    u32 header_len;
+    int result = 0;
+
+    // Holding RTNL keeps the vnic from being destroyed until the generator is in the list
+    rtnl_lock();
+    dev = find_vnic_by_name(name);
+    if (!dev) {
+        result = -ENODEV;
+        goto out;
+    }
+    gen->dev = dev;
+
+    if (gen->mode != VNIC_PKTGEN_REPLAY) {
+        header_len = ETH_HLEN + sizeof(struct iphdr) + (gen->mode == VNIC_PKTGEN_UDP ?
+                     sizeof(struct udphdr) : sizeof(struct tcphdr));
+        if (!gen->saddr) {
+            gen->saddr = vnic_ip_addr(dev);
+        }
+        if (!gen->saddr) {
+            result = -EADDRNOTAVAIL;
+        } else if (gen->size < header_len || gen->size > ETH_HLEN + dev->mtu) {
+            result = -EMSGSIZE;
+        } else {
+            result = vnic_pktgen_make_template(gen);
+        }
+        if (result) {
+            goto out;
+        }
+    }
+
+    mutex_lock(&vnic_pktgen_mutex);
+    list_for_each_entry(other, &vnic_pktgens, list) {
+        if (other->dev == dev) {
+            result = -EBUSY;
+            goto out_unlock;
+        }
+    }
+    task = kthread_create(vnic_pktgen_thread, gen, "vnic_pktgen/%s", dev->name);
+    if (IS_ERR(task)) {
+        result = PTR_ERR(task);
+        goto out_unlock;
+    }
+    if (gen->cpu >= 0) {
+        kthread_bind(task, gen->cpu);
+    }
+    gen->task = task;
+    dev_hold(dev);
+    list_add_tail(&gen->list, &vnic_pktgens);
+    // Started before the locks are dropped, since the generator may be stopped after that
+    wake_up_process(task);
+
+out_unlock:
+    mutex_unlock(&vnic_pktgen_mutex);
+out:
+    if (result) {
+        // Not attached yet, so the reference is not dropped when gen is freed
+        gen->dev = NULL;
+    }
+    rtnl_unlock();
+    return result;
+}
+
+/**
+ * ===============================================================
+ *                             debugfs
+ * ===============================================================
+ */
+
+/**
+ * Lists each generator with what it has sent, and its average rate
+ */
+static int vnic_pktgen_show(struct seq_file *m, void *v) {
+    struct vnic_pktgen *gen;
+    u64 start_ns, end_ns, pps;
+    const char *state;
+
+    seq_printf(m, "%-15s %-6s %-7s %12s %14s %10s %10s %10s\n", "dev", "mode", "state",
+               "sent", "bytes", "busy", "dropped", "pps");
+    mutex_lock(&vnic_pktgen_mutex);
+    list_for_each_entry(gen, &vnic_pktgens, list) {
+        start_ns = READ_ONCE(gen->start_ns);
+        end_ns = READ_ONCE(gen->end_ns);
+        if (!end_ns) {
+            state = "running";
+            end_ns = ktime_get_ns();
+        } else {
+            state = gen->error ? "failed" : "done";
+        }
+        pps = start_ns && end_ns > start_ns ?
+              mul_u64_u64_div_u64(READ_ONCE(gen->sent), NSEC_PER_SEC, end_ns - start_ns) : 0;
+        seq_printf(m, "%-15s %-6s %-7s %12llu %14llu %10llu %10llu %10llu\n", gen->dev->name,
+                   vnic_pktgen_mode_names[gen->mode], state, READ_ONCE(gen->sent),
+                   READ_ONCE(gen->bytes), READ_ONCE(gen->busy), READ_ONCE(gen->dropped), pps);
+    }
+    mutex_unlock(&vnic_pktgen_mutex);
+    return 0;
+}
+
+static int vnic_pktgen_open(struct inode *inode, struct file *file) {
+    return single_open(file, vnic_pktgen_show, NULL);
+}
+
+/**
+ * Returns the next token separated by spaces or tabs from *s, or NULL if there are none
+ */
+static char *vnic_pktgen_next_token(char **s) {
+    char *token;
+
+    while ((token = strsep(s, " \t")) != NULL && !*token) {
+    }
+    return token;
+}
+
+/**
+ * Parses an IPv4 address into host byte order
+ * Returns 0 on success, -EINVAL if value is not an address
+ */
+static int vnic_pktgen_parse_ip(const char *value, u32 *ip_addr) {
+    return vnic_parse_ip(value, strlen(value), ip_addr) ? -EINVAL : 0;
+}
+
+/**
+ * Sets a parameter of gen from "param=value"
+ * Returns 0 on success, -EINVAL if the parameter is unknown or its value invalid
+ */
+static int vnic_pktgen_set_param(struct vnic_pktgen *gen, char *param) {
+    bool replay = gen->mode == VNIC_PKTGEN_REPLAY;
+    char *value = strchr(param, '=');
+
+    if (!value) {
+        return -EINVAL;
+    }
+    *value++ = '\0';
+
+    if (strcmp(param, "cpu") == 0) {
+        return kstrtoint(value, 10, &gen->cpu);
+    } else if (replay && strcmp(param, "speed") == 0) {
+        return kstrtou32(value, 10, &gen->speed);
+    } else if (replay && strcmp(param, "loops") == 0) {
+        return kstrtou32(value, 10, &gen->loops);
+    } else if (replay) {
+        return -EINVAL;
+    } else if (strcmp(param, "dst") == 0) {
+        return vnic_pktgen_parse_ip(value, &gen->daddr);
+    } else if (strcmp(param, "src") == 0) {
+        return vnic_pktgen_parse_ip(value, &gen->saddr);
+    } else if (strcmp(param, "dsts") == 0) {
+        return kstrtou32(value, 10, &gen->dsts);
+    } else if (strcmp(param, "size") == 0) {
+        return kstrtou32(value, 10, &gen->size);
+    } else if (strcmp(param, "rate") == 0) {
+        return kstrtou32(value, 10, &gen->rate);
+    } else if (strcmp(param, "flows") == 0) {
+        return kstrtou32(value, 10, &gen->flows);
+    } else if (strcmp(param, "count") == 0) {
+        return kstrtou64(value, 10, &gen->count);
+    }
+    return -EINVAL;
+}
+
+/**
+ * Starts and stops generators. Accepts one command per write:
+ *     udp <vnic> dst=<ip> [dsts=<n>] [src=<ip>] [size=<bytes>] [rate=<pps>] [flows=<n>]
+ *         [count=<n>] [cpu=<cpu>]
+ *         sends UDP packets of size bytes from vnic, including the ethernet header, to
+ *         dsts addresses starting at dst. Packets are spread over flows source ports.
+ *         rate 0 sends as fast as the vnic takes them, and count 0 sends until stopped.
+ *         src defaults to the address of the vnic
+ *     tcp <vnic> ...              the same, with TCP segments carrying PSH and ACK
+ *     replay <vnic> <path> [speed=<n>] [loops=<n>] [cpu=<cpu>]
+ *         replays the pcap file at path from vnic, speed times faster than it was
+ *         recorded, loops times. speed 0 sends as fast as possible, loops 0 until stopped
+ *     stop <vnic>                 stops the generator of vnic
+ *     clear                       stops every generator
+ * A vnic has at most one generator. cpu binds the thread of the generator to a CPU
+ */
+static ssize_t vnic_pktgen_write(struct file *file, const char __user *user_buf,
+                                 size_t count, loff_t *ppos) {
+    char buf[256];
+    char *cmd, *name, *path = NULL;
+    char *params, *param;
+    struct vnic_pktgen *gen;
+    int result;
+
+    if (count >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    if (copy_from_user(buf, user_buf, count)) {
+        return -EFAULT;
+    }
+    buf[count] = '\0';
+
+    params = strim(buf);
+    cmd = vnic_pktgen_next_token(&params);
+    if (cmd && strcmp(cmd, "clear") == 0) {
+        vnic_pktgen_remove_all(NULL);
+        return count;
+    }
+    name = vnic_pktgen_next_token(&params);
+    if (!name) {
+        return -EINVAL;
+    }
+    if (strcmp(cmd, "stop") == 0) {
+        result = vnic_pktgen_stop(name);
+        return result ? result : count;
+    }
+
+    gen = kzalloc(sizeof(struct vnic_pktgen), GFP_KERNEL);
+    if (!gen) {
+        return -ENOMEM;
+    }
+    gen->cpu = -1;
+    gen->size = ETH_ZLEN;
+    gen->flows = 1;
+    gen->dsts = 1;
+    gen->speed = 1;
+    gen->loops = 1;
+
+    if (strcmp(cmd, "udp") == 0) {
+        gen->mode = VNIC_PKTGEN_UDP;
+    } else if (strcmp(cmd, "tcp") == 0) {
+        gen->mode = VNIC_PKTGEN_TCP;
+    } else if (strcmp(cmd, "replay") == 0) {
+        gen->mode = VNIC_PKTGEN_REPLAY;
+        path = vnic_pktgen_next_token(&params);
+    } else {
+        result = -EINVAL;
+        goto err;
+    }
+
+    result = 0;
+    while (!result && (param = vnic_pktgen_next_token(&params)) != NULL) {
+        result = vnic_pktgen_set_param(gen, param);
+    }
+    if (result) {
+        goto err;
+    }
+    if (gen->cpu >= 0 && (gen->cpu >= nr_cpu_ids || !cpu_online(gen->cpu))) {
+        result = -EINVAL;
+        goto err;
+    }
+
+    if (gen->mode == VNIC_PKTGEN_REPLAY) {
+        result = path ? vnic_pktgen_open_pcap(gen, path) : -EINVAL;
+    } else if (!gen->daddr || !gen->dsts || !gen->flows || gen->flows > PKTGEN_MAX_FLOWS) {
+        result = -EINVAL;
+    }
+    if (!result) {
+        result = vnic_pktgen_start(gen, name);
+    }
+    if (!result) {
+        return count;
+    }
+
+err:
+    vnic_pktgen_free(gen);
+    return result;
+}
+
+static const struct file_operations vnic_pktgen_fops = {
+    .owner = THIS_MODULE,
+    .open = vnic_pktgen_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+    .write = vnic_pktgen_write,
+};
+
+void vnic_pktgen_debugfs_init(struct dentry *root) {
+    debugfs_create_file("pktgen", 0600, root, NULL, &vnic_pktgen_fops);
+}
+
+/**
+ * Stops every generator. The vnics stop their own generators when they are destroyed,
+ * so this only matters while they are still registered
+ */
+void vnic_pktgen_cleanup(void) {
+    vnic_pktgen_remove_all(NULL);
+}
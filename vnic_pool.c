@@ -0,0 +1,206 @@
+/**
+ * Per-CPU cache of pages for packet buffers built by the module: packets sent by the
+ * network simulator through /dev/vnic_netsim and by the packet generator, and copies
+ * made for XDP programs.
+ *
+ * Each CPU keeps a ring of pool_size pages, holding one reference to each. A packet is
+ * built around a page from the ring with build_skb(), taking a second reference which
+ * is dropped when the stack frees the packet. When the ring comes back round to a page
+ * whose only reference is the cache's own, the packet has been freed and the page is
+ * reused without going back to the page allocator. A page which is still in use is
+ * given up to the packet holding it, and replaced with a new one.
+ *
+ * Only the data buffer is recycled. build_skb() still takes the sk_buff itself from
+ * skbuff_head_cache for every packet, as kernels before 5.12 have no napi_build_skb()
+ * to draw it from a per-CPU cache.
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "vnic.h"
+
+/**
+ * Command line arguments for loading the module
+ * pool_size : int, the number of pages each CPU keeps for recycling packet buffers.
+ */
+static int pool_size = 256;
+module_param(pool_size, int, 0444);
+
+struct vnic_page_cache {
+    unsigned int next; /* The slot to take a page from next */
+    u64 hits;          /* Packets built on a recycled page */
+    u64 misses;        /* Packets which needed a new page, or were too long for one */
+    u64 busy;          /* Pages which were still in use when their slot came round */
+    struct u64_stats_sync syncp;
+    struct page *pages[];
+};
+
+static struct vnic_page_cache __percpu *vnic_page_caches;
+static int vnic_page_cache_len;
+
+/**
+ * Allocates the page caches. Pages are allocated lazily, as packets are built
+ * Returns 0 on success, -ENOMEM on failure
+ */
+int vnic_pool_init(void) {
+    int cpu;
+
+    vnic_page_cache_len = max(pool_size, 1);
+    vnic_page_caches = __alloc_percpu(struct_size((struct vnic_page_cache *)NULL, pages, vnic_page_cache_len),
+                                      __alignof__(struct vnic_page_cache));
+    if (!vnic_page_caches) {
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu) {
+        u64_stats_init(&per_cpu_ptr(vnic_page_caches, cpu)->syncp);
+    }
+    return 0;
+}
+
+/**
+ * Drops the references of the caches to their pages. Pages still held by packets are
+ * freed along with the packets
+ */
+void vnic_pool_cleanup(void) {
+    int cpu;
+    int i;
+
+    if (!vnic_page_caches) {
+        return;
+    }
+
+    for_each_possible_cpu(cpu) {
+        struct vnic_page_cache *cache = per_cpu_ptr(vnic_page_caches, cpu);
+
+        for (i = 0; i < vnic_page_cache_len; i++) {
+            if (cache->pages[i]) {
+                put_page(cache->pages[i]);
+            }
+        }
+    }
+    free_percpu(vnic_page_caches);
+    vnic_page_caches = NULL;
+}
+
+/**
+ * Takes the page in the next slot of the cache if it is free, otherwise puts a new page
+ * in the slot. The returned page holds a reference for the caller.
+ * Returns NULL if a new page is needed and cannot be allocated.
+ */
+static struct page *vnic_page_cache_get(struct vnic_page_cache *cache, bool *hit) {
+    struct page **slot = &cache->pages[cache->next];
+    struct page *page = *slot;
+
+    cache->next = (cache->next + 1) % vnic_page_cache_len;
+
+    if (page && page_ref_count(page) == 1) {
+        // Only the reference of the cache is left, so take another for the packet
+        *hit = true;
+        page_ref_inc(page);
+        return page;
+    }
+
+    *hit = false;
+    if (page) {
+        // Still held by a packet, which now owns the page
+        u64_stats_update_begin(&cache->syncp);
+        cache->busy++;
+        u64_stats_update_end(&cache->syncp);
+        put_page(page);
+        *slot = NULL;
+    }
+
+    page = dev_alloc_page();
+    if (!page) {
+        return NULL;
+    }
+    // Pages from the emergency reserves must go back as soon as possible
+    if (!page_is_pfmemalloc(page)) {
+        *slot = page;
+        page_ref_inc(page);
+    }
+    return page;
+}
+
+/**
+ * Allocates an empty skb for dev able to hold len bytes, from the page cache of this CPU
+ * if the packet fits in a page. Must be called with bottom halves disabled.
+ * Returns NULL if memory runs out.
+ */
+struct sk_buff *vnic_alloc_skb(struct net_device *dev, unsigned int len) {
+    struct vnic_page_cache *cache = this_cpu_ptr(vnic_page_caches);
+    struct sk_buff *skb = NULL;
+    struct page *page;
+    bool hit = false;
+
+    if (len <= VNIC_POOL_MAX_LEN) {
+        page = vnic_page_cache_get(cache, &hit);
+        if (page) {
+            skb = build_skb(page_address(page), PAGE_SIZE);
+            if (skb) {
+                skb_reserve(skb, VNIC_POOL_HEADROOM);
+                skb->dev = dev;
+            } else {
+                put_page(page);
+            }
+        }
+    }
+
+    u64_stats_update_begin(&cache->syncp);
+    if (hit && skb) {
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+    u64_stats_update_end(&cache->syncp);
+
+    if (!skb) {
+        skb = netdev_alloc_skb(dev, len);
+    }
+    return skb;
+}
+
+/**
+ * Lists the hits, misses and busy pages of each CPU, then the totals
+ */
+static int vnic_pool_show(struct seq_file *m, void *v) {
+    u64 total_hits = 0, total_misses = 0, total_busy = 0;
+    int cpu;
+
+    seq_printf(m, "%-6s %16s %16s %16s\n", "cpu", "hits", "misses", "busy");
+    for_each_possible_cpu(cpu) {
+        struct vnic_page_cache *cache = per_cpu_ptr(vnic_page_caches, cpu);
+        u64 hits, misses, busy;
+        unsigned int start;
+
+        do {
+            start = u64_stats_fetch_begin(&cache->syncp);
+            hits = cache->hits;
+            misses = cache->misses;
+            busy = cache->busy;
+        } while (u64_stats_fetch_retry(&cache->syncp, start));
+
+        seq_printf(m, "%-6d %16llu %16llu %16llu\n", cpu, hits, misses, busy);
+        total_hits += hits;
+        total_misses += misses;
+        total_busy += busy;
+    }
+    seq_printf(m, "%-6s %16llu %16llu %16llu\n", "total", total_hits, total_misses, total_busy);
+    return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(vnic_pool);
+
+void vnic_pool_debugfs_init(struct dentry *root) {
+    debugfs_create_file("page_cache", 0400, root, NULL, &vnic_pool_fops);
+}
@@ -0,0 +1,153 @@
+/**
+ * Tracepoints for the VNIC device file
+ * Enable with e.g. `echo 1 > /sys/kernel/debug/tracing/events/vnic/enable`
+ *
+ * Copyright (C) 2020 Samuel Bailey
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vnic
+
+#if !defined(VNIC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define VNIC_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+
+#include "vnic.h"
+
+TRACE_DEFINE_ENUM(VNIC_DROP_NO_DEST);
+TRACE_DEFINE_ENUM(VNIC_DROP_DEST_DOWN);
+TRACE_DEFINE_ENUM(VNIC_DROP_TOO_SHORT);
+TRACE_DEFINE_ENUM(VNIC_DROP_RX_FULL);
+TRACE_DEFINE_ENUM(VNIC_DROP_NO_MEM);
+TRACE_DEFINE_ENUM(VNIC_DROP_LINK_LOSS);
+TRACE_DEFINE_ENUM(VNIC_DROP_LINK_LIMIT);
+TRACE_DEFINE_ENUM(VNIC_DROP_XDP);
+
+#define show_drop_reason(reason)                             \
+    __print_symbolic(reason,                                 \
+                     { VNIC_DROP_NO_DEST, "no_dest" },       \
+                     { VNIC_DROP_DEST_DOWN, "dest_down" },   \
+                     { VNIC_DROP_TOO_SHORT, "too_short" },   \
+                     { VNIC_DROP_RX_FULL, "rx_full" },       \
+                     { VNIC_DROP_NO_MEM, "no_mem" },         \
+                     { VNIC_DROP_LINK_LOSS, "link_loss" },   \
+                     { VNIC_DROP_LINK_LIMIT, "link_limit" }, \
+                     { VNIC_DROP_XDP, "xdp" })
+
+/**
+ * A packet is transmitted by dev, and is about to be passed to dest_dev
+ */
+TRACE_EVENT(vnic_xmit,
+    TP_PROTO(const struct net_device *dev, const struct sk_buff *skb,
+             const struct iphdr *iph, const struct net_device *dest_dev),
+
+    TP_ARGS(dev, skb, iph, dest_dev),
+
+    TP_STRUCT__entry(
+        __string(name, dev->name)
+        __string(dest_name, dest_dev ? dest_dev->name : "none")
+        __field(unsigned int, len)
+        __field(u16, queue)
+        __array(u8, saddr, 4)
+        __array(u8, daddr, 4)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, dev->name);
+        __assign_str(dest_name, dest_dev ? dest_dev->name : "none");
+        __entry->len = skb->len;
+        __entry->queue = skb_get_queue_mapping(skb);
+        memcpy(__entry->saddr, &iph->saddr, 4);
+        memcpy(__entry->daddr, &iph->daddr, 4);
+    ),
+
+    TP_printk("dev=%s queue=%u len=%u saddr=%pI4 daddr=%pI4 dest=%s",
+              __get_str(name), __entry->queue, __entry->len,
+              __entry->saddr, __entry->daddr, __get_str(dest_name))
+);
+
+/**
+ * A packet is queued on receive queue queue of dev
+ */
+TRACE_EVENT(vnic_rx,
+    TP_PROTO(const struct net_device *dev, const struct sk_buff *skb, u16 queue),
+
+    TP_ARGS(dev, skb, queue),
+
+    TP_STRUCT__entry(
+        __string(name, dev->name)
+        __field(unsigned int, len)
+        __field(u16, queue)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, dev->name);
+        __entry->len = skb->len;
+        __entry->queue = queue;
+    ),
+
+    TP_printk("dev=%s queue=%u len=%u",
+              __get_str(name), __entry->queue, __entry->len)
+);
+
+/**
+ * The IP lookup table is searched for ip_addr (host byte order). dev is NULL on a miss
+ */
+TRACE_EVENT(vnic_lookup,
+    TP_PROTO(u32 ip_addr, const struct net_device *dev, int attempts),
+
+    TP_ARGS(ip_addr, dev, attempts),
+
+    TP_STRUCT__entry(
+        __field(u32, ip_addr)
+        __string(name, dev ? dev->name : "none")
+        __field(bool, hit)
+        __field(int, attempts)
+    ),
+
+    TP_fast_assign(
+        __entry->ip_addr = ip_addr;
+        __assign_str(name, dev ? dev->name : "none");
+        __entry->hit = dev != NULL;
+        __entry->attempts = attempts;
+    ),
+
+    TP_printk("ip_addr=%pI4h %s dev=%s attempts=%d",
+              &__entry->ip_addr, __entry->hit ? "hit" : "miss",
+              __get_str(name), __entry->attempts)
+);
+
+/**
+ * A packet on dev is dropped for the given vnic_drop_reason
+ */
+TRACE_EVENT(vnic_drop,
+    TP_PROTO(const struct net_device *dev, const struct sk_buff *skb, int reason),
+
+    TP_ARGS(dev, skb, reason),
+
+    TP_STRUCT__entry(
+        __string(name, dev->name)
+        __field(unsigned int, len)
+        __field(int, reason)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, dev->name);
+        __entry->len = skb->len;
+        __entry->reason = reason;
+    ),
+
+    TP_printk("dev=%s len=%u reason=%s",
+              __get_str(name), __entry->len, show_drop_reason(__entry->reason))
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vnic_trace
+#include <trace/define_trace.h>